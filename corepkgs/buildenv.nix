@@ -1,12 +1,9 @@
-with import <nix/config.nix>;
-
 { derivations, manifest }:
 
 derivation {
   name = "user-environment";
   system = builtins.currentSystem;
-  builder = perl;
-  args = [ "-w" ./buildenv.pl ];
+  builder = "builtin:buildenv";
 
   manifest = manifest;
 
@@ -22,7 +19,4 @@ derivation {
   # Building user environments remotely just causes huge amounts of
   # network traffic, so don't do that.
   preferLocalBuild = true;
-
-  # Don't build in a chroot because Nix's dependencies may not be there.
-  __noChroot = true;
 }
@@ -130,9 +130,9 @@ SV * computeFSClosure(int flipDirection, int includeOutputs, ...)
     PPCODE:
         try {
             doInit();
-            PathSet paths;
-            for (int n = 2; n < items; ++n)
-                computeFSClosure(*store, SvPV_nolen(ST(n)), paths, flipDirection, includeOutputs);
+            PathSet roots, paths;
+            for (int n = 2; n < items; ++n) roots.insert(SvPV_nolen(ST(n)));
+            computeFSClosure(*store, roots, paths, flipDirection, includeOutputs);
             for (PathSet::iterator i = paths.begin(); i != paths.end(); ++i)
                 XPUSHs(sv_2mortal(newSVpv(i->c_str(), 0)));
         } catch (Error & e) {
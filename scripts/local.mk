@@ -2,7 +2,6 @@ nix_bin_scripts := \
   $(d)/nix-build \
   $(d)/nix-channel \
   $(d)/nix-collect-garbage \
-  $(d)/nix-copy-closure \
   $(d)/nix-generate-patches \
   $(d)/nix-install-package \
   $(d)/nix-prefetch-url \
@@ -17,7 +16,6 @@ nix_substituters := \
   $(d)/download-using-manifests.pl
 
 nix_noinst_scripts := \
-  $(d)/build-remote.pl \
   $(d)/find-runtime-roots.pl \
   $(d)/nix-http-export.cgi \
   $(d)/nix-profile.sh \
@@ -30,7 +28,6 @@ profiledir = $(sysconfdir)/profile.d
 
 $(eval $(call install-file-as, $(d)/nix-profile.sh, $(profiledir)/nix.sh, 0644))
 $(eval $(call install-program-in, $(d)/find-runtime-roots.pl, $(libexecdir)/nix))
-$(eval $(call install-program-in, $(d)/build-remote.pl, $(libexecdir)/nix))
 $(foreach prog, $(nix_substituters), $(eval $(call install-program-in, $(prog), $(libexecdir)/nix/substituters)))
 $(eval $(call install-symlink, nix-build, $(bindir)/nix-shell))
 
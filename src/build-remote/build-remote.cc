@@ -0,0 +1,146 @@
+#include "shared.hh"
+#include "util.hh"
+#include "globals.hh"
+#include "misc.hh"
+#include "store-api.hh"
+#include "serve-protocol.hh"
+#include "serve-client.hh"
+#include "remote-builders.hh"
+
+#include <algorithm>
+
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+using namespace nix;
+
+
+/* Performs a build on a remote machine on behalf of the build hook
+   support in libstore, which has already chosen the machine and
+   claimed a slot on it.  Like any build hook, we read the inputs and
+   outputs of the derivation from stdin, and the builder's output goes
+   to fd 4. */
+
+
+/* Wait for the lock that prevents multiple builds from copying to
+   `host' simultaneously.  That's undesirable because we may end up
+   with N processes uploading the same missing path simultaneously,
+   dividing the effective bandwidth by N.  Don't wait forever, so that
+   a process that gets stuck while holding the lock doesn't block
+   everybody else indefinitely.  It's safe to continue after a
+   timeout, just (potentially) inefficient. */
+static int lockUpload(const string & host)
+{
+    Path path = remoteLoadDir() + "/" + host + ".upload-lock";
+    AutoCloseFD fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd == -1) throw SysError(format("opening lock file ‘%1%’") % path);
+
+    for (int n = 0; n < 15 * 60; ++n) {
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) return fd.borrow();
+        if (errno != EWOULDBLOCK) throw SysError(format("acquiring lock on ‘%1%’") % path);
+        sleep(1);
+    }
+
+    printMsg(lvlError, format("somebody is hogging ‘%1%’, continuing...") % path);
+    unlink(path.c_str());
+    return -1;
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        /* Make sure that we don't get any SSH passphrase or host key
+           popups - if there is any problem it should fail, not do
+           something interactive. */
+        setenv("DISPLAY", "", 1);
+        setenv("SSH_ASKPASS", "", 1);
+
+        if (argc != 7) throw UsageError("invalid arguments");
+        string host = argv[1];
+        string sshKey = argv[2];
+        Path drvPath = argv[3];
+        int maxSilentTime, printBuildTrace, buildTimeout;
+        if (!string2Int(argv[4], maxSilentTime) ||
+            !string2Int(argv[5], printBuildTrace) ||
+            !string2Int(argv[6], buildTimeout))
+            throw UsageError("invalid arguments");
+
+        PathSet inputs = tokenizeString<PathSet>(readLine(STDIN_FILENO));
+        PathSet outputs = tokenizeString<PathSet>(readLine(STDIN_FILENO));
+
+        if (printBuildTrace)
+            printMsg(lvlError, format("@ build-remote %1% %2%") % drvPath % host);
+
+        settings.update();
+
+        store = openStore();
+
+        /* Our parent holds the locks on the outputs, so importing them
+           (or building them, if the ‘remote’ side is this machine)
+           must not lock them again. */
+        setenv("NIX_HELD_LOCKS", concatStringsSep(" ", outputs).c_str(), 1);
+
+        ServeConnection conn;
+        openServeConnection(conn, host, remoteSshOptions(sshKey), 4);
+        setServeCompression(conn, streamingCodecs());
+
+        /* Copy the derivation and its dependencies to the build
+           machine. */
+        {
+            AutoCloseFD uploadLock = lockUpload(host);
+
+            PathSet closure = inputs;
+            closure.insert(drvPath);
+            PathSet present = queryRemoteValidPaths(conn, closure, true, false);
+
+            Paths sorted = topoSortPaths(*store, closure), missing;
+            std::reverse(sorted.begin(), sorted.end());
+            for (auto & i : sorted)
+                if (present.find(i) == present.end()) missing.push_back(i);
+
+            if (!missing.empty()) {
+                printMsg(lvlTalkative, format("copying %1% missing paths to ‘%2%’...")
+                    % missing.size() % host);
+                bool sign = pathExists(settings.nixConfDir + "/signing-key.sec");
+                exportToServe(conn, *store, missing, sign);
+            }
+        }
+
+        /* Perform the build. */
+        printMsg(lvlError, format("building ‘%1%’ on ‘%2%’") % drvPath % host);
+        if (printBuildTrace)
+            printMsg(lvlError, format("@ build-remote-start %1% %2%") % drvPath % host);
+        writeInt(cmdBuildPaths, conn.to);
+        writeStrings(singleton<PathSet>(drvPath), conn.to);
+        writeInt(maxSilentTime, conn.to);
+        writeInt(buildTimeout, conn.to);
+        conn.to.flush();
+        int res = readInt(conn.from);
+        if (printBuildTrace)
+            printMsg(lvlError, format("@ build-remote-done %1% %2%") % drvPath % host);
+        if (res != 0) {
+            string msg = readString(conn.from);
+            printMsg(lvlError, format("error: %1% on ‘%2%’") % msg % host);
+            throw Exit(res);
+        }
+
+        /* Copy the outputs from the build machine. */
+        PathSet missing;
+        for (auto & i : outputs)
+            if (!store->isValidPath(i)) missing.insert(i);
+        if (!missing.empty()) {
+            writeInt(cmdExportPaths, conn.to);
+            writeInt(0, conn.to);
+            writeStrings(missing, conn.to);
+            conn.to.flush();
+            importFromServe(conn, *store);
+        }
+
+        closeServeConnection(conn);
+    });
+}
@@ -0,0 +1,11 @@
+programs += build-remote
+
+build-remote_DIR := $(d)
+
+build-remote_SOURCES := $(d)/build-remote.cc
+
+build-remote_INSTALL_DIR := $(libexecdir)/nix
+
+build-remote_LIBS = libmain libstore libutil libformat
+
+build-remote_LDFLAGS = -pthread
@@ -7,6 +7,8 @@
 #include "serve-protocol.hh"
 #include "worker-protocol.hh"
 #include "store-api.hh"
+#include "local-store.hh"
+#include "chunks.hh"
 
 #include <iostream>
 #include <unistd.h>
@@ -40,8 +42,54 @@ static std::pair<FdSink, FdSource> connect(const string & conn)
 }
 
 
-static void substitute(std::pair<FdSink, FdSource> & pipes, Path storePath, Path destPath)
+/* Try to fetch `storePath' as a chunk stream, taking the chunks that
+   older versions of it in the local store have from those. */
+static bool substituteChunked(std::pair<FdSink, FdSource> & pipes, Path storePath, Path destPath)
 {
+    LocalStore * localStore = dynamic_cast<LocalStore *>(store.get());
+    if (!localStore) return false;
+
+    std::shared_ptr<ChunkIndex> index;
+    ChunkHashes known;
+    try {
+        index = std::make_shared<ChunkIndex>(*localStore);
+        known = index->similarChunks(singleton<PathSet>(storePath));
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot use the chunk index: %1%") % e.msg());
+        return false;
+    }
+    if (known.empty()) return false;
+
+    writeInt(cmdDumpStorePathChunked, pipes.first);
+    writeString(storePath, pipes.first);
+    writeString(packChunkHashes(known), pipes.first);
+    pipes.first.flush();
+
+    ChunkDecoder decoder(pipes.second, *index);
+    try {
+        restorePath(destPath, decoder);
+        decoder.finish();
+    } catch (MissingChunk & e) {
+        printMsg(lvlError, format("warning: %1%; downloading ‘%2%’ in full") % e.msg() % storePath);
+        decoder.skip();
+        if (pathExists(destPath)) deletePath(destPath);
+        return false;
+    }
+
+    printMsg(lvlInfo, format("took %.2f MiB of ‘%s’ from local paths")
+        % (decoder.localSize / (1024.0 * 1024.0)) % storePath);
+    return true;
+}
+
+
+static void substitute(std::pair<FdSink, FdSource> & pipes, unsigned int serverVersion,
+    Path storePath, Path destPath)
+{
+    if (GET_PROTOCOL_MINOR(serverVersion) >= 3 && substituteChunked(pipes, storePath, destPath)) {
+        std::cout << std::endl;
+        return;
+    }
+
     writeInt(cmdDumpStorePath, pipes.first);
     writeString(storePath, pipes.first);
     pipes.first.flush();
@@ -120,7 +168,7 @@ int main(int argc, char * * argv)
         unsigned int magic = readInt(pipes.second);
         if (magic != SERVE_MAGIC_2)
             throw Error("protocol mismatch");
-        readInt(pipes.second); // Server version, unused for now
+        unsigned int serverVersion = readInt(pipes.second);
         writeInt(SERVE_PROTOCOL_VERSION, pipes.first);
         pipes.first.flush();
 
@@ -133,7 +181,8 @@ int main(int argc, char * * argv)
             Path storePath = argv[2];
             Path destPath = argv[3];
             printMsg(lvlError, format("downloading ‘%1%’ via SSH from ‘%2%’...") % storePath % host);
-            substitute(pipes, storePath, destPath);
+            store = openStore();
+            substitute(pipes, serverVersion, storePath, destPath);
         }
         else
             throw UsageError(format("download-via-ssh: unknown command ‘%1%’") % arg);
@@ -9,8 +9,10 @@
 #include <algorithm>
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 
 #if HAVE_BOEHMGC
 
@@ -23,6 +25,7 @@
 
 #define GC_STRDUP strdup
 #define GC_MALLOC malloc
+#define GC_MALLOC_ATOMIC malloc
 
 #define NEW new
 
@@ -192,7 +195,7 @@ EvalState::EvalState(const Strings & _searchPath)
 {
     nrEnvs = nrValuesInEnvs = nrValues = nrListElems = 0;
     nrAttrsets = nrAttrsInAttrsets = nrOpUpdates = nrOpUpdateValuesCopied = 0;
-    nrListConcats = nrPrimOpCalls = nrFunctionCalls = 0;
+    nrListConcats = nrPrimOpCalls = nrFunctionCalls = nrFileCacheHits = 0;
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
 #if HAVE_BOEHMGC
@@ -247,6 +250,8 @@ EvalState::EvalState(const Strings & _searchPath)
 EvalState::~EvalState()
 {
     fileEvalCache.clear();
+    for (auto & i : mappedFiles)
+        munmap(i.second, i.first.size + 1);
     printCanaries();
 }
 
@@ -572,6 +577,128 @@ void EvalState::evalFile(const Path & path, Value & v)
 void EvalState::resetFileCache()
 {
     fileEvalCache.clear();
+    readFileCache.clear();
+    readDirCache.clear();
+}
+
+
+EvalState::FileKey::FileKey(const struct stat & st)
+    : dev(st.st_dev), ino(st.st_ino), size(st.st_size)
+    , mtime(st.st_mtime), ctime(st.st_ctime)
+#if HAVE_STRUCT_STAT_ST_MTIM
+    , mtimeNsec(st.st_mtim.tv_nsec), ctimeNsec(st.st_ctim.tv_nsec)
+#else
+    , mtimeNsec(0), ctimeNsec(0)
+#endif
+{
+}
+
+
+bool EvalState::FileKey::operator < (const FileKey & k) const
+{
+    if (dev != k.dev) return dev < k.dev;
+    if (ino != k.ino) return ino < k.ino;
+    if (size != k.size) return size < k.size;
+    if (mtime != k.mtime) return mtime < k.mtime;
+    if (mtimeNsec != k.mtimeNsec) return mtimeNsec < k.mtimeNsec;
+    if (ctime != k.ctime) return ctime < k.ctime;
+    return ctimeNsec < k.ctimeNsec;
+}
+
+
+/* Files in the store at least this large are mapped into memory
+   rather than read. */
+static const size_t mapThreshold = 1024 * 1024;
+
+
+/* Map a file into memory as a NUL-terminated string.  The file is
+   mapped over anonymous memory that is one byte larger, so the
+   terminator is there even if the size is a multiple of the page
+   size.  Since the contents are shared with the page cache, this is
+   only safe for files that cannot change, i.e. those in the store. */
+static char * mapFile(int fd, size_t size, const Path & path)
+{
+    void * p = mmap(0, size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw SysError(format("mapping ‘%1%’") % path);
+    if (mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(p, size + 1);
+        throw SysError(format("mapping ‘%1%’") % path);
+    }
+    return (char *) p;
+}
+
+
+void EvalState::readFile(const Path & path, Value & v)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening file ‘%1%’") % path);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) throw SysError(format("getting status of ‘%1%’") % path);
+
+    FileKey key(st);
+    auto i = readFileCache.find(key);
+    if (i != readFileCache.end()) {
+        nrFileCacheHits++;
+        v = i->second;
+        return;
+    }
+
+    /* Read the file straight into memory owned by the string, rather
+       than via a std::string.  Large files are mapped if they're
+       really in the store, i.e. not reached through a symlink from
+       the store to somewhere else. */
+    size_t size = st.st_size;
+    char * s;
+    if (size >= mapThreshold && isInStore(canonPath(path, true))) {
+        auto j = mappedFiles.find(key);
+        if (j == mappedFiles.end())
+            j = mappedFiles.insert(std::make_pair(key, mapFile(fd, size, path))).first;
+        s = j->second;
+    } else {
+        s = (char *) GC_MALLOC_ATOMIC(size + 1);
+        if (!s) throw std::bad_alloc();
+        readFull(fd, (unsigned char *) s, size);
+        s[size] = 0;
+    }
+
+    mkStringNoCopy(v, s);
+    readFileCache[key] = v;
+}
+
+
+void EvalState::readDir(const Path & path, Value & v)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError(format("getting status of ‘%1%’") % path);
+
+    FileKey key(st);
+    auto i = readDirCache.find(key);
+    if (i != readDirCache.end()) {
+        nrFileCacheHits++;
+        v = i->second;
+        return;
+    }
+
+    DirEntries entries = readDirectory(path);
+    mkAttrs(v, entries.size());
+
+    for (auto & ent : entries) {
+        Value * ent_val = allocAttr(v, symbols.create(ent.name));
+        /* Only stat the entry if the file system didn't tell us its
+           type. */
+        if (ent.type == DT_UNKNOWN)
+            ent.type = getFileType(path + "/" + ent.name);
+        mkStringNoCopy(*ent_val,
+            ent.type == DT_REG ? "regular" :
+            ent.type == DT_DIR ? "directory" :
+            ent.type == DT_LNK ? "symlink" :
+            "unknown");
+    }
+
+    v.attrs->sort();
+    readDirCache[key] = v;
 }
 
 
@@ -1481,6 +1608,7 @@ void EvalState::printStats()
     printMsg(v, format("  number of attr lookups: %1%") % nrLookups);
     printMsg(v, format("  number of primop calls: %1%") % nrPrimOpCalls);
     printMsg(v, format("  number of function calls: %1%") % nrFunctionCalls);
+    printMsg(v, format("  files and directories read from cache: %1%") % nrFileCacheHits);
     printMsg(v, format("  total allocations: %1% bytes") % (bEnvs + bLists + bValues + bAttrsets));
 
     if (countCalls) {
@@ -7,6 +7,8 @@
 
 #include <map>
 
+#include <sys/stat.h>
+
 #if HAVE_BOEHMGC
 #include <gc/gc_allocator.h>
 #endif
@@ -144,6 +146,33 @@ private:
 #endif
     FileEvalCache fileEvalCache;
 
+    /* Caches for builtins.readFile and builtins.readDir, keyed by the
+       identity, size, and modification and status change times of
+       the file or directory, so that a file that is modified during
+       evaluation is read again. */
+    struct FileKey
+    {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        time_t mtime, ctime;
+        long mtimeNsec, ctimeNsec;
+        FileKey(const struct stat & st);
+        bool operator < (const FileKey & k) const;
+    };
+#if HAVE_BOEHMGC
+    typedef std::map<FileKey, Value, std::less<FileKey>, traceable_allocator<std::pair<const FileKey, Value> > > FileContentsCache;
+#else
+    typedef std::map<FileKey, Value> FileContentsCache;
+#endif
+    FileContentsCache readFileCache, readDirCache;
+
+    /* Large store files that have been mapped into memory by
+       readFile().  Strings may still point into them after their
+       cache entries are gone, so they're kept (and reused) until the
+       EvalState is destroyed. */
+    std::map<FileKey, char *> mappedFiles;
+
     SearchPath searchPath;
 
 public:
@@ -167,6 +196,12 @@ public:
 
     void resetFileCache();
 
+    /* Return the contents of a file as a string, or the names and
+       types of the entries of a directory as an attribute set, as
+       builtins.readFile and builtins.readDir do. */
+    void readFile(const Path & path, Value & v);
+    void readDir(const Path & path, Value & v);
+
     /* Look up a file in the search path. */
     Path findFile(const string & path);
     Path findFile(SearchPath & searchPath, const string & path);
@@ -302,6 +337,7 @@ private:
     unsigned long nrListConcats;
     unsigned long nrPrimOpCalls;
     unsigned long nrFunctionCalls;
+    unsigned long nrFileCacheHits;
 
     bool countCalls;
 
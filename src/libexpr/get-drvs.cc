@@ -177,11 +177,11 @@ typedef set<Bindings *> Done;
 
 
 /* Evaluate value `v'.  If it evaluates to a set of type `derivation',
-   then put information about it in `drvs' (unless it's already in
+   then pass information about it to `callback' (unless it's already in
    `doneExprs').  The result boolean indicates whether it makes sense
    for the caller to recursively search for derivations in `v'. */
 static bool getDerivation(EvalState & state, Value & v,
-    const string & attrPath, DrvInfos & drvs, Done & done,
+    const string & attrPath, const DrvCallback & callback, Done & done,
     bool ignoreAssertionFailures)
 {
     try {
@@ -203,7 +203,7 @@ static bool getDerivation(EvalState & state, Value & v,
             i2 == v.attrs->end() ? "unknown" : state.forceStringNoCtx(*i2->value, *i2->pos),
             v.attrs);
 
-        drvs.push_back(drv);
+        callback(drv);
         return false;
 
     } catch (AssertionError & e) {
@@ -218,7 +218,8 @@ bool getDerivation(EvalState & state, Value & v, DrvInfo & drv,
 {
     Done done;
     DrvInfos drvs;
-    getDerivation(state, v, "", drvs, done, ignoreAssertionFailures);
+    getDerivation(state, v, "", [&](DrvInfo & i) { drvs.push_back(i); },
+        done, ignoreAssertionFailures);
     if (drvs.size() != 1) return false;
     drv = drvs.front();
     return true;
@@ -233,14 +234,14 @@ static string addToPath(const string & s1, const string & s2)
 
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
-    DrvInfos & drvs, Done & done,
+    const DrvCallback & callback, Done & done,
     bool ignoreAssertionFailures)
 {
     Value v;
     state.autoCallFunction(autoArgs, vIn, v);
 
     /* Process the expression. */
-    if (!getDerivation(state, v, pathPrefix, drvs, done, ignoreAssertionFailures)) ;
+    if (!getDerivation(state, v, pathPrefix, callback, done, ignoreAssertionFailures)) ;
 
     else if (v.type == tAttrs) {
 
@@ -263,15 +264,15 @@ static void getDerivations(EvalState & state, Value & vIn,
             string pathPrefix2 = addToPath(pathPrefix, i->first);
             Value & v2(*v.attrs->find(i->second)->value);
             if (combineChannels)
-                getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-            else if (getDerivation(state, v2, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
+                getDerivations(state, v2, pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
+            else if (getDerivation(state, v2, pathPrefix2, callback, done, ignoreAssertionFailures)) {
                 /* If the value of this attribute is itself a set,
                    should we recurse into it?  => Only if it has a
                    `recurseForDerivations = true' attribute. */
                 if (v2.type == tAttrs) {
                     Bindings::iterator j = v2.attrs->find(state.symbols.create("recurseForDerivations"));
                     if (j != v2.attrs->end() && state.forceBool(*j->value))
-                        getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+                        getDerivations(state, v2, pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
                 }
             }
         }
@@ -282,8 +283,8 @@ static void getDerivations(EvalState & state, Value & vIn,
             startNest(nest, lvlDebug,
                 format("evaluating list element"));
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
-            if (getDerivation(state, *v.list.elems[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
-                getDerivations(state, *v.list.elems[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+            if (getDerivation(state, *v.list.elems[n], pathPrefix2, callback, done, ignoreAssertionFailures))
+                getDerivations(state, *v.list.elems[n], pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
         }
     }
 
@@ -295,7 +296,16 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
 {
     Done done;
-    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
+    getDerivations(state, v, pathPrefix, autoArgs,
+        [&](DrvInfo & drv) { drvs.push_back(drv); }, done, ignoreAssertionFailures);
+}
+
+
+void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, const DrvCallback & callback, bool ignoreAssertionFailures)
+{
+    Done done;
+    getDerivations(state, v, pathPrefix, autoArgs, callback, done, ignoreAssertionFailures);
 }
 
 
@@ -4,6 +4,7 @@
 
 #include <string>
 #include <map>
+#include <functional>
 
 
 namespace nix {
@@ -87,5 +88,13 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
     bool ignoreAssertionFailures);
 
+/* Like getDerivations() above, but pass each derivation to `callback'
+   as soon as it has been found rather than collecting them. */
+typedef std::function<void(DrvInfo & drv)> DrvCallback;
+
+void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, const DrvCallback & callback,
+    bool ignoreAssertionFailures);
+
 
 }
@@ -2,133 +2,197 @@
 #include "json-to-value.hh"
 
 #include <cstring>
+#include <algorithm>
 
-namespace nix {
-
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
-static void skipWhitespace(const char * & s)
-{
-    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
-}
+namespace nix {
 
 
 #if HAVE_BOEHMGC
 typedef std::vector<Value *, gc_allocator<Value *> > ValueVector;
-typedef std::map<Symbol, Value *, std::less<Symbol>, gc_allocator<Value *> > ValueMap;
+typedef std::vector<Attr, gc_allocator<Attr> > AttrVector;
 #else
 typedef std::vector<Value *> ValueVector;
-typedef std::map<Symbol, Value *> ValueMap;
+typedef std::vector<Attr> AttrVector;
 #endif
 
 
-static string parseJSONString(const char * & s)
+/* Return the first double quote or backslash in [p, end), or `end'.
+   This is where the parser spends most of its time on typical
+   inputs, so look at 16 bytes at a time if we can. */
+static const char * findStringEnd(const char * p, const char * end)
 {
-    string res;
-    if (*s++ != '"') throw JSONParseError("expected JSON string");
-    while (*s != '"') {
-        if (!*s) throw JSONParseError("got end-of-string in JSON string");
-        if (*s == '\\') {
-            s++;
-            if (*s == '"') res += '"';
-            else if (*s == '\\') res += '\\';
-            else if (*s == '/') res += '/';
-            else if (*s == '/') res += '/';
-            else if (*s == 'b') res += '\b';
-            else if (*s == 'f') res += '\f';
-            else if (*s == 'n') res += '\n';
-            else if (*s == 'r') res += '\r';
-            else if (*s == 't') res += '\t';
-            else if (*s == 'u') throw JSONParseError("\\u characters in JSON strings are currently not supported");
-            else throw JSONParseError("invalid escaped character in JSON string");
-            s++;
-        } else
-            res += *s++;
+#if __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p != end && *p != '"' && *p != '\\') p++;
+    return p;
+}
+
+
+struct JSONParser
+{
+    EvalState & state;
+    const char * s, * end;
+
+    /* The elements and members of the arrays and objects that are
+       being parsed.  Each array or object uses the top of the stack
+       and pops its entries when it's done, so nested values don't
+       need containers of their own.  These must be visible to the
+       garbage collector. */
+    ValueVector values;
+    AttrVector attrs;
+
+    /* Scratch space for strings. */
+    string buf;
+
+    JSONParser(EvalState & state, const string & s)
+        : state(state), s(s.c_str()), end(s.c_str() + s.size()) { }
+
+    void skipWhitespace()
+    {
+        while (s != end && (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')) s++;
+    }
+
+    /* Parse a JSON string into `buf'. */
+    void parseString();
+
+    void parseValue(Value & v);
+};
+
+
+void JSONParser::parseString()
+{
+    buf.clear();
+    if (s == end || *s++ != '"') throw JSONParseError("expected JSON string");
+    while (true) {
+        const char * p = findStringEnd(s, end);
+        buf.append(s, p - s);
+        s = p;
+        if (s == end) throw JSONParseError("got end-of-string in JSON string");
+        if (*s == '"') break;
+        s++;
+        if (s == end) throw JSONParseError("got end-of-string in JSON string");
+        if (*s == '"') buf += '"';
+        else if (*s == '\\') buf += '\\';
+        else if (*s == '/') buf += '/';
+        else if (*s == 'b') buf += '\b';
+        else if (*s == 'f') buf += '\f';
+        else if (*s == 'n') buf += '\n';
+        else if (*s == 'r') buf += '\r';
+        else if (*s == 't') buf += '\t';
+        else if (*s == 'u') throw JSONParseError("\\u characters in JSON strings are currently not supported");
+        else throw JSONParseError("invalid escaped character in JSON string");
+        s++;
     }
     s++;
-    return res;
 }
 
 
-static void parseJSON(EvalState & state, const char * & s, Value & v)
+void JSONParser::parseValue(Value & v)
 {
-    skipWhitespace(s);
+    skipWhitespace();
 
-    if (!*s) throw JSONParseError("expected JSON value");
+    if (s == end) throw JSONParseError("expected JSON value");
 
     if (*s == '[') {
         s++;
-        ValueVector values;
-        values.reserve(128);
-        skipWhitespace(s);
-        while (1) {
-            if (values.empty() && *s == ']') break;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            values.push_back(v2);
-            skipWhitespace(s);
-            if (*s == ']') break;
-            if (*s != ',') throw JSONParseError("expected ‘,’ or ‘]’ after JSON array element");
+        size_t start = values.size();
+        skipWhitespace();
+        if (s != end && *s == ']')
             s++;
-        }
-        s++;
-        state.mkList(v, values.size());
-        for (size_t n = 0; n < values.size(); ++n)
-            v.list.elems[n] = values[n];
+        else
+            while (true) {
+                Value * v2 = state.allocValue();
+                parseValue(*v2);
+                values.push_back(v2);
+                skipWhitespace();
+                if (s == end) throw JSONParseError("expected ‘,’ or ‘]’ after JSON array element");
+                if (*s++ == ']') break;
+                if (s[-1] != ',') throw JSONParseError("expected ‘,’ or ‘]’ after JSON array element");
+            }
+        state.mkList(v, values.size() - start);
+        std::copy(values.begin() + start, values.end(), v.list.elems);
+        values.resize(start);
     }
 
     else if (*s == '{') {
         s++;
-        ValueMap attrs;
-        while (1) {
-            skipWhitespace(s);
-            if (attrs.empty() && *s == '}') break;
-            string name = parseJSONString(s);
-            skipWhitespace(s);
-            if (*s != ':') throw JSONParseError("expected ‘:’ in JSON object");
+        size_t start = attrs.size();
+        skipWhitespace();
+        if (s != end && *s == '}')
             s++;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            attrs[state.symbols.create(name)] = v2;
-            skipWhitespace(s);
-            if (*s == '}') break;
-            if (*s != ',') throw JSONParseError("expected ‘,’ or ‘}’ after JSON member");
-            s++;
-        }
-        state.mkAttrs(v, attrs.size());
-        for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second));
-        v.attrs->sort();
-        s++;
+        else
+            while (true) {
+                skipWhitespace();
+                parseString();
+                Symbol name = state.symbols.create(buf);
+                skipWhitespace();
+                if (s == end || *s != ':') throw JSONParseError("expected ‘:’ in JSON object");
+                s++;
+                Value * v2 = state.allocValue();
+                parseValue(*v2);
+                attrs.push_back(Attr(name, v2));
+                skipWhitespace();
+                if (s == end) throw JSONParseError("expected ‘,’ or ‘}’ after JSON member");
+                if (*s++ == '}') break;
+                if (s[-1] != ',') throw JSONParseError("expected ‘,’ or ‘}’ after JSON member");
+            }
+
+        /* Sort the members once, in the order used by Bindings.  If
+           a name occurs more than once, the last occurrence wins. */
+        AttrVector::iterator first = attrs.begin() + start;
+        std::stable_sort(first, attrs.end());
+        size_t count = 0;
+        for (AttrVector::iterator i = first; i != attrs.end(); ++i)
+            if (i + 1 == attrs.end() || (i + 1)->name != i->name) count++;
+        state.mkAttrs(v, count);
+        for (AttrVector::iterator i = first; i != attrs.end(); ++i)
+            if (i + 1 == attrs.end() || (i + 1)->name != i->name)
+                v.attrs->push_back(*i);
+        attrs.resize(start);
     }
 
     else if (*s == '"') {
-        mkString(v, parseJSONString(s));
+        parseString();
+        mkString(v, buf);
     }
 
     else if (isdigit(*s) || *s == '-') {
         bool neg = false;
         if (*s == '-') {
             neg = true;
-            if (!*++s) throw JSONParseError("unexpected end of JSON number");
+            if (++s == end) throw JSONParseError("unexpected end of JSON number");
         }
         NixInt n = 0;
         // FIXME: detect overflow
-        while (isdigit(*s)) n = n * 10 + (*s++ - '0');
-        if (*s == '.' || *s == 'e') throw JSONParseError("floating point JSON numbers are not supported");
+        while (s != end && isdigit(*s)) n = n * 10 + (*s++ - '0');
+        if (s != end && (*s == '.' || *s == 'e')) throw JSONParseError("floating point JSON numbers are not supported");
         mkInt(v, neg ? -n : n);
     }
 
-    else if (strncmp(s, "true", 4) == 0) {
+    else if (end - s >= 4 && strncmp(s, "true", 4) == 0) {
         s += 4;
         mkBool(v, true);
     }
 
-    else if (strncmp(s, "false", 5) == 0) {
+    else if (end - s >= 5 && strncmp(s, "false", 5) == 0) {
         s += 5;
         mkBool(v, false);
     }
 
-    else if (strncmp(s, "null", 4) == 0) {
+    else if (end - s >= 4 && strncmp(s, "null", 4) == 0) {
         s += 4;
         mkNull(v);
     }
@@ -137,12 +201,14 @@ static void parseJSON(EvalState & state, const char * & s, Value & v)
 }
 
 
-void parseJSON(EvalState & state, const string & s_, Value & v)
+void parseJSON(EvalState & state, const string & s, Value & v)
 {
-    const char * s = s_.c_str();
-    parseJSON(state, s, v);
-    skipWhitespace(s);
-    if (*s) throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%") % s);
+    JSONParser parser(state, s);
+    parser.parseValue(v);
+    parser.skipWhitespace();
+    if (parser.s != parser.end)
+        throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%")
+            % string(parser.s, parser.end));
 }
 
 
@@ -3,27 +3,13 @@
 #include "util.hh"
 
 #include <cstdlib>
-#include <iomanip>
+#include <algorithm>
+#include <vector>
 
 
 namespace nix {
 
 
-void escapeJSON(std::ostream & str, const string & s)
-{
-    str << "\"";
-    foreach (string::const_iterator, i, s)
-        if (*i == '\"' || *i == '\\') str << "\\" << *i;
-        else if (*i == '\n') str << "\\n";
-        else if (*i == '\r') str << "\\r";
-        else if (*i == '\t') str << "\\t";
-        else if (*i >= 0 && *i < 32)
-            str << "\\u" << std::setfill('0') << std::setw(4) << std::hex << (uint16_t) *i << std::dec;
-        else str << *i;
-    str << "\"";
-}
-
-
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, std::ostream & str, PathSet & context)
 {
@@ -58,13 +44,17 @@ void printValueAsJSON(EvalState & state, bool strict,
             Bindings::iterator i = v.attrs->find(state.sOutPath);
             if (i == v.attrs->end()) {
                 JSONObject json(str);
-                StringSet names;
-                foreach (Bindings::iterator, i, *v.attrs)
-                    names.insert(i->name);
-                foreach (StringSet::iterator, i, names) {
-                    Attr & a(*v.attrs->find(state.symbols.create(*i)));
-                    json.attr(*i);
-                    printValueAsJSON(state, strict, *a.value, str, context);
+                /* Sort the attributes by name without copying the
+                   names. */
+                std::vector<Attr *> attrs;
+                attrs.reserve(v.attrs->size());
+                for (auto & a : *v.attrs) attrs.push_back(&a);
+                std::sort(attrs.begin(), attrs.end(), [](Attr * a, Attr * b) {
+                    return (const string &) a->name < (const string &) b->name;
+                });
+                for (auto a : attrs) {
+                    json.attr(a->name);
+                    printValueAsJSON(state, strict, *a->value, str, context);
                 }
             } else
                 printValueAsJSON(state, strict, *i->value, str, context);
@@ -8,6 +8,12 @@
 #include "util.hh"
 #include "archive.hh"
 #include "affinity.hh"
+#include "indexed-log.hh"
+#include "builtins.hh"
+#include "remote-builders.hh"
+#include "json.hh"
+#include "jobserver.hh"
+#include "names.hh"
 
 #include <map>
 #include <sstream>
@@ -50,6 +56,8 @@
 
 #define CHROOT_ENABLED HAVE_CHROOT && HAVE_UNSHARE && HAVE_SYS_MOUNT_H && defined(MS_BIND) && defined(MS_PRIVATE) && defined(CLONE_NEWNS)
 
+#define CHROOT_TEMPLATE_ENABLED CHROOT_ENABLED && HAVE_SETNS
+
 #if CHROOT_ENABLED
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -59,6 +67,7 @@
 
 #if __linux__
 #include <sys/personality.h>
+#include <sys/prctl.h>
 #endif
 
 #if HAVE_STATVFS
@@ -74,6 +83,19 @@ using std::map;
 static string pathNullDevice = "/dev/null";
 
 
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+typedef map<Path, Path> DirsInChroot; // maps target path to source path
+
+struct ChrootTemplate;
+
+
 /* Forward definition. */
 class Worker;
 struct HookInstance;
@@ -131,10 +153,17 @@ protected:
     /* Whether the goal is finished. */
     ExitCode exitCode;
 
+    /* The expected length of the critical path from this goal to the
+       end of the build: its own expected duration plus the longest
+       critical path among its waiters.  Maintained by
+       updateCriticalPath() as waiters come and go. */
+    unsigned long long criticalPath;
+
     Goal(Worker & worker) : worker(worker)
     {
         nrFailed = nrNoSubstituters = nrIncompleteClosure = 0;
         exitCode = ecBusy;
+        criticalPath = 0;
     }
 
     virtual ~Goal()
@@ -178,6 +207,20 @@ public:
 
     virtual string key() = 0;
 
+    unsigned long long getCriticalPath()
+    {
+        return criticalPath;
+    }
+
+    void updateCriticalPath();
+
+    /* How long this goal is expected to take once it has what it
+       needs, in milliseconds.  Used for scheduling. */
+    virtual unsigned long long expectedDuration()
+    {
+        return 0;
+    }
+
 protected:
     void amDone(ExitCode result);
 };
@@ -223,6 +266,11 @@ private:
     /* Goals waiting for a build slot. */
     WeakGoals wantingToBuild;
 
+    /* Whether the goals in `wantingToBuild' should be woken up once
+       the awake goals have run, because a slot has become available
+       or new goals are ready to build. */
+    bool wakeWantingToBuild;
+
     /* Child processes currently running. */
     Children children;
 
@@ -257,6 +305,13 @@ public:
 
     std::shared_ptr<HookInstance> hook;
 
+    /* Machine selection for the native build hook. */
+    std::shared_ptr<RemoteBuilders> remoteBuilders;
+
+    /* The mount namespace that chroot builds are cloned from if
+       `build-chroot-template' is set. */
+    std::shared_ptr<ChrootTemplate> chrootTemplate;
+
     Worker(LocalStore & store);
     ~Worker();
 
@@ -290,6 +345,12 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Put `goal', which has everything it needs to start building or
+       substituting, to sleep until all goals that are awake have run.
+       Then all such goals are woken up together, so that the ones on
+       the critical path can claim the available slots first. */
+    void readyToBuild(GoalPtr goal);
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
@@ -303,6 +364,11 @@ public:
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
+    /* Return `goals' ordered by the expected length of the critical
+       path from each goal to the end of the build, longest first, so
+       that slots go to the goals that hold up the most other work. */
+    std::vector<GoalPtr> prioritise(const Goals & goals);
+
     /* Wait for input to become available. */
     void waitForInput();
 
@@ -327,6 +393,31 @@ void Goal::addWaitee(GoalPtr waitee)
 {
     waitees.insert(waitee);
     addToWeakGoals(waitee->waiters, shared_from_this());
+    waitee->updateCriticalPath();
+}
+
+
+/* Recompute the critical path of this goal from those of its waiters
+   and, if it changed, that of the goals it is waiting for, and so
+   on.  This only touches the goals whose critical path actually
+   changes, and uses a work list since dependency chains can be very
+   long. */
+void Goal::updateCriticalPath()
+{
+    std::vector<GoalPtr> todo(1, shared_from_this());
+    while (!todo.empty()) {
+        GoalPtr goal = todo.back();
+        todo.pop_back();
+        unsigned long long longest = 0;
+        for (auto & i : goal->waiters) {
+            GoalPtr waiter = i.lock();
+            if (waiter) longest = std::max(longest, waiter->criticalPath);
+        }
+        unsigned long long l = goal->expectedDuration() + longest;
+        if (l == goal->criticalPath) continue;
+        goal->criticalPath = l;
+        todo.insert(todo.end(), goal->waitees.begin(), goal->waitees.end());
+    }
 }
 
 
@@ -354,6 +445,7 @@ void Goal::waiteeDone(GoalPtr waitee, ExitCode result)
             foreach (WeakGoals::iterator, j, goal->waiters)
                 if (j->lock() != shared_from_this()) waiters2.push_back(*j);
             goal->waiters = waiters2;
+            goal->updateCriticalPath();
         }
         waitees.clear();
 
@@ -582,19 +674,24 @@ struct HookInstance
     /* The process ID of the hook. */
     Pid pid;
 
-    HookInstance();
+    /* The remote build slot used by a native hook. */
+    RemoteSlotPtr slot;
+
+    /* Start `program' with the given arguments. */
+    HookInstance(const Path & program, const Strings & args);
 
     ~HookInstance();
 };
 
 
-HookInstance::HookInstance()
+HookInstance::HookInstance(const Path & program, const Strings & args)
 {
-    debug("starting build hook");
+    debug(format("starting build hook ‘%1%’") % program);
 
-    Path buildHook = getEnv("NIX_BUILD_HOOK");
-    if (string(buildHook, 0, 1) != "/") buildHook = settings.nixLibexecDir + "/nix/" + buildHook;
-    buildHook = canonPath(buildHook);
+    std::vector<const char *> cargs;
+    cargs.push_back(program.c_str());
+    for (auto & i : args) cargs.push_back(i.c_str());
+    cargs.push_back(0);
 
     /* Create a pipe to get the output of the child. */
     fromHook.create();
@@ -620,13 +717,9 @@ HookInstance::HookInstance()
         if (dup2(builderOut.writeSide, 4) == -1)
             throw SysError("dupping builder's stdout/stderr");
 
-        execl(buildHook.c_str(), buildHook.c_str(), settings.thisSystem.c_str(),
-            (format("%1%") % settings.maxSilentTime).str().c_str(),
-            (format("%1%") % settings.printBuildTrace).str().c_str(),
-            (format("%1%") % settings.buildTimeout).str().c_str(),
-            NULL);
+        execv(program.c_str(), (char * *) &cargs[0]);
 
-        throw SysError(format("executing ‘%1%’") % buildHook);
+        throw SysError(format("executing ‘%1%’") % program);
     });
 
     pid.setSeparatePG(true);
@@ -649,7 +742,27 @@ HookInstance::~HookInstance()
 //////////////////////////////////////////////////////////////////////
 
 
-typedef map<string, string> HashRewrites;
+/* Return a JSON list describing `paths' for `exportReferencesGraph'. */
+static string makeReferencesGraphJSON(StoreAPI & store, const PathSet & paths)
+{
+    std::ostringstream str;
+    {
+        JSONList list(str);
+        for (auto & info : store.queryPathInfos(paths)) {
+            list.elem();
+            JSONObject obj(str);
+            obj.attr("path", info.path);
+            obj.attr("narHash", "sha256:" + printHash32(info.hash));
+            obj.attr("narSize");
+            str << info.narSize;
+            obj.attr("references");
+            JSONList refs(str);
+            for (auto & i : info.references) refs.elem(i);
+        }
+    }
+    str << "\n";
+    return str.str();
+}
 
 
 string rewriteHashes(string s, const HashRewrites & rewrites)
@@ -725,6 +838,7 @@ private:
     FILE * fLogFile;
     BZFILE * bzLogFile;
     AutoCloseFD fdLogFile;
+    std::shared_ptr<IndexedLogWriter> indexedLogFile;
 
     /* Number of bytes received from the builder's stdout/stderr. */
     unsigned long logSize;
@@ -743,6 +857,9 @@ private:
     /* RAII object to delete the chroot directory. */
     std::shared_ptr<AutoDelete> autoDelChroot;
 
+    /* The template the chroot is cloned from, if any. */
+    std::shared_ptr<ChrootTemplate> chrootTemplate;
+
     /* All inputs that are regular files. */
     PathSet regularInputPaths;
 
@@ -753,7 +870,6 @@ private:
     GoalState state;
 
     /* Stuff we need to pass to initChild(). */
-    typedef map<Path, Path> DirsInChroot; // maps target path to source path
     DirsInChroot dirsInChroot;
     typedef map<string, string> Environment;
     Environment env;
@@ -775,6 +891,19 @@ private:
        outputs to allow hard links between outputs. */
     InodesSeen inodesSeen;
 
+    /* How long previous builds of this derivation took, in
+       milliseconds.  -1 if it hasn't been built before, -2 if we
+       haven't looked yet. */
+    long long previousDuration;
+
+    /* When the builder or the build hook was started. */
+    double buildStart;
+
+    /* Whether the builder gets the jobserver, whether the build is
+       registered with it, and whether we hold a jobserver token for
+       it. */
+    bool useJobserver, inJobserver, haveJobToken;
+
 public:
     DerivationGoal(const Path & drvPath, const StringSet & wantedOutputs, Worker & worker, BuildMode buildMode = bmNormal);
     ~DerivationGoal();
@@ -800,6 +929,8 @@ public:
     /* Add wanted outputs to an already existing derivation goal. */
     void addWantedOutputs(const StringSet & outputs);
 
+    unsigned long long expectedDuration();
+
 private:
     /* The states. */
     void init();
@@ -847,6 +978,11 @@ private:
     /* Forcibly kill the child process, if any. */
     void killChild();
 
+    void leaveJobserver();
+
+    /* Report and/or record the resources used by a local build. */
+    void reportBuildStats(const struct rusage & usage, bool succeeded);
+
     Path addHashRewrite(const Path & path);
 
     void repairClosure();
@@ -862,6 +998,11 @@ DerivationGoal::DerivationGoal(const Path & drvPath, const StringSet & wantedOut
     , bzLogFile(0)
     , useChroot(false)
     , buildMode(buildMode)
+    , previousDuration(-2)
+    , buildStart(0)
+    , useJobserver(false)
+    , inJobserver(false)
+    , haveJobToken(false)
 {
     this->drvPath = drvPath;
     state = &DerivationGoal::init;
@@ -875,14 +1016,37 @@ DerivationGoal::~DerivationGoal()
     /* Careful: we should never ever throw an exception from a
        destructor. */
     try { killChild(); } catch (...) { ignoreException(); }
+    try { leaveJobserver(); } catch (...) { ignoreException(); }
     try { deleteTmpDir(false); } catch (...) { ignoreException(); }
     try { closeLogFile(); } catch (...) { ignoreException(); }
 }
 
 
+/* The key under which the build time of a derivation is recorded:
+   its name without the version, e.g. `hello' for `hello-2.9.drv'. */
+static string buildTimeKey(const Path & drvPath)
+{
+    string name = storePathToName(drvPath);
+    if (hasSuffix(name, drvExtension))
+        name = string(name, 0, name.size() - drvExtension.size());
+    return DrvName(name).name;
+}
+
+
+unsigned long long DerivationGoal::expectedDuration()
+{
+    if (previousDuration == -2)
+        previousDuration = worker.store.queryBuildTime(buildTimeKey(drvPath));
+    /* Count derivations that haven't been built before as taking a
+       second, so that among those the longest chain goes first. */
+    return previousDuration >= 0 ? previousDuration : 1000;
+}
+
+
 void DerivationGoal::killChild()
 {
     if (pid != -1) {
+        leaveJobserver();
         worker.childTerminated(pid);
 
         if (buildUser.enabled()) {
@@ -905,6 +1069,51 @@ void DerivationGoal::killChild()
 }
 
 
+void DerivationGoal::leaveJobserver()
+{
+    if (haveJobToken) {
+        getJobserver()->release();
+        haveJobToken = false;
+    }
+    if (inJobserver) {
+        getJobserver()->buildFinished();
+        inJobserver = false;
+    }
+}
+
+
+void DerivationGoal::reportBuildStats(const struct rusage & usage, bool succeeded)
+{
+    if (hook || (!settings.printBuildTrace && !settings.recordBuildStats)) return;
+
+    BuildStats stats;
+    stats.drvPath = drvPath;
+    stats.startTime = buildStart;
+    stats.succeeded = succeeded;
+    stats.wallTime = (now() - buildStart) * 1000;
+    stats.userTime = usage.ru_utime.tv_sec * 1000ULL + usage.ru_utime.tv_usec / 1000;
+    stats.systemTime = usage.ru_stime.tv_sec * 1000ULL + usage.ru_stime.tv_usec / 1000;
+    stats.maxRSS = usage.ru_maxrss;
+    /* Block counts are in units of 512 bytes. */
+    stats.bytesRead = usage.ru_inblock * 512ULL;
+    stats.bytesWritten = usage.ru_oublock * 512ULL;
+
+    if (settings.printBuildTrace)
+        printMsg(lvlError, format("@ build-stats %1% %2%") % drvPath % showBuildStats(stats));
+
+    /* Recording the statistics is best-effort.  A database error must
+       neither fail a successful build nor, since this is also called
+       while handling a build failure, replace the build's own
+       error. */
+    if (settings.recordBuildStats)
+        try {
+            worker.store.registerBuildStats(stats);
+        } catch (Error & e) {
+            printMsg(lvlError, format("warning: %1%") % e.msg());
+        }
+}
+
+
 void DerivationGoal::cancel(bool timeout)
 {
     if (settings.printBuildTrace && timeout)
@@ -978,8 +1187,10 @@ void DerivationGoal::haveDerivation()
     /* Get the derivation. */
     drv = derivationFromPath(worker.store, drvPath);
 
+    PathSet outputPaths;
     foreach (DerivationOutputs::iterator, i, drv.outputs)
-        worker.store.addTempRoot(i->second.path);
+        outputPaths.insert(i->second.path);
+    worker.store.addTempRoots(outputPaths);
 
     /* Check what outputs paths are not already valid. */
     PathSet invalidOutputs = checkPathValidity(false, buildMode == bmRepair);
@@ -1173,6 +1384,9 @@ void DerivationGoal::inputsRealised()
 
     allPaths.insert(inputPaths.begin(), inputPaths.end());
 
+    /* Tell the garbage collector that the inputs are in use. */
+    worker.store.markPathsUsed(inputPaths);
+
     /* Is this a fixed-output derivation? */
     fixedOutput = true;
     foreach (DerivationOutputs::iterator, i, drv.outputs)
@@ -1182,7 +1396,7 @@ void DerivationGoal::inputsRealised()
        slot to become available, since we don't need one if there is a
        build hook. */
     state = &DerivationGoal::tryToBuild;
-    worker.wakeUp(shared_from_this());
+    worker.readyToBuild(shared_from_this());
 }
 
 
@@ -1239,8 +1453,13 @@ void DerivationGoal::tryToBuild()
        released when we exit this function or Nix crashes.  If we
        can't acquire the lock, then continue; hopefully some other
        goal can start a build, and if not, the main loop will sleep a
-       few seconds and then retry this goal. */
-    if (!outputLocks.lockPaths(outputPaths(drv.outputs), "", false)) {
+       few seconds and then retry this goal.  Don't lock outputs that
+       our caller already holds, which happens when we are the
+       ‘remote’ side of a build hook running on the same machine. */
+    PathSet lockedPaths = outputPaths(drv.outputs);
+    for (auto & i : tokenizeString<Strings>(getEnv("NIX_HELD_LOCKS")))
+        lockedPaths.erase(i);
+    if (!outputLocks.lockPaths(lockedPaths, "", false)) {
         worker.waitForAWhile(shared_from_this());
         return;
     }
@@ -1292,6 +1511,7 @@ void DerivationGoal::tryToBuild()
             case rpAccept:
                 /* Yes, it has started doing so.  Wait until we get
                    EOF from the hook. */
+                buildStart = now();
                 state = &DerivationGoal::buildDone;
                 return;
             case rpPostpone:
@@ -1319,12 +1539,14 @@ void DerivationGoal::tryToBuild()
     try {
 
         /* Okay, we have to build. */
+        buildStart = now();
         startBuilder();
 
     } catch (BuildError & e) {
         printMsg(lvlError, e.msg());
         outputLocks.unlock();
         buildUser.release();
+        leaveJobserver();
         if (settings.printBuildTrace)
             printMsg(lvlError, format("@ build-failed %1% - %2% %3%")
                 % drvPath % 0 % e.msg());
@@ -1365,6 +1587,8 @@ void DerivationGoal::buildDone()
        :-) */
     int status;
     pid_t savedPid;
+    struct rusage usage;
+    memset(&usage, 0, sizeof usage);
     if (hook) {
         savedPid = hook->pid;
         status = hook->pid.wait(true);
@@ -1372,12 +1596,13 @@ void DerivationGoal::buildDone()
         /* !!! this could block! security problem! solution: kill the
            child */
         savedPid = pid;
-        status = pid.wait(true);
+        status = pid.wait(true, &usage);
     }
 
     debug(format("builder process for ‘%1%’ finished") % drvPath);
 
     /* So the child is gone now. */
+    leaveJobserver();
     worker.childTerminated(savedPid);
 
     /* Close the read side of the logger pipe. */
@@ -1441,6 +1666,7 @@ void DerivationGoal::buildDone()
         registerOutputs();
 
         if (buildMode == bmCheck) {
+            reportBuildStats(usage, true);
             amDone(ecSuccess);
             return;
         }
@@ -1480,6 +1706,7 @@ void DerivationGoal::buildDone()
         }
 
         else {
+            reportBuildStats(usage, false);
             if (settings.printBuildTrace)
                 printMsg(lvlError, format("@ build-failed %1% - %2% %3%")
                     % drvPath % 1 % e.msg());
@@ -1504,6 +1731,17 @@ void DerivationGoal::buildDone()
     /* Release the build user, if applicable. */
     buildUser.release();
 
+    /* Remember how long this took for scheduling future builds.  The
+       build itself succeeded, so failing to record this shouldn't
+       make it fail. */
+    try {
+        worker.store.registerBuildTime(buildTimeKey(drvPath), (now() - buildStart) * 1000);
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: %1%") % e.msg());
+    }
+
+    reportBuildStats(usage, true);
+
     if (settings.printBuildTrace)
         printMsg(lvlError, format("@ build-succeeded %1% -") % drvPath);
 
@@ -1513,10 +1751,8 @@ void DerivationGoal::buildDone()
 
 HookReply DerivationGoal::tryBuildHook()
 {
-    if (!settings.useBuildHook || getEnv("NIX_BUILD_HOOK") == "") return rpDecline;
-
-    if (!worker.hook)
-        worker.hook = std::shared_ptr<HookInstance>(new HookInstance);
+    Path buildHook = getEnv("NIX_BUILD_HOOK");
+    if (!settings.useBuildHook || buildHook == "") return rpDecline;
 
     /* Tell the hook about system features (beyond the system type)
        required from the build machine.  (The hook could parse the
@@ -1524,45 +1760,92 @@ HookReply DerivationGoal::tryBuildHook()
     Strings features = tokenizeString<Strings>(get(drv.env, "requiredSystemFeatures"));
     foreach (Strings::iterator, i, features) checkStoreName(*i); /* !!! abuse */
 
-    /* Send the request to the hook. */
-    writeLine(worker.hook->toHook.writeSide, (format("%1% %2% %3% %4%")
-        % (worker.getNrLocalBuilds() < settings.maxBuildJobs ? "1" : "0")
-        % drv.platform % drvPath % concatStringsSep(",", features)).str());
-
-    /* Read the first line of input, which should be a word indicating
-       whether the hook wishes to perform the build. */
-    string reply;
-    while (true) {
-        string s = readLine(worker.hook->fromHook.readSide);
-        if (string(s, 0, 2) == "# ") {
-            reply = string(s, 2);
-            break;
+    bool amWilling = worker.getNrLocalBuilds() < settings.maxBuildJobs;
+
+    /* The inputs that have to be copied to the remote system.  This
+       unfortunately has to contain the entire derivation closure to
+       ensure that the validity invariant holds on the remote system.
+       (I.e., it's unfortunate that we have to list it since the
+       remote system *probably* already has it.) */
+    PathSet allInputs;
+    allInputs.insert(inputPaths.begin(), inputPaths.end());
+
+    if (isNativeBuildHook(buildHook)) {
+
+        /* The standard hook is implemented by us: we pick the
+           machine, and a helper process does the copying and
+           building. */
+        computeFSClosure(worker.store, drvPath, allInputs);
+
+        if (!worker.remoteBuilders)
+            worker.remoteBuilders = std::shared_ptr<RemoteBuilders>(new RemoteBuilders(worker.store));
+
+        bool postpone;
+        RemoteSlotPtr slot = worker.remoteBuilders->acquireSlot(drv.platform,
+            StringSet(features.begin(), features.end()), allInputs,
+            amWilling && drv.platform == settings.thisSystem, postpone);
+        if (!slot) return postpone ? rpPostpone : rpDecline;
+
+        Strings args;
+        args.push_back(slot->hostName);
+        args.push_back(slot->sshKey);
+        args.push_back(drvPath);
+        args.push_back(int2String(settings.maxSilentTime));
+        args.push_back(int2String(settings.printBuildTrace));
+        args.push_back(int2String(settings.buildTimeout));
+        hook = std::shared_ptr<HookInstance>(
+            new HookInstance(settings.nixLibexecDir + "/nix/build-remote", args));
+        hook->slot = slot;
+
+    } else {
+
+        if (string(buildHook, 0, 1) != "/") buildHook = settings.nixLibexecDir + "/nix/" + buildHook;
+        buildHook = canonPath(buildHook);
+
+        if (!worker.hook) {
+            Strings args;
+            args.push_back(settings.thisSystem);
+            args.push_back(int2String(settings.maxSilentTime));
+            args.push_back(int2String(settings.printBuildTrace));
+            args.push_back(int2String(settings.buildTimeout));
+            worker.hook = std::shared_ptr<HookInstance>(new HookInstance(buildHook, args));
         }
-        s += "\n";
-        writeToStderr(s);
-    }
 
-    debug(format("hook reply is ‘%1%’") % reply);
+        /* Send the request to the hook. */
+        writeLine(worker.hook->toHook.writeSide, (format("%1% %2% %3% %4%")
+            % (amWilling ? "1" : "0")
+            % drv.platform % drvPath % concatStringsSep(",", features)).str());
+
+        /* Read the first line of input, which should be a word
+           indicating whether the hook wishes to perform the build. */
+        string reply;
+        while (true) {
+            string s = readLine(worker.hook->fromHook.readSide);
+            if (string(s, 0, 2) == "# ") {
+                reply = string(s, 2);
+                break;
+            }
+            s += "\n";
+            writeToStderr(s);
+        }
 
-    if (reply == "decline" || reply == "postpone")
-        return reply == "decline" ? rpDecline : rpPostpone;
-    else if (reply != "accept")
-        throw Error(format("bad hook reply ‘%1%’") % reply);
+        debug(format("hook reply is ‘%1%’") % reply);
 
-    printMsg(lvlTalkative, format("using hook to build path(s) %1%") % showPaths(missingPaths));
+        if (reply == "decline" || reply == "postpone")
+            return reply == "decline" ? rpDecline : rpPostpone;
+        else if (reply != "accept")
+            throw Error(format("bad hook reply ‘%1%’") % reply);
 
-    hook = worker.hook;
-    worker.hook.reset();
+        hook = worker.hook;
+        worker.hook.reset();
 
-    /* Tell the hook all the inputs that have to be copied to the
-       remote system.  This unfortunately has to contain the entire
-       derivation closure to ensure that the validity invariant holds
-       on the remote system.  (I.e., it's unfortunate that we have to
-       list it since the remote system *probably* already has it.) */
-    PathSet allInputs;
-    allInputs.insert(inputPaths.begin(), inputPaths.end());
-    computeFSClosure(worker.store, drvPath, allInputs);
+        computeFSClosure(worker.store, drvPath, allInputs);
+    }
 
+    printMsg(lvlTalkative, format("using hook to build path(s) %1%") % showPaths(missingPaths));
+
+    /* Tell the hook all the inputs that have to be copied to the
+       remote system. */
     string s;
     foreach (PathSet::iterator, i, allInputs) { s += *i; s += ' '; }
     writeLine(hook->toHook.writeSide, s);
@@ -1598,8 +1881,253 @@ void chmod_(const Path & path, mode_t mode)
 }
 
 
+#if CHROOT_ENABLED
+
+/* Make all filesystems private.  This is necessary because subtrees
+   may have been mounted as "shared" (MS_SHARED).  (Systemd does this,
+   for instance.)  Even though we have a private mount namespace,
+   mounting filesystems on top of a shared subtree still propagates
+   outside of the namespace.  Making a subtree private is local to the
+   namespace, though, so setting MS_PRIVATE does not affect the
+   outside world. */
+static void makeMountsPrivate()
+{
+    Strings mounts = tokenizeString<Strings>(readFile("/proc/self/mountinfo", true), "\n");
+    foreach (Strings::iterator, i, mounts) {
+        vector<string> fields = tokenizeString<vector<string> >(*i, " ");
+        string fs = decodeOctalEscaped(fields.at(4));
+        if (mount(0, fs.c_str(), 0, MS_PRIVATE, 0) == -1)
+            throw SysError(format("unable to make filesystem ‘%1%’ private") % fs);
+    }
+}
+
+
+static void bindMount(const Path & source, const Path & target)
+{
+    struct stat st;
+    debug(format("bind mounting ‘%1%’ to ‘%2%’") % source % target);
+    if (stat(source.c_str(), &st) == -1)
+        throw SysError(format("getting attributes of path ‘%1%’") % source);
+    if (S_ISDIR(st.st_mode))
+        createDirs(target);
+    else {
+        createDirs(dirOf(target));
+        writeFile(target, "");
+    }
+    if (mount(source.c_str(), target.c_str(), "", MS_BIND, 0) == -1)
+        throw SysError(format("bind mount from ‘%1%’ to ‘%2%’ failed") % source % target);
+}
+
+
+/* Return whether the chroot gets a private instance of devpts, which
+   requires the kernel to be compiled with
+   CONFIG_DEVPTS_MULTIPLE_INSTANCES=y (which is the case if
+   /dev/ptx/ptmx exists). */
+static bool hasPrivatePts(const DirsInChroot & dirs)
+{
+    return pathExists("/dev/pts/ptmx")
+        && dirs.find("/dev") == dirs.end()
+        && dirs.find("/dev/ptmx") == dirs.end()
+        && dirs.find("/dev/pts") == dirs.end();
+}
+
+
+/* Set up the parts of the chroot in `root' that don't depend on the
+   build: a nearly empty /dev (unless the user asked to bind-mount the
+   host /dev), the bind mounts in `dirs', and the mount point for
+   /proc. */
+static void setUpChrootBase(const Path & root, DirsInChroot dirs)
+{
+    if (dirs.find("/dev") == dirs.end()) {
+        createDirs(root + "/dev/shm");
+        createDirs(root + "/dev/pts");
+        Strings ss;
+        ss.push_back("/dev/full");
+#ifdef __linux__
+        if (pathExists("/dev/kvm"))
+            ss.push_back("/dev/kvm");
+#endif
+        ss.push_back("/dev/null");
+        ss.push_back("/dev/random");
+        ss.push_back("/dev/tty");
+        ss.push_back("/dev/urandom");
+        ss.push_back("/dev/zero");
+        foreach (Strings::iterator, i, ss) dirs[*i] = *i;
+        createSymlink("/proc/self/fd", root + "/dev/fd");
+        createSymlink("/proc/self/fd/0", root + "/dev/stdin");
+        createSymlink("/proc/self/fd/1", root + "/dev/stdout");
+        createSymlink("/proc/self/fd/2", root + "/dev/stderr");
+        if (hasPrivatePts(dirs))
+            createSymlink("/dev/pts/ptmx", root + "/dev/ptmx");
+    }
+
+    /* Bind-mount all the directories from the "host" filesystem that
+       we want in the chroot environment. */
+    foreach (DirsInChroot::iterator, i, dirs) {
+        if (i->second == "/proc") continue; // backwards compatibility
+        bindMount(i->second, root + i->first);
+    }
+
+    createDirs(root + "/proc");
+}
+
+
+/* Mount the file systems that each build gets a fresh instance of:
+   /proc, /dev/shm and /dev/pts.  This must be done in the build's
+   own PID namespace, since a procfs shows the processes of the
+   namespace of the process that mounted it. */
+static void mountPrivateFilesystems(const Path & root, const DirsInChroot & dirs)
+{
+    if (mount("none", (root + "/proc").c_str(), "proc", 0, 0) == -1)
+        throw SysError("mounting /proc");
+
+    /* Mount a new tmpfs on /dev/shm to ensure that whatever the
+       builder puts in /dev/shm is cleaned up automatically. */
+    if (pathExists("/dev/shm") && mount("none", (root + "/dev/shm").c_str(), "tmpfs", 0, 0) == -1)
+        throw SysError("mounting /dev/shm");
+
+    /* Mount a new devpts on /dev/pts. */
+    if (hasPrivatePts(dirs)) {
+        if (mount("none", (root + "/dev/pts").c_str(), "devpts", 0, "newinstance,mode=0620") == -1)
+            throw SysError("mounting /dev/pts");
+
+        /* Make sure /dev/pts/ptmx is world-writable.  With some
+           Linux versions, it is created with permissions 0.  */
+        chmod_(root + "/dev/pts/ptmx", 0666);
+    }
+}
+
+#endif
+
+
+#if CHROOT_TEMPLATE_ENABLED
+
+/* With `build-chroot-template', the mounts that every chroot build
+   needs (/dev and `build-chroot-dirs') are set up only once,
+   in the mount namespace of a helper process that just waits until
+   the worker goes away.  Each build enters that namespace and then
+   unshares it, which gives it a private copy of all those mounts at
+   the cost of a single system call, and only has to add /etc, /tmp,
+   the store, its inputs and the per-build file systems. */
+struct ChrootTemplate
+{
+    /* The `build-chroot-dirs' that are mounted in the template. */
+    DirsInChroot dirs;
+
+    /* The root of the chroot, in the template namespace. */
+    Path root;
+    AutoDelete autoDelRoot;
+
+    /* Closing this makes the helper exit. */
+    AutoCloseFD toHelper;
+    Pid pid;
+
+    /* The helper's mount namespace. */
+    AutoCloseFD ns;
+
+    ChrootTemplate(const DirsInChroot & dirs);
+    ~ChrootTemplate();
+};
+
+
+/* Return whether `target' is mounted per build rather than in the
+   template, because it is below the directories that each build
+   replaces with its own. */
+static bool isPerBuildMount(const Path & target)
+{
+    return target == "/etc" || isInDir(target, "/etc")
+        || target == "/tmp" || isInDir(target, "/tmp")
+        || isInStore(target) || target == settings.nixStore;
+}
+
+
+ChrootTemplate::ChrootTemplate(const DirsInChroot & dirs)
+    : dirs(dirs)
+    , root(createTempDir("", "nix-chroot-template"))
+    , autoDelRoot(root)
+{
+    printMsg(lvlChatty, format("setting up chroot template in ‘%1%’") % root);
+
+    createDirs(root + "/etc");
+    createDirs(root + "/tmp");
+    createDirs(root + settings.nixStore);
+
+    Pipe toPipe, fromPipe;
+    toPipe.create();
+    fromPipe.create();
+
+    ProcessOptions options;
+    options.errorPrefix = "error setting up chroot template: ";
+    options.allowVfork = false;
+    pid = startProcess([&]() {
+        set<int> keep;
+        keep.insert(toPipe.readSide);
+        keep.insert(fromPipe.writeSide);
+        closeMostFDs(keep);
+        if (unshare(CLONE_NEWNS) == -1)
+            throw SysError("setting up a private mount namespace");
+        makeMountsPrivate();
+        setUpChrootBase(root, this->dirs);
+        writeLine(fromPipe.writeSide, "");
+        char c;
+        while (read(toPipe.readSide, &c, 1) == -1 && errno == EINTR) ;
+        _exit(0);
+    }, options);
+
+    toPipe.readSide.close();
+    fromPipe.writeSide.close();
+    toHelper = toPipe.writeSide.borrow();
+
+    try {
+        readLine(fromPipe.readSide);
+    } catch (EndOfFile & e) {
+        throw Error("unable to set up the chroot template");
+    }
+
+    Path nsPath = (format("/proc/%1%/ns/mnt") % (pid_t) pid).str();
+    ns = open(nsPath.c_str(), O_RDONLY);
+    if (ns == -1) throw SysError(format("opening ‘%1%’") % nsPath);
+    closeOnExec(ns);
+}
+
+
+ChrootTemplate::~ChrootTemplate()
+{
+    try {
+        toHelper.close();
+        pid.wait(true);
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+#endif
+
+
+#if CHROOT_ENABLED
+/* The entry point of a builder process created with clone(); this
+   does what startProcess() would. */
+int childEntry(void * arg)
+{
+    _writeToStderr = 0;
+    try {
+        if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+            throw SysError("setting death signal");
+        restoreAffinity();
+    } catch (std::exception & e) {
+        writeToStderr("while setting up the build environment: " + string(e.what()) + "\n");
+        _exit(1);
+    }
+    ((DerivationGoal *) arg)->runChild();
+    return 1;
+}
+#endif
+
+
 void DerivationGoal::startBuilder()
 {
+    double setupStart = now();
+
     startNest(nest, lvlInfo, format(
             buildMode == bmRepair ? "repairing path(s) %1%" :
             buildMode == bmCheck ? "checking path(s) %1%" :
@@ -1639,6 +2167,14 @@ void DerivationGoal::startBuilder()
     /* The maximum number of cores to utilize for parallel building. */
     env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
 
+    /* Let parallel Makes in all builds share the jobserver.  Only do
+       this for derivations that ask for it, since the jobserver makes
+       any Make run jobs in parallel.  This is not tied to
+       `enableParallelBuilding', because stdenv then also passes an
+       explicit `-j', which makes Make ignore the jobserver. */
+    useJobserver = settings.buildJobserver && get(drv.env, "enableJobserver") == "1";
+    if (useJobserver) env["MAKEFLAGS"] = getJobserver()->makeFlags();
+
     /* Add all bindings specified in the derivation. */
     foreach (StringPairs::iterator, i, drv.env)
         env[i->first] = i->second;
@@ -1686,7 +2222,12 @@ void DerivationGoal::startBuilder()
        each `pathN' will be stored in a text file `nameN' in the
        temporary build directory.  The text files have the format used
        by `nix-store --register-validity'.  However, the deriver
-       fields are left empty. */
+       fields are left empty.  If `exportReferencesGraphFormat' is
+       set to `json', the files contain a JSON list instead. */
+    string graphFormat = get(drv.env, "exportReferencesGraphFormat");
+    if (graphFormat != "" && graphFormat != "text" && graphFormat != "json")
+        throw BuildError(format("unsupported ‘exportReferencesGraphFormat’ ‘%1%’") % graphFormat);
+
     string s = get(drv.env, "exportReferencesGraph");
     Strings ss = tokenizeString<Strings>(s);
     if (ss.size() % 2 != 0)
@@ -1709,21 +2250,24 @@ void DerivationGoal::startBuilder()
            outputs as well.  This is useful if you want to do things
            like passing all build-time dependencies of some path to a
            derivation that builds a NixOS DVD image. */
-        PathSet paths, paths2;
-        computeFSClosure(worker.store, storePath, paths);
-        paths2 = paths;
+        PathSet paths, outputs;
+        computeFSClosure(worker.store, singleton<PathSet>(storePath), paths);
 
-        foreach (PathSet::iterator, j, paths2) {
+        foreach (PathSet::iterator, j, paths) {
             if (isDerivation(*j)) {
                 Derivation drv = derivationFromPath(worker.store, *j);
                 foreach (DerivationOutputs::iterator, k, drv.outputs)
-                    computeFSClosure(worker.store, k->second.path, paths);
+                    outputs.insert(k->second.path);
             }
         }
 
+        computeFSClosure(worker.store, outputs, paths);
+
         /* Write closure info to `fileName'. */
         writeFile(tmpDir + "/" + fileName,
-            worker.store.makeValidityRegistration(paths, false, false));
+            graphFormat == "json"
+            ? makeReferencesGraphJSON(worker.store, paths)
+            : worker.store.makeValidityRegistration(paths, false, false));
     }
 
 
@@ -1825,6 +2369,22 @@ void DerivationGoal::startBuilder()
             else
                 dirsInChroot[string(i, 0, p)] = string(i, p + 1);
         }
+
+#if CHROOT_TEMPLATE_ENABLED
+        /* Reuse the worker's chroot template for the directories that
+           are the same for every build, or create it if necessary. */
+        if (settings.chrootTemplate) {
+            DirsInChroot baseDirs;
+            foreach (DirsInChroot::iterator, i, dirsInChroot)
+                if (!isPerBuildMount(i->first)) baseDirs.insert(*i);
+            if (!worker.chrootTemplate || worker.chrootTemplate->dirs != baseDirs) {
+                worker.chrootTemplate.reset();
+                worker.chrootTemplate = std::make_shared<ChrootTemplate>(baseDirs);
+            }
+            chrootTemplate = worker.chrootTemplate;
+        }
+#endif
+
         dirsInChroot[tmpDir] = tmpDir;
 
         /* Make the closure of the inputs available in the chroot,
@@ -1913,12 +2473,32 @@ void DerivationGoal::startBuilder()
     /* Create a pipe to get the output of the builder. */
     builderOut.create();
 
-    /* Fork a child to build the package. */
-    ProcessOptions options;
-    options.allowVfork = !buildUser.enabled();
-    pid = startProcess([&]() {
-        runChild();
-    });
+    /* The builder's own job counts against the jobserver's budget. */
+    if (useJobserver) {
+        getJobserver()->buildStarted();
+        inJobserver = true;
+        haveJobToken = getJobserver()->acquire();
+    }
+
+    /* Fork a child to build the package.  Chroot builds get a
+       private PID namespace in which the builder is PID 1, so that
+       it can only see and signal its own processes, and so that all
+       of them are killed when it exits. */
+#if CHROOT_ENABLED
+    if (useChroot) {
+        char stack[32 * 1024];
+        pid_t child = clone(childEntry, stack + sizeof(stack) - 8, CLONE_NEWPID | SIGCHLD, this);
+        if (child == -1) throw SysError("cloning builder process");
+        pid = child;
+    } else
+#endif
+    {
+        ProcessOptions options;
+        options.allowVfork = !buildUser.enabled();
+        pid = startProcess([&]() {
+            runChild();
+        });
+    }
 
     /* parent */
     pid.setSeparatePG(true);
@@ -1930,6 +2510,11 @@ void DerivationGoal::startBuilder()
     string msg = readLine(builderOut.readSide);
     if (!msg.empty()) throw Error(msg);
 
+    unsigned int setupTime = (now() - setupStart) * 1000;
+    printMsg(lvlChatty, format("setting up the build environment took %1% ms") % setupTime);
+    if (settings.printBuildTrace)
+        printMsg(lvlError, format("@ build-setup %1% %2%") % drvPath % setupTime);
+
     if (settings.printBuildTrace) {
         printMsg(lvlError, format("@ build-started %1% - %2% %3%")
             % drvPath % drv.platform % logFile);
@@ -1992,108 +2577,61 @@ void DerivationGoal::runChild()
             char domainname[] = "(none)"; // kernel default
             setdomainname(domainname, sizeof(domainname));
 
-            /* Make all filesystems private.  This is necessary
-               because subtrees may have been mounted as "shared"
-               (MS_SHARED).  (Systemd does this, for instance.)  Even
-               though we have a private mount namespace, mounting
-               filesystems on top of a shared subtree still propagates
-               outside of the namespace.  Making a subtree private is
-               local to the namespace, though, so setting MS_PRIVATE
-               does not affect the outside world. */
-            Strings mounts = tokenizeString<Strings>(readFile("/proc/self/mountinfo", true), "\n");
-            foreach (Strings::iterator, i, mounts) {
-                vector<string> fields = tokenizeString<vector<string> >(*i, " ");
-                string fs = decodeOctalEscaped(fields.at(4));
-                if (mount(0, fs.c_str(), 0, MS_PRIVATE, 0) == -1)
-                    throw SysError(format("unable to make filesystem ‘%1%’ private") % fs);
-            }
-
-            /* Set up a nearly empty /dev, unless the user asked to
-               bind-mount the host /dev. */
-            if (dirsInChroot.find("/dev") == dirsInChroot.end()) {
-                createDirs(chrootRootDir + "/dev/shm");
-                createDirs(chrootRootDir + "/dev/pts");
-                Strings ss;
-                ss.push_back("/dev/full");
-#ifdef __linux__
-                if (pathExists("/dev/kvm"))
-                    ss.push_back("/dev/kvm");
-#endif
-                ss.push_back("/dev/null");
-                ss.push_back("/dev/random");
-                ss.push_back("/dev/tty");
-                ss.push_back("/dev/urandom");
-                ss.push_back("/dev/zero");
-                foreach (Strings::iterator, i, ss) dirsInChroot[*i] = *i;
-                createSymlink("/proc/self/fd", chrootRootDir + "/dev/fd");
-                createSymlink("/proc/self/fd/0", chrootRootDir + "/dev/stdin");
-                createSymlink("/proc/self/fd/1", chrootRootDir + "/dev/stdout");
-                createSymlink("/proc/self/fd/2", chrootRootDir + "/dev/stderr");
-            }
-
-            /* Bind-mount all the directories from the "host"
-               filesystem that we want in the chroot
-               environment. */
-            foreach (DirsInChroot::iterator, i, dirsInChroot) {
-                struct stat st;
-                Path source = i->second;
-                Path target = chrootRootDir + i->first;
-                if (source == "/proc") continue; // backwards compatibility
-                debug(format("bind mounting ‘%1%’ to ‘%2%’") % source % target);
-                if (stat(source.c_str(), &st) == -1)
-                    throw SysError(format("getting attributes of path ‘%1%’") % source);
-                if (S_ISDIR(st.st_mode))
-                    createDirs(target);
-                else {
-                    createDirs(dirOf(target));
-                    writeFile(target, "");
+#if CHROOT_TEMPLATE_ENABLED
+            if (chrootTemplate) {
+                /* Enter the namespace of the template, which we got a
+                   private copy of when we unshared it above.  Then
+                   add the per-build parts of the chroot. */
+                if (setns(chrootTemplate->ns, CLONE_NEWNS) == -1)
+                    throw SysError("entering the chroot template namespace");
+                if (unshare(CLONE_NEWNS) == -1)
+                    throw SysError("setting up a private mount namespace");
+
+                Path root = chrootTemplate->root;
+                bindMount(chrootRootDir + "/etc", root + "/etc");
+                bindMount(chrootRootDir + "/tmp", root + "/tmp");
+                bindMount(chrootRootDir + settings.nixStore, root + settings.nixStore);
+
+                foreach (DirsInChroot::iterator, i, dirsInChroot) {
+                    DirsInChroot::iterator j = chrootTemplate->dirs.find(i->first);
+                    if (j != chrootTemplate->dirs.end() && j->second == i->second) continue;
+                    bindMount(i->second, root + i->first);
                 }
-                if (mount(source.c_str(), target.c_str(), "", MS_BIND, 0) == -1)
-                    throw SysError(format("bind mount from ‘%1%’ to ‘%2%’ failed") % source % target);
-            }
 
-            /* Bind a new instance of procfs on /proc. */
-            createDirs(chrootRootDir + "/proc");
-            if (mount("none", (chrootRootDir + "/proc").c_str(), "proc", 0, 0) == -1)
-                throw SysError("mounting /proc");
-
-            /* Mount a new tmpfs on /dev/shm to ensure that whatever
-               the builder puts in /dev/shm is cleaned up automatically. */
-            if (pathExists("/dev/shm") && mount("none", (chrootRootDir + "/dev/shm").c_str(), "tmpfs", 0, 0) == -1)
-                throw SysError("mounting /dev/shm");
-
-            /* Mount a new devpts on /dev/pts.  Note that this
-               requires the kernel to be compiled with
-               CONFIG_DEVPTS_MULTIPLE_INSTANCES=y (which is the case
-               if /dev/ptx/ptmx exists). */
-            if (pathExists("/dev/pts/ptmx") &&
-                !pathExists(chrootRootDir + "/dev/ptmx")
-                && dirsInChroot.find("/dev/pts") == dirsInChroot.end())
-            {
-                if (mount("none", (chrootRootDir + "/dev/pts").c_str(), "devpts", 0, "newinstance,mode=0620") == -1)
-                    throw SysError("mounting /dev/pts");
-                createSymlink("/dev/pts/ptmx", chrootRootDir + "/dev/ptmx");
+                mountPrivateFilesystems(root, chrootTemplate->dirs);
 
-                /* Make sure /dev/pts/ptmx is world-writable.  With some
-                   Linux versions, it is created with permissions 0.  */
-                chmod_(chrootRootDir + "/dev/pts/ptmx", 0666);
+                if (chroot(root.c_str()) == -1)
+                    throw SysError(format("cannot change root directory to ‘%1%’") % root);
+            } else
+#endif
+            {
+                makeMountsPrivate();
+                setUpChrootBase(chrootRootDir, dirsInChroot);
+                mountPrivateFilesystems(chrootRootDir, dirsInChroot);
+
+                /* Do the chroot().  Below we do a chdir() to the
+                   temporary build directory to make sure the current
+                   directory is in the chroot.  (Actually the order
+                   doesn't matter, since due to the bind mount tmpDir
+                   and tmpRootDit/tmpDir are the same directories.) */
+                if (chroot(chrootRootDir.c_str()) == -1)
+                    throw SysError(format("cannot change root directory to ‘%1%’") % chrootRootDir);
             }
-
-            /* Do the chroot().  Below we do a chdir() to the
-               temporary build directory to make sure the current
-               directory is in the chroot.  (Actually the order
-               doesn't matter, since due to the bind mount tmpDir and
-               tmpRootDit/tmpDir are the same directories.) */
-            if (chroot(chrootRootDir.c_str()) == -1)
-                throw SysError(format("cannot change root directory to ‘%1%’") % chrootRootDir);
         }
 #endif
 
         if (chdir(tmpDir.c_str()) == -1)
             throw SysError(format("changing into ‘%1%’") % tmpDir);
 
-        /* Close all other file descriptors. */
-        closeMostFDs(set<int>());
+        /* Close all other file descriptors, except the jobserver's. */
+        set<int> keepFDs;
+        if (useJobserver) {
+            keepFDs = getJobserver()->builderFDs();
+            for (auto fd : keepFDs)
+                if (fcntl(fd, F_SETFD, 0) == -1)
+                    throw SysError("clearing FD_CLOEXEC");
+        }
+        closeMostFDs(keepFDs);
 
 #if __linux__
         /* Change the personality to 32-bit if we're doing an
@@ -2153,23 +2691,41 @@ void DerivationGoal::runChild()
                 throw SysError("setuid failed");
         }
 
-        /* Fill in the arguments. */
-        string builderBasename = baseNameOf(drv.builder);
-        args.push_back(builderBasename.c_str());
-        foreach (Strings::iterator, i, drv.args) {
-            auto re = rewriteHashes(*i, rewritesToTmp);
-            auto cstr = new char[re.length()+1];
-            std::strcpy(cstr, re.c_str());
-
-            args.push_back(cstr);
+        /* Fill in the arguments.  Builtin builders have no program
+           to execute. */
+        string builderBasename;
+        if (!isBuiltin(drv)) {
+            builderBasename = baseNameOf(drv.builder);
+            args.push_back(builderBasename.c_str());
+            foreach (Strings::iterator, i, drv.args) {
+                auto re = rewriteHashes(*i, rewritesToTmp);
+                auto cstr = new char[re.length()+1];
+                std::strcpy(cstr, re.c_str());
+
+                args.push_back(cstr);
+            }
+            args.push_back(0);
         }
-        args.push_back(0);
 
         restoreSIGPIPE();
 
         /* Indicate that we managed to set up the build environment. */
         writeToStderr("\n");
 
+        /* Builtin builders run in this process. */
+        if (isBuiltin(drv)) {
+            try {
+                StringPairs builtinEnv;
+                foreach (Environment::const_iterator, i, env)
+                    builtinEnv[i->first] = rewriteHashes(i->second, rewritesToTmp);
+                runBuiltin(drv, builtinEnv);
+                _exit(0);
+            } catch (std::exception & e) {
+                writeToStderr("error: " + string(e.what()) + "\n");
+                _exit(1);
+            }
+        }
+
         /* Execute the program.  This should not return. */
         execve(program.c_str(), (char * *) &args[0], (char * *) envArr);
 
@@ -2264,8 +2820,12 @@ void DerivationGoal::registerOutputs()
             throw BuildError(format("suspicious ownership or permission on ‘%1%’; rejecting this build output") % path);
 #endif
 
-        /* Apply hash rewriting if necessary. */
+        /* Apply hash rewriting if necessary.  This also scans the
+           result for references and computes its hash, so we don't
+           have to do that again below. */
         bool rewritten = false;
+        HashResult hash;
+        PathSet references;
         if (!rewritesFromTmp.empty()) {
             printMsg(lvlError, format("warning: rewriting hashes in ‘%1%’; cross fingers") % path);
 
@@ -2274,13 +2834,7 @@ void DerivationGoal::registerOutputs()
                something like that. */
             canonicalisePathMetaData(actualPath, buildUser.enabled() ? buildUser.getUID() : -1, inodesSeen);
 
-            /* FIXME: this is in-memory. */
-            StringSink sink;
-            dumpPath(actualPath, sink);
-            deletePath(actualPath);
-            sink.s = rewriteHashes(sink.s, rewritesFromTmp);
-            StringSource source(sink.s);
-            restorePath(actualPath, source);
+            references = rewriteHashesInPath(actualPath, rewritesFromTmp, allPaths, hash);
 
             rewritten = true;
         }
@@ -2320,9 +2874,11 @@ void DerivationGoal::registerOutputs()
         /* For this output path, find the references to other paths
            contained in it.  Compute the SHA-256 NAR hash at the same
            time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        HashResult hash;
-        PathSet references = scanForReferences(actualPath, allPaths, hash);
+           verify later on whether nobody has messed with the store.
+           Canonicalisation doesn't affect either, so a rewritten path
+           has already been scanned. */
+        if (!rewritten)
+            references = scanForReferences(actualPath, allPaths, hash);
 
         if (buildMode == bmCheck) {
             ValidPathInfo info = worker.store.queryPathInfo(path);
@@ -2409,7 +2965,13 @@ Path DerivationGoal::openLogFile()
     Path dir = (format("%1%/%2%/%3%/") % settings.nixLogDir % drvsLogDir % string(baseName, 0, 2)).str();
     createDirs(dir);
 
-    if (settings.compressLog) {
+    if (settings.compressLog && settings.indexedLog) {
+
+        Path logFileName = (format("%1%/%2%%3%") % dir % string(baseName, 2) % indexedLogSuffix).str();
+        indexedLogFile = std::shared_ptr<IndexedLogWriter>(new IndexedLogWriter(logFileName));
+        return logFileName;
+
+    } else if (settings.compressLog) {
 
         Path logFileName = (format("%1%/%2%.bz2") % dir % string(baseName, 2)).str();
         AutoCloseFD fd = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
@@ -2449,6 +3011,12 @@ void DerivationGoal::closeLogFile()
         fLogFile = 0;
     }
 
+    if (indexedLogFile) {
+        std::shared_ptr<IndexedLogWriter> log = indexedLogFile;
+        indexedLogFile.reset();
+        log->close();
+    }
+
     fdLogFile.close();
 }
 
@@ -2488,7 +3056,9 @@ void DerivationGoal::handleChildOutput(int fd, const string & data)
             int err;
             BZ2_bzWrite(&err, bzLogFile, (unsigned char *) data.data(), data.size());
             if (err != BZ_OK) throw Error(format("cannot write to compressed log file (BZip2 error = %1%)") % err);
-        } else if (fdLogFile != -1)
+        } else if (indexedLogFile)
+            indexedLogFile->write((unsigned char *) data.data(), data.size());
+        else if (fdLogFile != -1)
             writeFull(fdLogFile, (unsigned char *) data.data(), data.size());
     }
 
@@ -2737,7 +3307,7 @@ void SubstitutionGoal::referencesValid()
             assert(worker.store.isValidPath(*i));
 
     state = &SubstitutionGoal::tryToRun;
-    worker.wakeUp(shared_from_this());
+    worker.readyToBuild(shared_from_this());
 }
 
 
@@ -2949,6 +3519,7 @@ Worker::Worker(LocalStore & store)
     if (working) abort();
     working = true;
     nrLocalBuilds = 0;
+    wakeWantingToBuild = false;
     lastWokenUp = 0;
     permanentFailure = false;
     timedOut = false;
@@ -2973,6 +3544,7 @@ GoalPtr Worker::makeDerivationGoal(const Path & path, const StringSet & wantedOu
     if (!goal) {
         goal = GoalPtr(new DerivationGoal(path, wantedOutputs, *this, buildMode));
         derivationGoals[path] = goal;
+        goal->updateCriticalPath();
         wakeUp(goal);
     } else
         (dynamic_cast<DerivationGoal *>(goal.get()))->addWantedOutputs(wantedOutputs);
@@ -2986,6 +3558,7 @@ GoalPtr Worker::makeSubstitutionGoal(const Path & path, bool repair)
     if (!goal) {
         goal = GoalPtr(new SubstitutionGoal(path, *this, repair));
         substitutionGoals[path] = goal;
+        goal->updateCriticalPath();
         wakeUp(goal);
     }
     return goal;
@@ -3070,26 +3643,25 @@ void Worker::childTerminated(pid_t pid, bool wakeSleepers)
 
     children.erase(pid);
 
-    if (wakeSleepers) {
-
-        /* Wake up goals waiting for a build slot. */
-        foreach (WeakGoals::iterator, i, wantingToBuild) {
-            GoalPtr goal = i->lock();
-            if (goal) wakeUp(goal);
-        }
-
-        wantingToBuild.clear();
-    }
+    /* Wake up goals waiting for a build slot. */
+    if (wakeSleepers) wakeWantingToBuild = true;
 }
 
 
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
+    addToWeakGoals(wantingToBuild, goal);
     if (getNrLocalBuilds() < settings.maxBuildJobs)
-        wakeUp(goal); /* we can do it right away */
-    else
-        addToWeakGoals(wantingToBuild, goal);
+        wakeWantingToBuild = true; /* we can do it right away */
+}
+
+
+void Worker::readyToBuild(GoalPtr goal)
+{
+    debug("ready to build");
+    addToWeakGoals(wantingToBuild, goal);
+    wakeWantingToBuild = true;
 }
 
 
@@ -3117,7 +3689,8 @@ void Worker::run(const Goals & _topGoals)
 
         checkInterrupt();
 
-        /* Call every wake goal (in the ordering established by
+        /* Call every wake goal, those on the longest critical path
+           first (and otherwise in the ordering established by
            CompareGoalPtrs). */
         while (!awake.empty() && !topGoals.empty()) {
             Goals awake2;
@@ -3126,7 +3699,7 @@ void Worker::run(const Goals & _topGoals)
                 if (goal) awake2.insert(goal);
             }
             awake.clear();
-            for (auto & goal : awake2) {
+            for (auto & goal : prioritise(awake2)) {
                 checkInterrupt();
                 goal->work();
                 if (topGoals.empty()) break; // stuff may have been cancelled
@@ -3135,6 +3708,19 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* Now that nothing else can happen without waiting, let the
+           goals that want a build slot compete for the free ones.
+           They're called in order of priority by the loop above. */
+        if (wakeWantingToBuild) {
+            wakeWantingToBuild = false;
+            for (auto & i : wantingToBuild) {
+                GoalPtr goal = i.lock();
+                if (goal) wakeUp(goal);
+            }
+            wantingToBuild.clear();
+            continue;
+        }
+
         /* Wait for input. */
         if (!children.empty() || !waitingForAWhile.empty())
             waitForInput();
@@ -3155,6 +3741,17 @@ void Worker::run(const Goals & _topGoals)
 }
 
 
+std::vector<GoalPtr> Worker::prioritise(const Goals & goals)
+{
+    std::vector<GoalPtr> sorted(goals.begin(), goals.end());
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](const GoalPtr & a, const GoalPtr & b) {
+            return a->getCriticalPath() > b->getCriticalPath();
+        });
+    return sorted;
+}
+
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -0,0 +1,294 @@
+#include "builtins.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <list>
+#include <set>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+
+namespace nix {
+
+
+bool isBuiltin(const Derivation & drv)
+{
+    return string(drv.builder, 0, 8) == "builtin:";
+}
+
+
+void runBuiltin(const Derivation & drv, const StringPairs & env)
+{
+    if (drv.builder == "builtin:buildenv")
+        builtinBuildenv(env);
+    else
+        throw Error(format("unsupported builtin builder ‘%1%’") % string(drv.builder, 8));
+}
+
+
+/* The user environment is first computed in memory as a tree of
+   nodes, each of which is either a symlink into some package or a
+   directory that merges the contents of several packages.  The
+   resulting tree is then written to disk in one pass, so that we
+   never have to undo a symlink when a directory turns out to be
+   shared. */
+struct EnvNode
+{
+    bool isLink;
+    Path target;
+    bool targetIsDir;
+    int priority;
+    std::map<string, EnvNode *> entries;
+};
+
+
+struct BuildEnv
+{
+    Path out;
+    std::list<EnvNode> nodes;
+    EnvNode root;
+    PathSet done;
+    std::set<Path> postponed;
+
+    BuildEnv(const Path & out) : out(out)
+    {
+        root.isLink = false;
+        root.targetIsDir = false;
+        root.priority = 0;
+    }
+
+    EnvNode * newLink(const Path & target, bool targetIsDir, int priority)
+    {
+        nodes.push_back(EnvNode());
+        EnvNode & node(nodes.back());
+        node.isLink = true;
+        node.target = target;
+        node.targetIsDir = targetIsDir;
+        node.priority = priority;
+        return &node;
+    }
+
+    void createLinks(const Path & srcDir, EnvNode & dir, const Path & dstDir, int priority);
+
+    void addPkg(const Path & pkgDir, int priority);
+
+    unsigned int createTree(int fd, const EnvNode & dir, const Path & dirPath);
+};
+
+
+/* Whether `path' is a directory or a symlink to one.  `type' is the
+   d_type of the directory entry, which lets us skip the stat() in the
+   common case. */
+static bool isDirectory(const Path & path, unsigned char type)
+{
+    if (type == DT_DIR) return true;
+    if (type != DT_LNK && type != DT_UNKNOWN) return false;
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+void BuildEnv::createLinks(const Path & srcDir, EnvNode & dir, const Path & dstDir, int priority)
+{
+    DirEntries srcFiles = readDirectory(srcDir);
+    std::sort(srcFiles.begin(), srcFiles.end(),
+        [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+
+    for (auto & i : srcFiles) {
+        /* Like glob("*"), ignore hidden files. */
+        if (i.name[0] == '.') continue;
+
+        Path srcFile = srcDir + "/" + i.name;
+        Path dstFile = dstDir + "/" + i.name;
+
+        /* The files below are special-cased so that they don't show
+           up in user profiles, either because they are useless, or
+           because they would cause pointless collisions (e.g., each
+           Python package brings its own
+           `$out/lib/pythonX.Y/site-packages/easy-install.pth'.) */
+        if (i.name == "propagated-build-inputs" ||
+            i.name == "nix-support" ||
+            i.name == "perllocal.pod" ||
+            (i.name == "dir" && baseNameOf(srcDir) == "info") ||
+            i.name == "log")
+            continue;
+
+        auto j = dir.entries.find(i.name);
+        EnvNode * existing = j == dir.entries.end() ? 0 : j->second;
+
+        if (isDirectory(srcFile, i.type)) {
+
+            if (!existing)
+                dir.entries[i.name] = newLink(srcFile, true, priority);
+
+            else if (!existing->isLink)
+                createLinks(srcFile, *existing, dstFile, priority);
+
+            else {
+                /* Two packages provide this directory, so replace
+                   the symlink by a directory containing the
+                   contents of both. */
+                if (!existing->targetIsDir)
+                    throw Error(format("collision between directory ‘%1%’ and non-directory ‘%2%’")
+                        % srcFile % existing->target);
+                Path target = existing->target;
+                existing->isLink = false;
+                existing->target = "";
+                createLinks(target, *existing, dstFile, existing->priority);
+                createLinks(srcFile, *existing, dstFile, priority);
+            }
+        }
+
+        else {
+
+            if (existing && existing->isLink) {
+                if (existing->priority == priority)
+                    throw Error(format(
+                            "collision between ‘%1%’ and ‘%2%’; "
+                            "use ‘nix-env --set-flag priority NUMBER PKGNAME’ "
+                            "to change the priority of one of the conflicting packages")
+                        % srcFile % existing->target);
+                if (existing->priority < priority) continue;
+            }
+
+            else if (existing)
+                throw Error(format("error creating link ‘%1%’: %2%") % dstFile % strerror(EEXIST));
+
+            dir.entries[i.name] = newLink(srcFile, false, priority);
+        }
+    }
+}
+
+
+void BuildEnv::addPkg(const Path & pkgDir, int priority)
+{
+    if (done.find(pkgDir) != done.end()) return;
+    done.insert(pkgDir);
+
+    if (isDirectory(pkgDir, DT_UNKNOWN))
+        createLinks(pkgDir, root, out, priority);
+
+    Path propagatedFN = pkgDir + "/nix-support/propagated-user-env-packages";
+    if (pathExists(propagatedFN)) {
+        string propagated = readFile(propagatedFN);
+        propagated = string(propagated, 0, propagated.find('\n'));
+        for (auto & p : tokenizeString<Strings>(propagated))
+            if (done.find(p) == done.end()) postponed.insert(p);
+    }
+}
+
+
+unsigned int BuildEnv::createTree(int fd, const EnvNode & dir, const Path & dirPath)
+{
+    unsigned int symlinks = 0;
+
+    for (auto & i : dir.entries) {
+        Path path = dirPath + "/" + i.first;
+
+        if (i.second->isLink) {
+            if (symlinkat(i.second->target.c_str(), fd, i.first.c_str()) == -1)
+                throw SysError(format("error creating link ‘%1%’") % path);
+            symlinks++;
+            continue;
+        }
+
+        if (mkdirat(fd, i.first.c_str(), 0755) == -1)
+            throw SysError(format("error creating directory ‘%1%’") % path);
+        AutoCloseFD fd2 = openat(fd, i.first.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd2 == -1)
+            throw SysError(format("opening directory ‘%1%’") % path);
+        symlinks += createTree(fd2, *i.second, path);
+    }
+
+    return symlinks;
+}
+
+
+void builtinBuildenv(const StringPairs & env)
+{
+    auto getAttr = [&](const string & name) {
+        auto i = env.find(name);
+        if (i == env.end()) throw Error(format("attribute ‘%1%’ missing") % name);
+        return i->second;
+    };
+
+    BuildEnv state(getAttr("out"));
+
+    /* Convert the stuff we get from the environment back into a
+       coherent data type. */
+    struct Package
+    {
+        Path path;
+        bool active;
+        int priority;
+    };
+
+    std::vector<Package> pkgs;
+
+    Strings derivations = tokenizeString<Strings>(getAttr("derivations"));
+    auto next = [&]() {
+        if (derivations.empty()) throw Error("malformed attribute ‘derivations’");
+        string s = derivations.front();
+        derivations.pop_front();
+        return s;
+    };
+
+    while (!derivations.empty()) {
+        bool active = next() != "false";
+        int priority, outputs;
+        if (!string2Int(next(), priority)) priority = 0;
+        if (!string2Int(next(), outputs)) outputs = 0;
+        for (int n = 0; n < outputs; n++) {
+            Package pkg;
+            pkg.path = next();
+            pkg.active = active;
+            pkg.priority = priority;
+            pkgs.push_back(pkg);
+        }
+    }
+
+    /* Symlink to the packages that have been installed explicitly by
+       the user.  Process in priority order so that the first package
+       to provide a file is usually the one that wins. */
+    std::sort(pkgs.begin(), pkgs.end(), [](const Package & a, const Package & b) {
+        return a.priority < b.priority || (a.priority == b.priority && a.path < b.path);
+    });
+
+    for (auto & pkg : pkgs)
+        if (pkg.active) state.addPkg(pkg.path, pkg.priority);
+
+    /* Symlink to the packages that have been "propagated" by packages
+       installed by the user (i.e., package X declares that it wants Y
+       installed as well).  We do these later because they have a
+       lower priority in case of collisions. */
+    int priorityCounter = 1000; // don't care about collisions
+    while (!state.postponed.empty()) {
+        std::set<Path> pkgDirs;
+        pkgDirs.swap(state.postponed);
+        for (auto & pkgDir : pkgDirs)
+            state.addPkg(pkgDir, priorityCounter++);
+    }
+
+    if (state.root.entries.find("manifest.nix") != state.root.entries.end())
+        throw Error("cannot create manifest");
+    state.root.entries["manifest.nix"] = state.newLink(getAttr("manifest"), false, 0);
+
+    if (mkdir(state.out.c_str(), 0755) == -1)
+        throw SysError(format("error creating ‘%1%’") % state.out);
+    AutoCloseFD fd = open(state.out.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        throw SysError(format("opening directory ‘%1%’") % state.out);
+
+    unsigned int symlinks = state.createTree(fd, state.root, state.out);
+
+    writeToStderr((format("created %1% symlinks in user environment\n") % (symlinks - 1)).str());
+}
+
+
+}
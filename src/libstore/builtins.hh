@@ -0,0 +1,23 @@
+#pragma once
+
+#include "derivations.hh"
+
+
+namespace nix {
+
+
+/* Builders implemented inside Nix.  A derivation whose builder is
+   ‘builtin:<name>’ is built by calling the corresponding function in
+   the builder process instead of executing a program.  `env' is the
+   environment that would have been passed to the builder. */
+
+bool isBuiltin(const Derivation & drv);
+
+void runBuiltin(const Derivation & drv, const StringPairs & env);
+
+/* Build a user environment: a tree of symlinks to the files of a set
+   of packages.  This is equivalent to the former ‘buildenv.pl’. */
+void builtinBuildenv(const StringPairs & env);
+
+
+}
@@ -0,0 +1,420 @@
+#include "config.h"
+#include "chunks.hh"
+#include "archive.hh"
+#include "derivations.hh"
+#include "globals.hh"
+#include "names.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sqlite3.h>
+
+
+namespace nix {
+
+
+/* Chunks are at least `minChunkSize' and at most `maxChunkSize'
+   bytes.  In between, a chunk ends where the top `chunkMaskBits' bits
+   of the rolling hash are zero, giving an average chunk size of about
+   `minChunkSize' + 2^chunkMaskBits. */
+static const size_t minChunkSize = 2 * 1024;
+static const size_t maxChunkSize = 64 * 1024;
+static const unsigned int chunkMaskBits = 13;
+static const unsigned long long chunkMask = ~0ULL << (64 - chunkMaskBits);
+
+/* Paths with larger NARs are not indexed, since the decoder keeps
+   the NAR of the path it is taking chunks from in memory. */
+static const unsigned long long maxIndexedSize = 256 * 1024 * 1024;
+
+/* How many versions of a package to offer chunks from. */
+static const unsigned int maxSimilarPaths = 2;
+
+
+/* The random values added to the rolling (“gear”) hash for each byte
+   value.  These are part of the protocol: both sides must find the
+   same chunk boundaries. */
+static unsigned long long gear[256];
+
+static bool initGear()
+{
+    unsigned long long x = 0;
+    for (unsigned int i = 0; i < 256; ++i) {
+        /* SplitMix64. */
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    return true;
+}
+
+static bool gearInitialised = initGear();
+
+
+ChunkHash hashChunk(const string & data)
+{
+    Hash h = hashString(htSHA256, data);
+    return string((char *) h.hash, h.hashSize);
+}
+
+
+string packChunkHashes(const ChunkHashes & hashes)
+{
+    string s;
+    s.reserve(hashes.size() * 32);
+    for (auto & i : hashes) s += i;
+    return s;
+}
+
+
+ChunkHashes unpackChunkHashes(const string & s)
+{
+    if (s.size() % 32) throw Error("invalid list of chunk hashes");
+    ChunkHashes hashes;
+    for (size_t n = 0; n < s.size(); n += 32)
+        hashes.insert(string(s, n, 32));
+    return hashes;
+}
+
+
+ChunkingSink::ChunkingSink(Callback callback)
+    : callback(callback), h(0)
+{
+    assert(gearInitialised);
+}
+
+
+void ChunkingSink::operator () (const unsigned char * data, size_t len)
+{
+    while (len) {
+        size_t n = current.size(), i = 0;
+        bool cut = false;
+        while (i < len) {
+            h = (h << 1) + gear[data[i++]];
+            if (++n >= maxChunkSize || (n >= minChunkSize && !(h & chunkMask))) {
+                cut = true;
+                break;
+            }
+        }
+        current.append((const char *) data, i);
+        data += i;
+        len -= i;
+        if (cut) {
+            callback(current);
+            current.clear();
+            h = 0;
+        }
+    }
+}
+
+
+void ChunkingSink::finish()
+{
+    if (!current.empty()) callback(current);
+    current.clear();
+    h = 0;
+}
+
+
+ChunkEncoder::ChunkEncoder(Sink & to, const ChunkHashes & known)
+    : to(to), known(known), chunker([this](const string & chunk) {
+        ChunkHash hash = hashChunk(chunk);
+        if (this->known.find(hash) != this->known.end()) {
+            writeInt(1, this->to);
+            writeString(hash, this->to);
+        } else {
+            writeInt(2, this->to);
+            writeString(chunk, this->to);
+        }
+    })
+{
+}
+
+
+void ChunkEncoder::operator () (const unsigned char * data, size_t len)
+{
+    chunker(data, len);
+}
+
+
+void ChunkEncoder::finish()
+{
+    chunker.finish();
+    writeInt(0, to);
+}
+
+
+ChunkDecoder::ChunkDecoder(Source & from, ChunkIndex & index)
+    : literalSize(0), localSize(0), from(from), index(index), pos(0), eof(false)
+{
+}
+
+
+bool ChunkDecoder::nextChunk(bool resolve)
+{
+    if (eof) return false;
+
+    unsigned int type = readInt(from);
+
+    if (type == 0) {
+        eof = true;
+        return false;
+    }
+
+    else if (type == 2) {
+        chunk = readString(from);
+        literalSize += chunk.size();
+    }
+
+    else if (type == 1) {
+        ChunkHash hash = readString(from);
+        chunk.clear();
+        if (resolve) {
+            Path path = narPath;
+            unsigned long long offset;
+            unsigned int size;
+            if (!index.findChunk(hash, path, offset, size))
+                throw MissingChunk("chunk stream refers to an unknown chunk");
+            if (path != narPath) {
+                if (!index.store.isValidPath(path))
+                    throw MissingChunk(format("path ‘%1%’ is no longer valid") % path);
+                StringSink sink;
+                dumpPath(path, sink);
+                nar.swap(sink.s);
+                narPath = path;
+            }
+            if (offset + size > nar.size() || hashChunk(string(nar, offset, size)) != hash) {
+                index.removePath(path);
+                throw MissingChunk(format("chunk index entry for ‘%1%’ is stale") % path);
+            }
+            chunk = string(nar, offset, size);
+            localSize += size;
+        }
+    }
+
+    else throw SerialisationError("invalid chunk stream");
+
+    pos = 0;
+    return true;
+}
+
+
+size_t ChunkDecoder::read(unsigned char * data, size_t len)
+{
+    while (pos == chunk.size())
+        if (!nextChunk(true)) throw EndOfFile("unexpected end of chunk stream");
+    size_t n = std::min(len, chunk.size() - pos);
+    memcpy(data, chunk.data() + pos, n);
+    pos += n;
+    return n;
+}
+
+
+void ChunkDecoder::finish()
+{
+    if (pos != chunk.size() || nextChunk(true))
+        throw SerialisationError("unexpected data at the end of chunk stream");
+}
+
+
+void ChunkDecoder::skip()
+{
+    while (nextChunk(false)) ;
+    chunk.clear();
+    pos = 0;
+}
+
+
+ChunkIndex::ChunkIndex(LocalStore & store)
+    : store(store)
+{
+    Path dbPath = settings.nixDBPath + "/chunks.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &db.db,
+            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK)
+        throw Error(format("cannot open chunk index ‘%1%’") % dbPath);
+
+    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(db, "setting timeout");
+
+    /* The index can always be rebuilt, so don't bother syncing. */
+    if (sqlite3_exec(db, "pragma synchronous = off;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting synchronous mode");
+
+    const char * schema =
+        "create table if not exists Indexed (path text primary key not null);"
+        "create table if not exists Chunks ("
+        "    hash   text not null,"
+        "    path   text not null,"
+        "    offset integer not null,"
+        "    size   integer not null);"
+        "create index if not exists IndexChunks on Chunks(hash);"
+        "create index if not exists IndexChunkPaths on Chunks(path);";
+    if (sqlite3_exec(db, schema, 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "initialising chunk index");
+
+    stmtIsIndexed.create(db, "select 1 from Indexed where path = ?;");
+    stmtAddIndexed.create(db, "insert or replace into Indexed (path) values (?);");
+    stmtDeleteIndexed.create(db, "delete from Indexed where path = ?;");
+    stmtAddChunk.create(db, "insert into Chunks (hash, path, offset, size) values (?, ?, ?, ?);");
+    stmtDeleteChunks.create(db, "delete from Chunks where path = ?;");
+    stmtQueryChunks.create(db, "select hash from Chunks where path = ?;");
+    stmtFindChunk.create(db, "select path, offset, size from Chunks where hash = ?;");
+}
+
+
+bool ChunkIndex::isIndexed(const Path & path)
+{
+    SQLiteStmtUse use(stmtIsIndexed);
+    stmtIsIndexed.bind(path);
+    int res = sqlite3_step(stmtIsIndexed);
+    if (res != SQLITE_DONE && res != SQLITE_ROW)
+        throwSQLiteError(db, "querying chunk index");
+    return res == SQLITE_ROW;
+}
+
+
+void ChunkIndex::addPath(const Path & path)
+{
+    printMsg(lvlTalkative, format("indexing chunks of ‘%1%’") % path);
+
+    SQLiteTxn txn(db);
+
+    unsigned long long offset = 0;
+    ChunkingSink sink([&](const string & chunk) {
+        SQLiteStmtUse use(stmtAddChunk);
+        stmtAddChunk.bind(printHash(hashString(htSHA256, chunk)));
+        stmtAddChunk.bind(path);
+        stmtAddChunk.bind64(offset);
+        stmtAddChunk.bind((int) chunk.size());
+        if (sqlite3_step(stmtAddChunk) != SQLITE_DONE)
+            throwSQLiteError(db, "adding chunk to index");
+        offset += chunk.size();
+    });
+    dumpPath(path, sink);
+    sink.finish();
+
+    SQLiteStmtUse use(stmtAddIndexed);
+    stmtAddIndexed.bind(path);
+    if (sqlite3_step(stmtAddIndexed) != SQLITE_DONE)
+        throwSQLiteError(db, "adding path to chunk index");
+
+    txn.commit();
+}
+
+
+void ChunkIndex::removePath(const Path & path)
+{
+    {
+        SQLiteStmtUse use(stmtDeleteChunks);
+        stmtDeleteChunks.bind(path);
+        if (sqlite3_step(stmtDeleteChunks) != SQLITE_DONE)
+            throwSQLiteError(db, "removing path from chunk index");
+    }
+    SQLiteStmtUse use(stmtDeleteIndexed);
+    stmtDeleteIndexed.bind(path);
+    if (sqlite3_step(stmtDeleteIndexed) != SQLITE_DONE)
+        throwSQLiteError(db, "removing path from chunk index");
+}
+
+
+/* The name of the package in a store path, without its version. */
+static string packageName(const Path & path)
+{
+    return DrvName(storePathToName(path)).name;
+}
+
+
+ChunkHashes ChunkIndex::similarChunks(const PathSet & paths)
+{
+    /* Forget about paths that have been garbage-collected. */
+    {
+        SQLiteStmt stmt;
+        stmt.create(db, "select path from Indexed;");
+        PathSet indexed;
+        int res;
+        while ((res = sqlite3_step(stmt)) == SQLITE_ROW)
+            indexed.insert((const char *) sqlite3_column_text(stmt, 0));
+        if (res != SQLITE_DONE) throwSQLiteError(db, "querying chunk index");
+        PathSet valid = store.queryValidPaths(indexed);
+        SQLiteTxn txn(db);
+        for (auto & i : indexed)
+            if (valid.find(i) == valid.end()) removePath(i);
+        txn.commit();
+    }
+
+    /* Find the local paths with the same package names as `paths'. */
+    StringSet names;
+    for (auto & i : paths)
+        if (!isDerivation(i)) names.insert(packageName(i));
+
+    PathSet candidates;
+    for (auto & i : store.queryAllValidPaths())
+        if (!isDerivation(i) && paths.find(i) == paths.end()
+            && names.find(packageName(i)) != names.end())
+            candidates.insert(i);
+
+    /* Use the most recently registered versions of each package. */
+    ValidPathInfos infos = store.queryPathInfos(candidates);
+    infos.sort([](const ValidPathInfo & a, const ValidPathInfo & b) {
+        return a.registrationTime > b.registrationTime;
+    });
+
+    std::map<string, unsigned int> used;
+    ChunkHashes hashes;
+
+    for (auto & info : infos) {
+        if (info.narSize > maxIndexedSize) continue;
+        unsigned int & n(used[packageName(info.path)]);
+        if (n >= maxSimilarPaths) continue;
+        n++;
+
+        if (!isIndexed(info.path)) addPath(info.path);
+
+        SQLiteStmtUse use(stmtQueryChunks);
+        stmtQueryChunks.bind(info.path);
+        int res;
+        while ((res = sqlite3_step(stmtQueryChunks)) == SQLITE_ROW) {
+            Hash h = parseHash(htSHA256, (const char *) sqlite3_column_text(stmtQueryChunks, 0));
+            hashes.insert(string((char *) h.hash, h.hashSize));
+        }
+        if (res != SQLITE_DONE) throwSQLiteError(db, "querying chunk index");
+    }
+
+    return hashes;
+}
+
+
+bool ChunkIndex::findChunk(const ChunkHash & hash, Path & path,
+    unsigned long long & offset, unsigned int & size)
+{
+    Hash h(htSHA256);
+    if (hash.size() != h.hashSize) return false;
+    memcpy(h.hash, hash.data(), h.hashSize);
+
+    SQLiteStmtUse use(stmtFindChunk);
+    stmtFindChunk.bind(printHash(h));
+
+    /* Prefer the chunk's occurrence in `path', to avoid switching
+       between NARs. */
+    Path preferred = path;
+    bool found = false;
+    int res;
+    while ((res = sqlite3_step(stmtFindChunk)) == SQLITE_ROW) {
+        Path p = (const char *) sqlite3_column_text(stmtFindChunk, 0);
+        if (found && p != preferred) continue;
+        path = p;
+        offset = sqlite3_column_int64(stmtFindChunk, 1);
+        size = sqlite3_column_int(stmtFindChunk, 2);
+        found = true;
+        if (p == preferred) return true;
+    }
+    if (res != SQLITE_DONE && res != SQLITE_ROW)
+        throwSQLiteError(db, "querying chunk index");
+
+    return found;
+}
+
+
+}
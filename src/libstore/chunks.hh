@@ -0,0 +1,164 @@
+#pragma once
+
+#include "types.hh"
+#include "serialise.hh"
+#include "local-store.hh"
+
+#include <functional>
+#include <unordered_set>
+
+
+namespace nix {
+
+
+/* Transfer of store paths that only sends the parts of the data that
+   the receiver doesn't already have.  The data (a NAR or an export
+   stream) is split into content-defined chunks, i.e. chunks whose
+   boundaries depend only on the bytes around them, so that an
+   insertion or deletion only affects the chunks that contain it.  The
+   receiver advertises the hashes of the chunks of similar store paths
+   that it has (typically older versions of the same packages), and
+   the sender replaces those chunks with their hashes. */
+
+
+/* The identity of a chunk: its raw SHA-256 hash. */
+typedef string ChunkHash;
+
+typedef std::unordered_set<ChunkHash> ChunkHashes;
+
+ChunkHash hashChunk(const string & data);
+
+/* Convert a set of chunk hashes to and from a string for sending
+   them over the wire. */
+string packChunkHashes(const ChunkHashes & hashes);
+
+ChunkHashes unpackChunkHashes(const string & s);
+
+
+/* A sink that splits the data written to it into content-defined
+   chunks. */
+class ChunkingSink : public Sink
+{
+public:
+
+    typedef std::function<void(const string & chunk)> Callback;
+
+    ChunkingSink(Callback callback);
+
+    void operator () (const unsigned char * data, size_t len);
+
+    /* Pass on the final chunk. */
+    void finish();
+
+private:
+    Callback callback;
+    string current;
+    unsigned long long h;
+};
+
+
+/* A sink that writes its data to another sink as a chunk stream: a
+   sequence of frames that are either the hash of a chunk in `known'
+   or literal data, terminated by a frame of type 0. */
+class ChunkEncoder : public Sink
+{
+public:
+
+    ChunkEncoder(Sink & to, const ChunkHashes & known);
+
+    void operator () (const unsigned char * data, size_t len);
+
+    void finish();
+
+private:
+    Sink & to;
+    const ChunkHashes & known;
+    ChunkingSink chunker;
+};
+
+
+/* Thrown if a chunk stream refers to a chunk that we don't have (any
+   more). */
+MakeError(MissingChunk, Error);
+
+
+class ChunkIndex;
+
+/* A source that decodes a chunk stream, taking the referenced chunks
+   from local store paths. */
+class ChunkDecoder : public Source
+{
+public:
+
+    ChunkDecoder(Source & from, ChunkIndex & index);
+
+    size_t read(unsigned char * data, size_t len);
+
+    /* Consume the rest of the stream up to and including the
+       terminating frame, which must not be preceded by unread
+       data. */
+    void finish();
+
+    /* Skip the rest of the stream, e.g. after a MissingChunk
+       error. */
+    void skip();
+
+    /* Number of bytes received literally and taken from local
+       paths, respectively. */
+    unsigned long long literalSize, localSize;
+
+private:
+    Source & from;
+    ChunkIndex & index;
+    string chunk;
+    size_t pos;
+    bool eof;
+
+    /* The NAR of the local path that chunks were last taken from. */
+    Path narPath;
+    string nar;
+
+    bool nextChunk(bool resolve);
+};
+
+
+/* An on-disk index ($NIX_DB_DIR/chunks.sqlite) that records for each
+   chunk of the NARs of some local store paths where it can be
+   found. */
+class ChunkIndex
+{
+public:
+
+    ChunkIndex(LocalStore & store);
+
+    /* Return the hashes of the chunks of local paths that probably
+       share data with `paths': other paths that have the same name
+       apart from the version.  Those paths are indexed first if
+       necessary. */
+    ChunkHashes similarChunks(const PathSet & paths);
+
+    /* Return the NAR of a local path that contains the chunk `hash',
+       and its position in that NAR. */
+    bool findChunk(const ChunkHash & hash, Path & path,
+        unsigned long long & offset, unsigned int & size);
+
+    /* Forget the chunks of `path', e.g. because the path has been
+       modified since it was indexed. */
+    void removePath(const Path & path);
+
+    LocalStore & store;
+
+private:
+
+    SQLite db;
+
+    SQLiteStmt stmtIsIndexed, stmtAddIndexed, stmtDeleteIndexed,
+        stmtAddChunk, stmtDeleteChunks, stmtQueryChunks, stmtFindChunk;
+
+    bool isIndexed(const Path & path);
+
+    void addPath(const Path & path);
+};
+
+
+}
@@ -0,0 +1,301 @@
+#include "config.h"
+#include "compression.hh"
+#include "util.hh"
+
+#include <cstring>
+
+#include <bzlib.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if HAVE_LZ4
+#include <lz4.h>
+#endif
+
+
+namespace nix {
+
+
+/* Amount of uncompressed data per frame of a compressed stream. */
+static const size_t blockSize = 256 * 1024;
+
+/* Number of blocks that may be waiting for compression before the
+   producer blocks. */
+static const size_t maxPending = 16;
+
+
+string codecName(Codec codec)
+{
+    switch (codec) {
+        case codecBzip2: return "bzip2";
+        case codecZstd: return "zstd";
+        case codecLz4: return "lz4";
+        default: return "none";
+    }
+}
+
+
+Codec parseCodec(const string & name)
+{
+    if (name == "bzip2") return codecBzip2;
+#if HAVE_ZSTD
+    if (name == "zstd") return codecZstd;
+#endif
+#if HAVE_LZ4
+    if (name == "lz4") return codecLz4;
+#endif
+    return codecNone;
+}
+
+
+Strings streamingCodecs()
+{
+    Strings res;
+#if HAVE_ZSTD
+    res.push_back("zstd");
+#endif
+#if HAVE_LZ4
+    res.push_back("lz4");
+#endif
+    return res;
+}
+
+
+string compressBlock(Codec codec, const string & in)
+{
+    string out;
+
+#if HAVE_ZSTD
+    if (codec == codecZstd) {
+        out.resize(ZSTD_compressBound(in.size()));
+        size_t n = ZSTD_compress((void *) out.data(), out.size(), in.data(), in.size(), 1);
+        if (ZSTD_isError(n))
+            throw Error(format("zstd compression failed: %1%") % ZSTD_getErrorName(n));
+        out.resize(n);
+        return out;
+    }
+#endif
+
+#if HAVE_LZ4
+    if (codec == codecLz4) {
+        out.resize(LZ4_compressBound(in.size()));
+        int n = LZ4_compress_default(in.data(), (char *) out.data(), in.size(), out.size());
+        if (n <= 0) throw Error("lz4 compression failed");
+        out.resize(n);
+        return out;
+    }
+#endif
+
+    assert(codec == codecBzip2);
+    unsigned int n = in.size() + in.size() / 100 + 600;
+    out.resize(n);
+    int err = BZ2_bzBuffToBuffCompress((char *) out.data(), &n, (char *) in.data(), in.size(), 1, 0, 0);
+    if (err != BZ_OK)
+        throw Error(format("bzip2 compression failed (BZip2 error = %1%)") % err);
+    out.resize(n);
+    return out;
+}
+
+
+void decompressBlock(Codec codec, const string & in, string & out, size_t size)
+{
+    out.resize(size);
+
+    if (codec == codecZstd) {
+#if HAVE_ZSTD
+        size_t n = ZSTD_decompress((void *) out.data(), size, in.data(), in.size());
+        if (ZSTD_isError(n) || n != size)
+            throw Error("corrupt zstd block");
+        return;
+#else
+        throw Error("zstd compression is not supported by this version of Nix");
+#endif
+    }
+
+    if (codec == codecLz4) {
+#if HAVE_LZ4
+        int n = LZ4_decompress_safe(in.data(), (char *) out.data(), in.size(), size);
+        if (n < 0 || (size_t) n != size)
+            throw Error("corrupt lz4 block");
+        return;
+#else
+        throw Error("lz4 compression is not supported by this version of Nix");
+#endif
+    }
+
+    assert(codec == codecBzip2);
+    unsigned int n = size;
+    int err = BZ2_bzBuffToBuffDecompress((char *) out.data(), &n, (char *) in.data(), in.size(), 0, 0);
+    if (err != BZ_OK || n != size)
+        throw Error(format("corrupt bzip2 block (BZip2 error = %1%)") % err);
+}
+
+
+CompressionSink::CompressionSink(Sink & to, Codec codec)
+    : to(to), codec(codec), bytesIn(0), bytesOut(0), inFlight(0), finished(false)
+{
+    assert(codec != codecNone);
+    thread = std::thread([this]() { compressor(); });
+}
+
+
+CompressionSink::~CompressionSink()
+{
+    /* If finish() wasn't called, we're being unwound, so just stop
+       the compression thread. */
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.clear();
+        finished = true;
+        wakeup.notify_all();
+    }
+    if (thread.joinable()) thread.join();
+}
+
+
+void CompressionSink::operator () (const unsigned char * data, size_t len)
+{
+    bytesIn += len;
+    while (len) {
+        size_t n = std::min(len, blockSize - current.size());
+        current.append((const char *) data, n);
+        data += n;
+        len -= n;
+        if (current.size() == blockSize) queue(current);
+    }
+}
+
+
+void CompressionSink::queue(string & block)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.push_back(string());
+        pending.back().swap(block);
+        inFlight++;
+        wakeup.notify_all();
+    }
+    writeFrames(maxPending);
+}
+
+
+/* Write the blocks that have been compressed so far, waiting for
+   more until fewer than `limit' blocks are queued or being
+   compressed. */
+void CompressionSink::writeFrames(size_t limit)
+{
+    while (true) {
+        std::pair<size_t, string> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (error.empty() && compressed.empty() && inFlight >= limit) wakeup.wait(lock);
+            if (!error.empty()) throw Error(error);
+            if (compressed.empty()) return;
+            frame.first = compressed.front().first;
+            frame.second.swap(compressed.front().second);
+            compressed.pop_front();
+            inFlight--;
+        }
+        writeInt(frame.first, to);
+        writeString(frame.second, to);
+        bytesOut += 16 + frame.second.size() + (frame.second.size() % 8 ? 8 - frame.second.size() % 8 : 0);
+    }
+}
+
+
+void CompressionSink::compressor()
+{
+    while (true) {
+        string block;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (pending.empty() && !finished) wakeup.wait(lock);
+            if (pending.empty()) return;
+            block.swap(pending.front());
+            pending.pop_front();
+        }
+
+        try {
+            string data = compressBlock(codec, block);
+            std::unique_lock<std::mutex> lock(mutex);
+            compressed.push_back(std::make_pair(block.size(), string()));
+            compressed.back().second.swap(data);
+            wakeup.notify_all();
+        } catch (std::exception & e) {
+            std::unique_lock<std::mutex> lock(mutex);
+            error = e.what();
+            pending.clear();
+            wakeup.notify_all();
+            return;
+        }
+    }
+}
+
+
+void CompressionSink::finish()
+{
+    if (!current.empty()) queue(current);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished = true;
+        wakeup.notify_all();
+    }
+
+    writeFrames(1);
+
+    thread.join();
+
+    writeInt(0, to);
+    bytesOut += 8;
+}
+
+
+DecompressionSource::DecompressionSource(Source & from, Codec codec)
+    : from(from), codec(codec), pos(0), eof(false), bytesIn(0), bytesOut(0)
+{
+    assert(codec != codecNone);
+}
+
+
+bool DecompressionSource::nextBlock()
+{
+    if (eof) return false;
+    unsigned int size = readInt(from);
+    bytesIn += 8;
+    if (size == 0) {
+        eof = true;
+        return false;
+    }
+    if (size > blockSize * 64)
+        throw SerialisationError("compressed stream has an invalid frame size");
+    string data = readString(from);
+    bytesIn += 8 + data.size() + (data.size() % 8 ? 8 - data.size() % 8 : 0);
+    decompressBlock(codec, data, block, size);
+    bytesOut += size;
+    pos = 0;
+    return true;
+}
+
+
+size_t DecompressionSource::read(unsigned char * data, size_t len)
+{
+    while (pos == block.size())
+        if (!nextBlock()) throw EndOfFile("unexpected end of compressed stream");
+    size_t n = std::min(len, block.size() - pos);
+    memcpy(data, block.data() + pos, n);
+    pos += n;
+    return n;
+}
+
+
+void DecompressionSource::finish()
+{
+    if (pos != block.size() || nextBlock())
+        throw SerialisationError("unexpected data at the end of compressed stream");
+}
+
+
+}
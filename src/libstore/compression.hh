@@ -0,0 +1,121 @@
+#pragma once
+
+#include "types.hh"
+#include "serialise.hh"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+
+namespace nix {
+
+
+/* Block compression codecs.  The numeric values are stored in
+   indexed log files, so don't change them. */
+typedef enum {
+    codecNone = 0,
+    codecBzip2 = 1,
+    codecZstd = 2,
+    codecLz4 = 3,
+} Codec;
+
+string codecName(Codec codec);
+
+/* Return the codec called `name', or codecNone if there is no such
+   codec or this version of Nix doesn't support it. */
+Codec parseCodec(const string & name);
+
+/* The supported codecs that are fast enough to compress data on the
+   fly, best first. */
+Strings streamingCodecs();
+
+string compressBlock(Codec codec, const string & in);
+
+/* Decompress `in' into `out', which must become exactly `size'
+   bytes. */
+void decompressBlock(Codec codec, const string & in, string & out, size_t size);
+
+
+/* A sink that compresses data in blocks and writes them to another
+   sink as a sequence of frames (uncompressed size followed by the
+   compressed data as a string), terminated by a frame of size 0.
+   Compression happens on a background thread, so the producer and
+   the consumer of the data can run concurrently.  The frames are
+   written to the underlying sink by the producer's thread, so that
+   errors and interrupts happen there.  The underlying sink must not
+   be used by anybody else until finish() returns. */
+class CompressionSink : public Sink
+{
+public:
+
+    CompressionSink(Sink & to, Codec codec);
+
+    ~CompressionSink();
+
+    void operator () (const unsigned char * data, size_t len);
+
+    /* Write the remaining data and the terminating frame. */
+    void finish();
+
+    unsigned long long size() { return bytesIn; }
+
+    unsigned long long compressedSize() { return bytesOut; }
+
+private:
+
+    Sink & to;
+    Codec codec;
+    string current;
+    unsigned long long bytesIn, bytesOut;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<string> pending;
+    std::deque<std::pair<size_t, string> > compressed;
+    size_t inFlight;
+    bool finished;
+    string error;
+
+    void queue(string & block);
+
+    void writeFrames(size_t limit);
+
+    void compressor();
+};
+
+
+/* A source that reads the frames written by CompressionSink. */
+class DecompressionSource : public Source
+{
+public:
+
+    DecompressionSource(Source & from, Codec codec);
+
+    size_t read(unsigned char * data, size_t len);
+
+    /* Consume the rest of the stream up to and including the
+       terminating frame, which must not be preceded by unread
+       data. */
+    void finish();
+
+    unsigned long long size() { return bytesOut; }
+
+    unsigned long long compressedSize() { return bytesIn; }
+
+private:
+
+    Source & from;
+    Codec codec;
+    string block;
+    size_t pos;
+    bool eof;
+    unsigned long long bytesIn, bytesOut;
+
+    bool nextBlock();
+};
+
+
+}
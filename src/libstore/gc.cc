@@ -1,6 +1,7 @@
 #include "globals.hh"
 #include "misc.hh"
 #include "local-store.hh"
+#include "path-graph.hh"
 
 #include <functional>
 #include <queue>
@@ -145,57 +146,102 @@ Path addPermRoot(StoreAPI & store, const Path & _storePath,
 }
 
 
-void LocalStore::addTempRoot(const Path & path)
+void LocalStore::openTempRootsFile()
 {
-    /* Create the temporary roots file for this process. */
-    if (fdTempRoots == -1) {
+    if (fdTempRoots != -1) return;
 
-        while (1) {
-            Path dir = (format("%1%/%2%") % settings.nixStateDir % tempRootsDir).str();
-            createDirs(dir);
+    while (1) {
+        Path dir = (format("%1%/%2%") % settings.nixStateDir % tempRootsDir).str();
+        createDirs(dir);
 
-            fnTempRoots = (format("%1%/%2%")
-                % dir % getpid()).str();
+        fnTempRoots = (format("%1%/%2%")
+            % dir % getpid()).str();
 
-            AutoCloseFD fdGCLock = openGCLock(ltRead);
+        AutoCloseFD fdGCLock = openGCLock(ltRead);
 
-            if (pathExists(fnTempRoots))
-                /* It *must* be stale, since there can be no two
-                   processes with the same pid. */
-                unlink(fnTempRoots.c_str());
+        if (pathExists(fnTempRoots))
+            /* It *must* be stale, since there can be no two
+               processes with the same pid. */
+            unlink(fnTempRoots.c_str());
 
-            fdTempRoots = openLockFile(fnTempRoots, true);
+        fdTempRoots = openLockFile(fnTempRoots, true);
 
-            fdGCLock.close();
+        fdGCLock.close();
 
-            debug(format("acquiring read lock on ‘%1%’") % fnTempRoots);
-            lockFile(fdTempRoots, ltRead, true);
+        debug(format("acquiring read lock on ‘%1%’") % fnTempRoots);
+        lockFile(fdTempRoots, ltRead, true);
 
-            /* Check whether the garbage collector didn't get in our
-               way. */
-            struct stat st;
-            if (fstat(fdTempRoots, &st) == -1)
-                throw SysError(format("statting ‘%1%’") % fnTempRoots);
-            if (st.st_size == 0) break;
+        /* Check whether the garbage collector didn't get in our
+           way. */
+        struct stat st;
+        if (fstat(fdTempRoots, &st) == -1)
+            throw SysError(format("statting ‘%1%’") % fnTempRoots);
+        if (st.st_size == 0) break;
+
+        /* The garbage collector deleted this file before we could
+           get a lock.  (It won't delete the file after we get a
+           lock.)  Try again. */
+    }
+}
 
-            /* The garbage collector deleted this file before we could
-               get a lock.  (It won't delete the file after we get a
-               lock.)  Try again. */
-        }
 
+void LocalStore::addTempRoot(const Path & path)
+{
+    addTempRoots(singleton<PathSet>(path));
+}
+
+
+void LocalStore::addTempRoots(const PathSet & paths)
+{
+    /* Create the temporary roots file for this process. */
+    openTempRootsFile();
+
+    /* Roots that are already in the file need not be written again:
+       a garbage collector that is running now must have locked the
+       file after they were written, and so has read them. */
+    string s;
+    for (auto & i : paths)
+        if (tempRoots.find(i) == tempRoots.end()) s += i + '\0';
+
+    if (!s.empty()) {
+        /* Upgrade the lock to a write lock.  This will cause us to
+           block if the garbage collector is holding our lock. */
+        debug(format("acquiring write lock on ‘%1%’") % fnTempRoots);
+        lockFile(fdTempRoots, ltWrite, true);
+
+        writeFull(fdTempRoots, (const unsigned char *) s.data(), s.size());
+
+        /* Downgrade to a read lock. */
+        debug(format("downgrading to read lock on ‘%1%’") % fnTempRoots);
+        lockFile(fdTempRoots, ltRead, true);
+
+        tempRoots.insert(paths.begin(), paths.end());
     }
 
-    /* Upgrade the lock to a write lock.  This will cause us to block
-       if the garbage collector is holding our lock. */
-    debug(format("acquiring write lock on ‘%1%’") % fnTempRoots);
-    lockFile(fdTempRoots, ltWrite, true);
+    markPathsUsed(paths);
+}
 
-    string s = path + '\0';
-    writeFull(fdTempRoots, (const unsigned char *) s.data(), s.size());
 
-    /* Downgrade to a read lock. */
-    debug(format("downgrading to read lock on ‘%1%’") % fnTempRoots);
-    lockFile(fdTempRoots, ltRead, true);
+/* The time a store path was last used is recorded as the access time
+   of its top-level file or directory.  We set it explicitly because
+   the kernel won't update it for most uses (or at all on `noatime'
+   file systems), and the modification time is fixed by
+   canonicalisation.  This is only a hint, so errors (e.g. because the
+   path doesn't exist yet) are ignored.  Note that store paths
+   consisting of a single regular file that have been hard-linked
+   together by store optimisation share an inode, and thus a last-use
+   time. */
+void LocalStore::markPathsUsed(const PathSet & paths)
+{
+#if HAVE_UTIMENSAT
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+    for (auto & i : paths)
+        utimensat(AT_FDCWD, i.c_str(), times, AT_SYMLINK_NOFOLLOW);
+#endif
 }
 
 
@@ -503,6 +549,81 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
 }
 
 
+/* Compute the set of valid paths that are reachable from the roots,
+   in a single traversal.  This follows the same edges as
+   canReachRoot(), but forwards. */
+void LocalStore::findLivePaths(GCState & state)
+{
+    std::queue<Path> todo;
+    for (auto & i : state.roots) todo.push(i);
+
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        Path path = todo.front();
+        todo.pop();
+
+        if (state.alive.find(path) != state.alive.end() || !isValidPath(path)) continue;
+        state.alive.insert(path);
+
+        PathSet next;
+        queryReferences(path, next);
+
+        /* If gc-keep-derivations is set, the deriver of a live output
+           is alive. */
+        if (state.gcKeepDerivations) {
+            Path deriver = queryDeriver(path);
+            if (deriver != "") next.insert(deriver);
+        }
+
+        /* If gc-keep-outputs is set, the outputs of a live derivation
+           are alive. */
+        if (state.gcKeepOutputs && isDerivation(path)) {
+            PathSet outputs = queryDerivationOutputs(path);
+            next.insert(outputs.begin(), outputs.end());
+        }
+
+        for (auto & i : next)
+            if (state.alive.find(i) == state.alive.end()) todo.push(i);
+    }
+}
+
+
+/* Sort `paths' so that the ones that were used longest ago come
+   first.  Since using a path means using its references, a path
+   counts as used whenever one of its referrers in `paths' was used.
+   This also means that referrers generally come before their
+   references, so deleting a path rarely requires deleting more
+   recently used referrers first. */
+Paths LocalStore::sortByLastUse(const PathSet & paths)
+{
+    std::map<Path, time_t> lastUse;
+    for (auto & i : paths) {
+        struct stat st;
+        lastUse[i] = lstat(i.c_str(), &st) == 0 ? st.st_atime : 0;
+    }
+
+    /* In topological order, referrers come before their references,
+       so we can push the times down in one pass. */
+    PathGraph graph(*this, paths);
+    Paths sorted;
+    for (auto & i : graph.topoSort()) {
+        checkInterrupt();
+        const Path & path(graph.path(i));
+        for (auto & j : graph.references(i))
+            if (lastUse[graph.path(j)] < lastUse[path])
+                lastUse[graph.path(j)] = lastUse[path];
+        sorted.push_back(path);
+    }
+
+    sorted.sort([&](const Path & a, const Path & b) {
+        return lastUse[a] < lastUse[b];
+    });
+
+    return sorted;
+}
+
+
 void LocalStore::tryToDelete(GCState & state, const Path & path)
 {
     checkInterrupt();
@@ -684,16 +805,22 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
             dir.close();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
-            vector<Path> entries_(entries.begin(), entries.end());
-            random_shuffle(entries_.begin(), entries_.end());
-
-            foreach (vector<Path>::iterator, i, entries_)
-                tryToDelete(state, *i);
+            /* Determine which valid paths are alive.  The rest is
+               garbage. */
+            findLivePaths(state);
+
+            PathSet dead;
+            for (auto & i : entries)
+                if (state.alive.find(i) == state.alive.end()) dead.insert(i);
+            state.dead.insert(dead.begin(), dead.end());
+
+            /* Now delete the unreachable valid paths, least recently
+               used first.  This matters when using --max-freed etc.:
+               we'd rather not delete paths that are likely to be
+               needed again soon. */
+            if (state.shouldDelete)
+                for (auto & i : sortByLastUse(dead))
+                    deletePathRecursive(state, i);
 
         } catch (GCLimitReached & e) {
         }
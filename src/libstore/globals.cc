@@ -35,23 +35,31 @@ Settings::Settings()
     long res = sysconf(_SC_NPROCESSORS_ONLN);
     if (res > 0) buildCores = res;
 #endif
+    verifyThreads = buildCores;
+    buildJobserver = false;
+    jobserverTokens = buildCores;
     readOnlyMode = false;
     thisSystem = SYSTEM;
     maxSilentTime = 0;
     buildTimeout = 0;
     useBuildHook = true;
     printBuildTrace = false;
+    recordBuildStats = false;
     reservedSize = 1024 * 1024;
     fsyncMetadata = true;
     useSQLiteWAL = true;
     syncBeforeRegistering = false;
+    groupCommit = false;
+    groupCommitWindow = 5;
     useSubstitutes = true;
     buildUsersGroup = getuid() == 0 ? "nixbld" : "";
     useChroot = false;
+    chrootTemplate = false;
     useSshSubstituter = true;
     impersonateLinux26 = false;
     keepLog = true;
     compressLog = true;
+    indexedLog = false;
     maxLogSize = 0;
     cacheFailure = false;
     pollInterval = 5;
@@ -63,6 +71,7 @@ Settings::Settings()
     lockCPU = getEnv("NIX_AFFINITY_HACK", "1") == "1";
     showTrace = false;
     enableImportNative = false;
+    usePathInfoSnapshot = true;
 }
 
 
@@ -149,19 +158,27 @@ void Settings::update()
     _get(tryFallback, "build-fallback");
     _get(maxBuildJobs, "build-max-jobs");
     _get(buildCores, "build-cores");
+    _get(buildJobserver, "build-jobserver");
+    _get(jobserverTokens, "build-jobserver-tokens");
     _get(thisSystem, "system");
     _get(maxSilentTime, "build-max-silent-time");
     _get(buildTimeout, "build-timeout");
+    _get(recordBuildStats, "build-record-stats");
     _get(reservedSize, "gc-reserved-space");
     _get(fsyncMetadata, "fsync-metadata");
     _get(useSQLiteWAL, "use-sqlite-wal");
     _get(syncBeforeRegistering, "sync-before-registering");
+    _get(groupCommit, "group-commit");
+    _get(groupCommitWindow, "group-commit-window");
+    _get(verifyThreads, "verify-threads");
     _get(useSubstitutes, "build-use-substitutes");
     _get(buildUsersGroup, "build-users-group");
     _get(useChroot, "build-use-chroot");
+    _get(chrootTemplate, "build-chroot-template");
     _get(impersonateLinux26, "build-impersonate-linux-26");
     _get(keepLog, "build-keep-log");
     _get(compressLog, "build-compress-log");
+    _get(indexedLog, "build-indexed-log");
     _get(maxLogSize, "build-max-log-size");
     _get(cacheFailure, "build-cache-failure");
     _get(pollInterval, "build-poll-interval");
@@ -175,6 +192,7 @@ void Settings::update()
     _get(logServers, "log-servers");
     _get(enableImportNative, "allow-unsafe-native-code-during-evaluation");
     _get(useCaseHack, "use-case-hack");
+    _get(usePathInfoSnapshot, "use-path-info-snapshot");
 
     string subs = getEnv("NIX_SUBSTITUTERS", "default");
     if (subs == "default") {
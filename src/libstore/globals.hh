@@ -85,6 +85,14 @@ struct Settings {
        auto-detected. */
     unsigned int buildCores;
 
+    /* Whether to give builders a GNU Make jobserver shared by all
+       concurrent builds. */
+    bool buildJobserver;
+
+    /* The number of jobs that builds may run in parallel in total
+       when using the jobserver. */
+    unsigned int jobserverTokens;
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode;
@@ -117,6 +125,8 @@ struct Settings {
        @ build-started <drvpath> <outpath> <system> <logfile>
        @ build-failed <drvpath> <outpath> <exitcode> <error text>
        @ build-succeeded <drvpath> <outpath>
+       @ build-setup <drvpath> <milliseconds>
+       @ build-stats <drvpath> <resource usage>
        @ substituter-started <outpath> <substituter>
        @ substituter-failed <outpath> <exitcode> <error text>
        @ substituter-succeeded <outpath>
@@ -126,6 +136,10 @@ struct Settings {
        builders. */
     bool printBuildTrace;
 
+    /* Whether to record the resources used by each build in the
+       database, for ‘nix-store --query --build-stats’. */
+    bool recordBuildStats;
+
     /* Amount of reserved space for the garbage collector
        (/nix/var/nix/db/reserved). */
     off_t reservedSize;
@@ -139,6 +153,18 @@ struct Settings {
     /* Whether to call sync() before registering a path as valid. */
     bool syncBeforeRegistering;
 
+    /* Whether concurrent registrations of valid paths by different
+       processes are combined into a single transaction. */
+    bool groupCommit;
+
+    /* How long (in milliseconds) the process performing a group
+       commit waits for other registrations to join. */
+    unsigned int groupCommitWindow;
+
+    /* Number of threads used by ‘nix-store --verify --check-contents’
+       to hash store paths. */
+    unsigned int verifyThreads;
+
     /* Whether to use substitutes. */
     bool useSubstitutes;
 
@@ -148,6 +174,10 @@ struct Settings {
     /* Whether to build in chroot. */
     bool useChroot;
 
+    /* Whether to set up the parts of the chroot that are the same
+       for every build only once, in a template mount namespace. */
+    bool chrootTemplate;
+
     /* Set of ssh connection strings for the ssh substituter */
     Strings sshSubstituterHosts;
 
@@ -163,6 +193,10 @@ struct Settings {
     /* Whether to compress logs. */
     bool compressLog;
 
+    /* Whether compressed logs are written in the indexed block format
+       (see indexed-log.hh) rather than as a single bzip2 stream. */
+    bool indexedLog;
+
     /* Maximum number of bytes a builder can write to stdout/stderr
        before being killed (0 means no limit). */
     unsigned long maxLogSize;
@@ -205,6 +239,10 @@ struct Settings {
     /* Whether the importNative primop should be enabled */
     bool enableImportNative;
 
+    /* Whether clients of the daemon may answer read-only queries from
+       the path info snapshot published by the daemon. */
+    bool usePathInfoSnapshot;
+
 private:
     SettingsMap settings, overrides;
 
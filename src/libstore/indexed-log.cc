@@ -0,0 +1,345 @@
+#include "config.h"
+#include "indexed-log.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+namespace nix {
+
+
+const string indexedLogSuffix = ".nlog";
+
+static const string headerMagic = "NIXLOG1\n";
+static const string trailerMagic = "NIXLOGIX";
+
+static const size_t headerSize = 16;
+static const size_t blockHeaderSize = 8;
+static const size_t indexEntrySize = 16;
+static const size_t trailerSize = 32;
+
+/* Amount of uncompressed data per block. */
+static const size_t blockSize = 256 * 1024;
+
+/* Number of blocks that may be waiting for compression before
+   write() blocks. */
+static const size_t maxPending = 64;
+
+
+static void put32(string & s, unsigned int n)
+{
+    for (int i = 0; i < 4; ++i) s.push_back((n >> (i * 8)) & 0xff);
+}
+
+
+static void put64(string & s, unsigned long long n)
+{
+    for (int i = 0; i < 8; ++i) s.push_back((n >> (i * 8)) & 0xff);
+}
+
+
+static unsigned int get32(const unsigned char * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+
+static unsigned long long get64(const unsigned char * p)
+{
+    return get32(p) | ((unsigned long long) get32(p + 4) << 32);
+}
+
+
+/* Like writeFull(), but usable from the compression thread, which
+   must not call checkInterrupt(). */
+static void writeAll(int fd, const string & s)
+{
+    const char * p = s.data();
+    size_t left = s.size();
+    while (left) {
+        ssize_t res = ::write(fd, p, left);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("writing to log file");
+        }
+        p += res;
+        left -= res;
+    }
+}
+
+
+static bool preadAll(int fd, unsigned char * buf, size_t count, off_t offset)
+{
+    while (count) {
+        ssize_t res = pread(fd, buf, count, offset);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading log file");
+        }
+        if (res == 0) return false;
+        buf += res;
+        count -= res;
+        offset += res;
+    }
+    return true;
+}
+
+
+IndexedLogWriter::IndexedLogWriter(const Path & path)
+    : path(path), finished(false)
+{
+#if HAVE_ZSTD
+    codec = codecZstd;
+#else
+    codec = codecBzip2;
+#endif
+
+    fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1) throw SysError(format("creating log file ‘%1%’") % path);
+    closeOnExec(fd);
+
+    string header = headerMagic;
+    put32(header, codec);
+    put32(header, blockSize);
+    writeAll(fd, header);
+    offset = header.size();
+
+    thread = std::thread([this]() { compressor(); });
+}
+
+
+IndexedLogWriter::~IndexedLogWriter()
+{
+    try {
+        close();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void IndexedLogWriter::write(const unsigned char * data, size_t len)
+{
+    while (len) {
+        size_t n = std::min(len, blockSize - current.size());
+        current.append((const char *) data, n);
+        data += n;
+        len -= n;
+        if (current.size() == blockSize) queue(current);
+    }
+}
+
+
+void IndexedLogWriter::queue(string & block)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (error.empty() && pending.size() >= maxPending) wakeup.wait(lock);
+    if (!error.empty())
+        throw Error(format("writing log file ‘%1%’: %2%") % path % error);
+    pending.push_back(string());
+    pending.back().swap(block);
+    wakeup.notify_all();
+}
+
+
+void IndexedLogWriter::compressor()
+{
+    while (true) {
+        string block;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (pending.empty() && !finished) wakeup.wait(lock);
+            if (pending.empty()) return;
+            block.swap(pending.front());
+            pending.pop_front();
+            wakeup.notify_all();
+        }
+
+        try {
+            string data = compressBlock(codec, block);
+            string header;
+            put32(header, data.size());
+            put32(header, block.size());
+            writeAll(fd, header);
+            writeAll(fd, data);
+            BlockInfo info;
+            info.offset = offset + header.size();
+            info.compressedSize = data.size();
+            info.size = block.size();
+            index.push_back(info);
+            offset += header.size() + data.size();
+        } catch (std::exception & e) {
+            std::unique_lock<std::mutex> lock(mutex);
+            error = e.what();
+            pending.clear();
+            wakeup.notify_all();
+            return;
+        }
+    }
+}
+
+
+void IndexedLogWriter::close()
+{
+    if (fd == -1) return;
+
+    if (!current.empty()) queue(current);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished = true;
+        wakeup.notify_all();
+    }
+
+    thread.join();
+
+    if (!error.empty()) {
+        fd.close();
+        throw Error(format("writing log file ‘%1%’: %2%") % path % error);
+    }
+
+    string s;
+    unsigned long long totalSize = 0;
+    for (auto & i : index) {
+        put64(s, i.offset);
+        put32(s, i.compressedSize);
+        put32(s, i.size);
+        totalSize += i.size;
+    }
+    put64(s, offset);
+    put64(s, index.size());
+    put64(s, totalSize);
+    s += trailerMagic;
+    writeAll(fd, s);
+
+    fd.close();
+}
+
+
+IndexedLogReader::IndexedLogReader(const Path & path)
+    : path(path), totalSize(0), cachedBlock(-1)
+{
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening log file ‘%1%’") % path);
+
+    unsigned char header[headerSize];
+    if (!preadAll(fd, header, headerSize, 0) ||
+        string((char *) header, headerMagic.size()) != headerMagic)
+        throw Error(format("‘%1%’ is not an indexed log file") % path);
+    codec = (Codec) get32(header + 8);
+    if (codec != codecBzip2 && codec != codecZstd)
+        throw Error(format("log file ‘%1%’ uses an unknown compression method") % path);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("getting status of ‘%1%’") % path);
+
+    /* Use the index if the log is complete. */
+    unsigned char trailer[trailerSize];
+    if ((size_t) st.st_size >= headerSize + trailerSize &&
+        preadAll(fd, trailer, trailerSize, st.st_size - trailerSize) &&
+        string((char *) trailer + 24, trailerMagic.size()) == trailerMagic)
+    {
+        unsigned long long indexOffset = get64(trailer);
+        unsigned long long nrBlocks = get64(trailer + 8);
+        if (indexOffset + nrBlocks * indexEntrySize + trailerSize != (unsigned long long) st.st_size)
+            throw Error(format("log file ‘%1%’ has a corrupt index") % path);
+        string index(nrBlocks * indexEntrySize, 0);
+        preadAll(fd, (unsigned char *) index.data(), index.size(), indexOffset);
+        for (unsigned long long n = 0; n < nrBlocks; ++n) {
+            const unsigned char * p = (const unsigned char *) index.data() + n * indexEntrySize;
+            Block block;
+            block.offset = get64(p);
+            block.compressedSize = get32(p + 8);
+            block.size = get32(p + 12);
+            block.start = totalSize;
+            totalSize += block.size;
+            blocks.push_back(block);
+        }
+        return;
+    }
+
+    /* Otherwise walk the block headers, ignoring an incomplete last
+       block. */
+    unsigned long long pos = headerSize;
+    while (pos + blockHeaderSize <= (unsigned long long) st.st_size) {
+        unsigned char p[blockHeaderSize];
+        if (!preadAll(fd, p, blockHeaderSize, pos)) break;
+        Block block;
+        block.offset = pos + blockHeaderSize;
+        block.compressedSize = get32(p);
+        block.size = get32(p + 4);
+        if (block.offset + block.compressedSize > (unsigned long long) st.st_size) break;
+        block.start = totalSize;
+        totalSize += block.size;
+        blocks.push_back(block);
+        pos = block.offset + block.compressedSize;
+    }
+}
+
+
+const string & IndexedLogReader::getBlock(unsigned int n)
+{
+    if (cachedBlock == (int) n) return cachedData;
+    const Block & block(blocks[n]);
+    string compressed(block.compressedSize, 0);
+    if (!preadAll(fd, (unsigned char *) compressed.data(), compressed.size(), block.offset))
+        throw Error(format("log file ‘%1%’ is truncated") % path);
+    cachedBlock = -1;
+    decompressBlock(codec, compressed, cachedData, block.size);
+    cachedBlock = n;
+    return cachedData;
+}
+
+
+void IndexedLogReader::read(unsigned long long start, unsigned long long end, Sink & sink)
+{
+    end = std::min(end, totalSize);
+    if (start >= end) return;
+
+    /* Find the block containing `start'. */
+    auto i = std::upper_bound(blocks.begin(), blocks.end(), start,
+        [](unsigned long long pos, const Block & b) { return pos < b.start; });
+    assert(i != blocks.begin());
+    unsigned int n = i - blocks.begin() - 1;
+
+    for ( ; n < blocks.size() && blocks[n].start < end; ++n) {
+        checkInterrupt();
+        const string & data(getBlock(n));
+        unsigned long long from = std::max(start, blocks[n].start) - blocks[n].start;
+        unsigned long long to = std::min(end, blocks[n].start + blocks[n].size) - blocks[n].start;
+        sink((const unsigned char *) data.data() + from, to - from);
+    }
+}
+
+
+unsigned long long IndexedLogReader::tailOffset(unsigned int lines)
+{
+    if (lines == 0 || totalSize == 0) return totalSize;
+
+    /* A trailing newline doesn't start another line. */
+    unsigned long long pos = totalSize;
+    bool skipNewline = true;
+
+    for (int n = blocks.size() - 1; n >= 0; --n) {
+        const string & data(getBlock(n));
+        for (unsigned long long i = pos - blocks[n].start; i > 0; --i) {
+            if (data[i - 1] != '\n') { skipNewline = false; continue; }
+            if (skipNewline) { skipNewline = false; continue; }
+            if (--lines == 0) return blocks[n].start + i;
+        }
+        pos = blocks[n].start;
+    }
+
+    return 0;
+}
+
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "types.hh"
+#include "util.hh"
+#include "serialise.hh"
+#include "compression.hh"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+
+namespace nix {
+
+
+/* Indexed build logs.  The log is cut into blocks of uncompressed
+   data that are compressed independently, each preceded by a small
+   header giving its compressed and uncompressed size.  When the log
+   is closed, an index of all blocks and a trailer are appended.
+   Readers can thus seek to any byte of the uncompressed log while
+   decompressing at most a couple of blocks; a log without index
+   (e.g. of a build still in progress) can still be read by walking
+   the block headers. */
+
+extern const string indexedLogSuffix;
+
+
+class IndexedLogWriter
+{
+public:
+
+    /* Create the log file `path'.  Compression happens on a
+       background thread, so write() normally doesn't block. */
+    IndexedLogWriter(const Path & path);
+
+    ~IndexedLogWriter();
+
+    void write(const unsigned char * data, size_t len);
+
+    /* Compress the remaining data and write the index. */
+    void close();
+
+private:
+
+    struct BlockInfo
+    {
+        unsigned long long offset;
+        unsigned int compressedSize, size;
+    };
+
+    Path path;
+    AutoCloseFD fd;
+    Codec codec;
+    unsigned long long offset;
+    std::vector<BlockInfo> index;
+
+    string current;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<string> pending;
+    bool finished;
+    string error;
+
+    void queue(string & block);
+
+    void compressor();
+};
+
+
+class IndexedLogReader
+{
+public:
+
+    IndexedLogReader(const Path & path);
+
+    /* Size of the uncompressed log. */
+    unsigned long long size() { return totalSize; }
+
+    /* Write the uncompressed bytes in [start, end) to `sink'. */
+    void read(unsigned long long start, unsigned long long end, Sink & sink);
+
+    /* Return the offset of the first of the last `lines' lines. */
+    unsigned long long tailOffset(unsigned int lines);
+
+private:
+
+    struct Block
+    {
+        unsigned long long offset, start;
+        unsigned int compressedSize, size;
+    };
+
+    Path path;
+    AutoCloseFD fd;
+    Codec codec;
+    std::vector<Block> blocks;
+    unsigned long long totalSize;
+
+    /* The most recently decompressed block. */
+    int cachedBlock;
+    string cachedData;
+
+    const string & getBlock(unsigned int n);
+};
+
+
+}
@@ -0,0 +1,115 @@
+#include "jobserver.hh"
+#include "globals.hh"
+#include "pathlocks.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cassert>
+
+
+namespace nix {
+
+
+Jobserver::Jobserver(unsigned int tokens)
+    : tokens(tokens), builds(0)
+{
+    /* Create a FIFO and open it three times, and a lock file.  The
+       files themselves are not needed once they're open. */
+    Path dir = createTempDir("", "nix-jobserver");
+    AutoDelete autoDelete(dir);
+    Path fifo = dir + "/fifo";
+    if (mkfifo(fifo.c_str(), 0600) == -1)
+        throw SysError(format("creating FIFO ‘%1%’") % fifo);
+
+    /* Opening read-write doesn't wait for a reader, and ensures that
+       the other opens don't wait for a writer. */
+    fdWrite = open(fifo.c_str(), O_RDWR);
+    if (fdWrite == -1) throw SysError(format("opening ‘%1%’") % fifo);
+    fdRead = open(fifo.c_str(), O_RDONLY);
+    if (fdRead == -1) throw SysError(format("opening ‘%1%’") % fifo);
+    fdTake = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fdTake == -1) throw SysError(format("opening ‘%1%’") % fifo);
+
+    closeOnExec(fdWrite);
+    closeOnExec(fdRead);
+    closeOnExec(fdTake);
+
+    fdLock = openLockFile(dir + "/lock", true);
+
+    reset();
+}
+
+
+std::set<int> Jobserver::builderFDs() const
+{
+    std::set<int> fds;
+    fds.insert(fdRead);
+    fds.insert(fdWrite);
+    return fds;
+}
+
+
+string Jobserver::makeFlags() const
+{
+    /* Make before 4.2 only knows `--jobserver-fds', and only uses it
+       together with a `-j' without a number.  If the builder closed
+       the descriptors, Make falls back to a serial build. */
+    return (format("-j --jobserver-fds=%1%,%2% --jobserver-auth=%1%,%2%")
+        % (int) fdRead % (int) fdWrite).str();
+}
+
+
+bool Jobserver::acquire()
+{
+    char c;
+    while (true) {
+        ssize_t res = read(fdTake, &c, 1);
+        if (res == 1) return true;
+        if (res == 0 || errno == EAGAIN) return false;
+        if (errno != EINTR) throw SysError("taking a jobserver token");
+    }
+}
+
+
+void Jobserver::release()
+{
+    writeFull(fdWrite, (const unsigned char *) "+", 1);
+}
+
+
+void Jobserver::buildStarted()
+{
+    /* Wait if another process is just refilling the pool. */
+    if (builds == 0) lockFile(fdLock, ltRead, true);
+    builds++;
+}
+
+
+void Jobserver::buildFinished()
+{
+    assert(builds > 0);
+    if (--builds > 0) return;
+    if (lockFile(fdLock, ltWrite, false)) reset();
+    lockFile(fdLock, ltNone, true);
+}
+
+
+void Jobserver::reset()
+{
+    while (acquire()) ;
+    writeFull(fdWrite, (const unsigned char *) string(tokens, '+').data(), tokens);
+}
+
+
+std::shared_ptr<Jobserver> getJobserver()
+{
+    static std::shared_ptr<Jobserver> jobserver;
+    if (!jobserver)
+        jobserver = std::make_shared<Jobserver>(settings.jobserverTokens);
+    return jobserver;
+}
+
+
+}
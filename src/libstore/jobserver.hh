@@ -0,0 +1,81 @@
+#pragma once
+
+#include "types.hh"
+#include "util.hh"
+
+#include <memory>
+
+
+namespace nix {
+
+
+/* A pool of job tokens shared by all builds of a process and of the
+   processes it forks (such as the workers of the Nix daemon), using the
+   protocol of the GNU Make jobserver: a pipe holding one byte per
+   job that may run in addition to the one that every Make process
+   can always run.  A Make that finds `--jobserver-auth=R,W' (or
+   `-j --jobserver-fds=R,W' before Make 4.2) in its MAKEFLAGS reads a
+   byte from file descriptor R before starting an extra job, and
+   writes it back to W when the job is done.  Parallel Makes in
+   concurrent builds thus share one global budget. */
+class Jobserver
+{
+public:
+
+    /* Create a pool that allows `tokens' jobs in total. */
+    Jobserver(unsigned int tokens);
+
+    /* The file descriptors that builders must inherit. */
+    std::set<int> builderFDs() const;
+
+    /* The value of MAKEFLAGS that tells Make to use the pool. */
+    string makeFlags() const;
+
+    /* Take the token that accounts for the job that a build can
+       always run.  Returns false (and the build runs anyway) if the
+       pool is exhausted.  Never blocks. */
+    bool acquire();
+
+    /* Return a token taken by acquire(). */
+    void release();
+
+    /* Register the start and the end of a build that uses the pool.
+       When the last build in any process sharing the pool finishes,
+       the pool is refilled to its full size, to recover tokens that
+       were lost when Make processes were killed. */
+    void buildStarted();
+    void buildFinished();
+
+private:
+
+    unsigned int tokens;
+
+    /* The number of builds in this process that use the pool. */
+    unsigned int builds;
+
+    /* A lock on which every process with running builds holds a
+       read lock.  POSIX locks belong to processes rather than file
+       descriptors, so a process that gets a write lock knows that no
+       other process is building. */
+    AutoCloseFD fdLock;
+
+    /* The builders' ends of the pool, which must be blocking. */
+    AutoCloseFD fdRead, fdWrite;
+
+    /* A separate, non-blocking file description of the pool for
+       acquire() and reset().  This is why the pool is a FIFO rather
+       than a pipe: O_NONBLOCK applies to all users of a file
+       description. */
+    AutoCloseFD fdTake;
+
+    void reset();
+};
+
+
+/* Return the pool of this process, creating it on first use.  The Nix
+   daemon creates it before serving any clients, so that builds for
+   all clients share one pool. */
+std::shared_ptr<Jobserver> getJobserver();
+
+
+}
@@ -6,10 +6,17 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "affinity.hh"
+#include "path-info-snapshot.hh"
+#include "path-graph.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -40,14 +47,7 @@
 namespace nix {
 
 
-MakeError(SQLiteError, Error);
-MakeError(SQLiteBusy, SQLiteError);
-
-
-static void throwSQLiteError(sqlite3 * db, const format & f)
-    __attribute__ ((noreturn));
-
-static void throwSQLiteError(sqlite3 * db, const format & f)
+void throwSQLiteError(sqlite3 * db, const format & f)
 {
     int err = sqlite3_errcode(db);
     if (err == SQLITE_BUSY || err == SQLITE_PROTOCOL) {
@@ -152,57 +152,32 @@ void SQLiteStmt::bind()
 }
 
 
-/* Helper class to ensure that prepared statements are reset when
-   leaving the scope that uses them.  Unfinished prepared statements
-   prevent transactions from being aborted, and can cause locks to be
-   kept when they should be released. */
-struct SQLiteStmtUse
+SQLiteTxn::SQLiteTxn(sqlite3 * db) : active(false)
 {
-    SQLiteStmt & stmt;
-    SQLiteStmtUse(SQLiteStmt & stmt) : stmt(stmt)
-    {
-        stmt.reset();
-    }
-    ~SQLiteStmtUse()
-    {
-        try {
-            stmt.reset();
-        } catch (...) {
-            ignoreException();
-        }
-    }
-};
+    this->db = db;
+    if (sqlite3_exec(db, "begin;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "starting transaction");
+    active = true;
+}
 
 
-struct SQLiteTxn
+void SQLiteTxn::commit()
 {
-    bool active;
-    sqlite3 * db;
-
-    SQLiteTxn(sqlite3 * db) : active(false) {
-        this->db = db;
-        if (sqlite3_exec(db, "begin;", 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "starting transaction");
-        active = true;
-    }
+    if (sqlite3_exec(db, "commit;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "committing transaction");
+    active = false;
+}
 
-    void commit()
-    {
-        if (sqlite3_exec(db, "commit;", 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "committing transaction");
-        active = false;
-    }
 
-    ~SQLiteTxn()
-    {
-        try {
-            if (active && sqlite3_exec(db, "rollback;", 0, 0, 0) != SQLITE_OK)
-                throwSQLiteError(db, "aborting transaction");
-        } catch (...) {
-            ignoreException();
-        }
+SQLiteTxn::~SQLiteTxn()
+{
+    try {
+        if (active && sqlite3_exec(db, "rollback;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "aborting transaction");
+    } catch (...) {
+        ignoreException();
     }
-};
+}
 
 
 void checkStoreNotSymlink()
@@ -275,22 +250,7 @@ LocalStore::LocalStore(bool reserveSpace)
 
     checkStoreNotSymlink();
 
-    /* We can't open a SQLite database if the disk is full.  Since
-       this prevents the garbage collector from running when it's most
-       needed, we reserve some dummy space that we can free just
-       before doing a garbage collection. */
-    try {
-        Path reservedPath = settings.nixDBPath + "/reserved";
-        if (reserveSpace) {
-            struct stat st;
-            if (stat(reservedPath.c_str(), &st) == -1 ||
-                st.st_size != settings.reservedSize)
-                writeFile(reservedPath, string(settings.reservedSize, 'X'));
-        }
-        else
-            deletePath(reservedPath);
-    } catch (SysError & e) { /* don't care about errors */
-    }
+    updateReservedSpace(reserveSpace);
 
     /* Acquire the big fat lock in shared mode to make sure that no
        schema upgrade is in progress. */
@@ -353,29 +313,73 @@ LocalStore::LocalStore(bool reserveSpace)
 LocalStore::~LocalStore()
 {
     try {
-        foreach (RunningSubstituters::iterator, i, runningSubstituters) {
-            if (i->second.disabled) continue;
-            i->second.to.close();
-            i->second.from.close();
-            i->second.error.close();
-            if (i->second.pid != -1)
-                i->second.pid.wait(true);
-        }
+        stopSubstituters();
     } catch (...) {
         ignoreException();
     }
 
     try {
-        if (fdTempRoots != -1) {
-            fdTempRoots.close();
-            unlink(fnTempRoots.c_str());
-        }
+        removeTempRoots();
     } catch (...) {
         ignoreException();
     }
 }
 
 
+void LocalStore::stopSubstituters()
+{
+    foreach (RunningSubstituters::iterator, i, runningSubstituters) {
+        if (i->second.disabled) continue;
+        i->second.to.close();
+        i->second.from.close();
+        i->second.error.close();
+        if (i->second.pid != -1)
+            i->second.pid.wait(true);
+    }
+}
+
+
+void LocalStore::removeTempRoots()
+{
+    if (fdTempRoots != -1) {
+        fdTempRoots.close();
+        unlink(fnTempRoots.c_str());
+    }
+    tempRoots.clear();
+}
+
+
+void LocalStore::resetClientState()
+{
+    stopSubstituters();
+    runningSubstituters.clear();
+    didSetSubstituterEnv = false;
+    removeTempRoots();
+    pathContentsGoodCache.clear();
+}
+
+
+void LocalStore::updateReservedSpace(bool reserve)
+{
+    /* We can't open a SQLite database if the disk is full.  Since
+       this prevents the garbage collector from running when it's most
+       needed, we reserve some dummy space that we can free just
+       before doing a garbage collection. */
+    try {
+        Path reservedPath = settings.nixDBPath + "/reserved";
+        if (reserve) {
+            struct stat st;
+            if (stat(reservedPath.c_str(), &st) == -1 ||
+                st.st_size != settings.reservedSize)
+                writeFile(reservedPath, string(settings.reservedSize, 'X'));
+        }
+        else
+            deletePath(reservedPath);
+    } catch (SysError & e) { /* don't care about errors */
+    }
+}
+
+
 int LocalStore::getSchema()
 {
     int curSchema = 0;
@@ -437,14 +441,16 @@ void LocalStore::openDB(bool create)
     if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 40000;", 0, 0, 0) != SQLITE_OK)
         throwSQLiteError(db, "setting autocheckpoint interval");
 
-    /* Initialise the database schema, if necessary. */
-    if (create) {
-        const char * schema =
+    /* Initialise the database schema.  Since it only consists of
+       `create ... if not exists' statements, this is also done for
+       existing databases, so that tables added without a schema
+       version bump (like BuildTimes and BuildStats) are created in
+       them. */
+    const char * schema =
 #include "schema.sql.hh"
-            ;
-        if (sqlite3_exec(db, (const char *) schema, 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "initialising database schema");
-    }
+        ;
+    if (sqlite3_exec(db, (const char *) schema, 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "initialising database schema");
 
     /* Prepare SQL statements. */
     stmtRegisterValidPath.create(db,
@@ -471,6 +477,22 @@ void LocalStore::openDB(bool create)
     stmtClearFailedPath.create(db,
         "delete from FailedPaths where ?1 = '*' or path = ?1 "
         "or path in (select d.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where v.path = ?1);");
+    /* Average the new duration with the previous ones, giving recent
+       builds more weight. */
+    stmtRegisterBuildTime.create(db,
+        "insert or replace into BuildTimes (name, duration, time) values "
+        "(?1, coalesce((select (duration + ?2) / 2 from BuildTimes where name = ?1), ?2), ?3);");
+    stmtQueryBuildTime.create(db,
+        "select duration from BuildTimes where name = ?;");
+    stmtRegisterBuildStats.create(db,
+        "insert into BuildStats (drvPath, startTime, succeeded, wallTime, userTime, systemTime, maxRSS, bytesRead, bytesWritten) "
+        "values (?, ?, ?, ?, ?, ?, ?, ?, ?);");
+    stmtQueryBuildStats.create(db,
+        "select startTime, succeeded, wallTime, userTime, systemTime, maxRSS, bytesRead, bytesWritten "
+        "from BuildStats where drvPath = ? order by id;");
+    stmtPruneBuildStats.create(db,
+        "delete from BuildStats where drvPath = ? and id not in "
+        "(select id from BuildStats where drvPath = ? order by id desc limit ?);");
     stmtAddDerivationOutput.create(db,
         "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
     stmtQueryValidDerivers.create(db,
@@ -756,6 +778,102 @@ bool LocalStore::hasPathFailed(const Path & path)
 }
 
 
+void LocalStore::registerBuildTime(const string & name, unsigned long long duration)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtRegisterBuildTime);
+        stmtRegisterBuildTime.bind(name);
+        stmtRegisterBuildTime.bind64(duration);
+        stmtRegisterBuildTime.bind(time(0));
+        if (sqlite3_step(stmtRegisterBuildTime) != SQLITE_DONE)
+            throwSQLiteError(db, format("registering build time of ‘%1%’") % name);
+    } end_retry_sqlite;
+}
+
+
+long long LocalStore::queryBuildTime(const string & name)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryBuildTime);
+        stmtQueryBuildTime.bind(name);
+        int res = sqlite3_step(stmtQueryBuildTime);
+        if (res == SQLITE_DONE) return -1;
+        if (res != SQLITE_ROW)
+            throwSQLiteError(db, format("querying build time of ‘%1%’") % name);
+        return sqlite3_column_int64(stmtQueryBuildTime, 0);
+    } end_retry_sqlite;
+}
+
+
+/* The number of builds of a derivation for which statistics are
+   kept; older ones are deleted when a new one is recorded. */
+static const int maxBuildStats = 20;
+
+
+void LocalStore::registerBuildStats(const BuildStats & stats)
+{
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        {
+            SQLiteStmtUse use(stmtRegisterBuildStats);
+            stmtRegisterBuildStats.bind(stats.drvPath);
+            stmtRegisterBuildStats.bind64(stats.startTime);
+            stmtRegisterBuildStats.bind(stats.succeeded ? 1 : 0);
+            stmtRegisterBuildStats.bind64(stats.wallTime);
+            stmtRegisterBuildStats.bind64(stats.userTime);
+            stmtRegisterBuildStats.bind64(stats.systemTime);
+            stmtRegisterBuildStats.bind64(stats.maxRSS);
+            stmtRegisterBuildStats.bind64(stats.bytesRead);
+            stmtRegisterBuildStats.bind64(stats.bytesWritten);
+            if (sqlite3_step(stmtRegisterBuildStats) != SQLITE_DONE)
+                throwSQLiteError(db, format("registering build statistics of ‘%1%’") % stats.drvPath);
+        }
+
+        {
+            SQLiteStmtUse use(stmtPruneBuildStats);
+            stmtPruneBuildStats.bind(stats.drvPath);
+            stmtPruneBuildStats.bind(stats.drvPath);
+            stmtPruneBuildStats.bind(maxBuildStats);
+            if (sqlite3_step(stmtPruneBuildStats) != SQLITE_DONE)
+                throwSQLiteError(db, format("pruning build statistics of ‘%1%’") % stats.drvPath);
+        }
+
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
+std::vector<BuildStats> LocalStore::queryBuildStats(const Path & drvPath)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryBuildStats);
+        stmtQueryBuildStats.bind(drvPath);
+
+        std::vector<BuildStats> res;
+        int r;
+        while ((r = sqlite3_step(stmtQueryBuildStats)) == SQLITE_ROW) {
+            BuildStats stats;
+            stats.drvPath = drvPath;
+            stats.startTime = sqlite3_column_int64(stmtQueryBuildStats, 0);
+            stats.succeeded = sqlite3_column_int(stmtQueryBuildStats, 1) != 0;
+            stats.wallTime = sqlite3_column_int64(stmtQueryBuildStats, 2);
+            stats.userTime = sqlite3_column_int64(stmtQueryBuildStats, 3);
+            stats.systemTime = sqlite3_column_int64(stmtQueryBuildStats, 4);
+            stats.maxRSS = sqlite3_column_int64(stmtQueryBuildStats, 5);
+            stats.bytesRead = sqlite3_column_int64(stmtQueryBuildStats, 6);
+            stats.bytesWritten = sqlite3_column_int64(stmtQueryBuildStats, 7);
+            res.push_back(stats);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, format("querying build statistics of ‘%1%’") % drvPath);
+
+        return res;
+    } end_retry_sqlite;
+}
+
+
 PathSet LocalStore::queryFailedPaths()
 {
     retry_sqlite {
@@ -808,53 +926,112 @@ Hash parseHashField(const Path & path, const string & s)
 }
 
 
-ValidPathInfo LocalStore::queryPathInfo(const Path & path)
+/* Fill in `info' if `path' is valid.  Must be called inside
+   retry_sqlite. */
+bool LocalStore::queryPathInfo_(const Path & path, ValidPathInfo & info)
 {
-    ValidPathInfo info;
+    info = ValidPathInfo();
     info.path = path;
 
-    assertStorePath(path);
+    /* Get the path info. */
+    SQLiteStmtUse use1(stmtQueryPathInfo);
 
-    retry_sqlite {
+    stmtQueryPathInfo.bind(path);
 
-        /* Get the path info. */
-        SQLiteStmtUse use1(stmtQueryPathInfo);
+    int r = sqlite3_step(stmtQueryPathInfo);
+    if (r == SQLITE_DONE) return false;
+    if (r != SQLITE_ROW) throwSQLiteError(db, "querying path in database");
 
-        stmtQueryPathInfo.bind(path);
+    info.id = sqlite3_column_int(stmtQueryPathInfo, 0);
 
-        int r = sqlite3_step(stmtQueryPathInfo);
-        if (r == SQLITE_DONE) throw Error(format("path ‘%1%’ is not valid") % path);
-        if (r != SQLITE_ROW) throwSQLiteError(db, "querying path in database");
+    const char * s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 1);
+    assert(s);
+    info.hash = parseHashField(path, s);
 
-        info.id = sqlite3_column_int(stmtQueryPathInfo, 0);
+    info.registrationTime = sqlite3_column_int(stmtQueryPathInfo, 2);
 
-        const char * s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 1);
+    s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
+    if (s) info.deriver = s;
+
+    /* Note that narSize = NULL yields 0. */
+    info.narSize = sqlite3_column_int64(stmtQueryPathInfo, 4);
+
+    /* Get the references. */
+    SQLiteStmtUse use2(stmtQueryReferences);
+
+    stmtQueryReferences.bind(info.id);
+
+    while ((r = sqlite3_step(stmtQueryReferences)) == SQLITE_ROW) {
+        s = (const char *) sqlite3_column_text(stmtQueryReferences, 0);
         assert(s);
-        info.hash = parseHashField(path, s);
+        info.references.insert(s);
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting references of ‘%1%’") % path);
+
+    return true;
+}
+
 
-        info.registrationTime = sqlite3_column_int(stmtQueryPathInfo, 2);
+ValidPathInfo LocalStore::queryPathInfo(const Path & path)
+{
+    assertStorePath(path);
+
+    retry_sqlite {
+        ValidPathInfo info;
+        if (!queryPathInfo_(path, info))
+            throw Error(format("path ‘%1%’ is not valid") % path);
+        return info;
+    } end_retry_sqlite;
+}
+
+
+ValidPathInfos LocalStore::queryPathInfos(const PathSet & paths)
+{
+    for (auto & i : paths) assertStorePath(i);
 
-        s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
-        if (s) info.deriver = s;
+    /* Do all queries in one read transaction rather than taking and
+       releasing the database lock for every statement. */
+    retry_sqlite {
+        SQLiteTxn txn(db);
+        ValidPathInfos res;
+        for (auto & i : paths) {
+            ValidPathInfo info;
+            if (queryPathInfo_(i, info)) res.push_back(info);
+        }
+        txn.commit();
+        return res;
+    } end_retry_sqlite;
+}
 
-        /* Note that narSize = NULL yields 0. */
-        info.narSize = sqlite3_column_int64(stmtQueryPathInfo, 4);
 
-        /* Get the references. */
-        SQLiteStmtUse use2(stmtQueryReferences);
+std::map<Hash, Path> LocalStore::queryPathsByHash(const std::set<Hash> & hashes)
+{
+    std::map<Hash, Path> res;
+    if (hashes.empty()) return res;
 
-        stmtQueryReferences.bind(info.id);
+    /* There is no index on the hash column, so a single scan is the
+       cheapest way to look up many hashes. */
+    retry_sqlite {
+        res.clear();
 
-        while ((r = sqlite3_step(stmtQueryReferences)) == SQLITE_ROW) {
-            s = (const char *) sqlite3_column_text(stmtQueryReferences, 0);
-            assert(s);
-            info.references.insert(s);
+        SQLiteStmt stmt;
+        stmt.create(db, "select path, hash from ValidPaths");
+
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char * path = (const char *) sqlite3_column_text(stmt, 0);
+            const char * s = (const char *) sqlite3_column_text(stmt, 1);
+            assert(path && s);
+            Hash hash = parseHashField(path, s);
+            if (hashes.find(hash) != hashes.end()) res[hash] = path;
         }
 
         if (r != SQLITE_DONE)
-            throwSQLiteError(db, format("error getting references of ‘%1%’") % path);
+            throwSQLiteError(db, "error querying valid paths by hash");
 
-        return info;
+        return res;
     } end_retry_sqlite;
 }
 
@@ -872,6 +1049,9 @@ void LocalStore::updatePathInfo(const ValidPathInfo & info)
     stmtUpdatePathInfo.bind(info.path);
     if (sqlite3_step(stmtUpdatePathInfo) != SQLITE_DONE)
         throwSQLiteError(db, format("updating info of path ‘%1%’ in database") % info.path);
+
+    /* Inside a transaction, the caller bumps after committing. */
+    if (sqlite3_get_autocommit(db)) bumpPathInfoGeneration();
 }
 
 
@@ -1286,44 +1466,260 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
      * expense of some speed of the path registering operation. */
     if (settings.syncBeforeRegistering) sync();
 
+    if (settings.groupCommit) {
+        registerValidPathsGrouped(infos);
+        return;
+    }
+
+    bool updated = false;
+
     retry_sqlite {
         SQLiteTxn txn(db);
-        PathSet paths;
-
-        foreach (ValidPathInfos::const_iterator, i, infos) {
-            assert(i->hash.type == htSHA256);
-            if (isValidPath_(i->path))
-                updatePathInfo(*i);
-            else
-                addValidPath(*i, false);
-            paths.insert(i->path);
+        updated = registerValidPaths_(infos);
+        txn.commit();
+    } end_retry_sqlite;
+
+    if (updated) bumpPathInfoGeneration();
+    bumpPathInfoRegistrations();
+}
+
+
+/* Register `infos' in the current transaction.  Returns whether the
+   metadata of any already valid path was changed. */
+bool LocalStore::registerValidPaths_(const ValidPathInfos & infos)
+{
+    bool updated = false;
+    PathSet paths;
+
+    foreach (ValidPathInfos::const_iterator, i, infos) {
+        assert(i->hash.type == htSHA256);
+        if (isValidPath_(i->path)) {
+            updatePathInfo(*i);
+            updated = true;
+        } else
+            addValidPath(*i, false);
+        paths.insert(i->path);
+    }
+
+    foreach (ValidPathInfos::const_iterator, i, infos) {
+        unsigned long long referrer = queryValidPathId(i->path);
+        foreach (PathSet::iterator, j, i->references)
+            addReference(referrer, queryValidPathId(*j));
+    }
+
+    /* Check that the derivation outputs are correct.  We can't do
+       this in addValidPath() above, because the references might
+       not be valid yet. */
+    foreach (ValidPathInfos::const_iterator, i, infos)
+        if (isDerivation(i->path)) {
+            // FIXME: inefficient; we already loaded the
+            // derivation in addValidPath().
+            Derivation drv = readDerivation(i->path);
+            checkDerivationOutputs(i->path, drv);
         }
 
-        foreach (ValidPathInfos::const_iterator, i, infos) {
-            unsigned long long referrer = queryValidPathId(i->path);
-            foreach (PathSet::iterator, j, i->references)
-                addReference(referrer, queryValidPathId(*j));
+    /* Do a topological sort of the paths.  This will throw an
+       error if a cycle is detected and roll back the
+       transaction.  Cycles can only occur when a derivation
+       has multiple outputs. */
+    PathGraph(paths, infos).topoSort();
+
+    return updated;
+}
+
+
+/* Group commit.  A process that wants to register paths writes a
+   request to the directory /nix/var/nix/db/registrations and locks
+   it for as long as it's waiting.  It then acquires the leader lock.
+   If by that time its request has been handled by another process,
+   it just picks up the result.  Otherwise it becomes the leader: it
+   waits briefly for other requests to arrive, registers all pending
+   requests in a single transaction, and writes a result for each of
+   them after the transaction has been committed.  Thus a
+   registration never returns before it's durable. */
+
+static void writeRegistration(const ValidPathInfos & infos, Sink & sink)
+{
+    writeInt(infos.size(), sink);
+    foreach (ValidPathInfos::const_iterator, i, infos) {
+        writeString(i->path, sink);
+        writeString(printHash(i->hash), sink);
+        writeString(i->deriver, sink);
+        writeStrings(i->references, sink);
+        writeLongLong(i->narSize, sink);
+        writeLongLong(i->registrationTime, sink);
+    }
+}
+
+
+static ValidPathInfos readRegistration(Source & source)
+{
+    ValidPathInfos infos;
+    unsigned int count = readInt(source);
+    while (count--) {
+        ValidPathInfo info;
+        info.path = readStorePath(source);
+        info.hash = parseHash(htSHA256, readString(source));
+        info.deriver = readString(source);
+        if (info.deriver != "") assertStorePath(info.deriver);
+        info.references = readStorePaths<PathSet>(source);
+        info.narSize = readLongLong(source);
+        info.registrationTime = readLongLong(source);
+        infos.push_back(info);
+    }
+    return infos;
+}
+
+
+void LocalStore::registerValidPathsGrouped(const ValidPathInfos & infos)
+{
+    Path dir = settings.nixDBPath + "/registrations";
+    createDirs(dir);
+
+    static unsigned int counter = 0;
+    string name = (format("%1%-%2%") % getpid() % counter++).str();
+    Path request = dir + "/" + name + ".req";
+    Path result = dir + "/" + name + ".res";
+    Path tmp = dir + "/" + name + ".tmp";
+
+    /* Remove a result left behind by a dead process with the same
+       PID. */
+    if (unlink(result.c_str()) == -1 && errno != ENOENT)
+        throw SysError(format("removing ‘%1%’") % result);
+
+    /* The request must be locked before it becomes visible, otherwise
+       a leader could mistake it for a request of a dead process. */
+    AutoCloseFD fdRequest = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fdRequest == -1)
+        throw SysError(format("creating ‘%1%’") % tmp);
+    closeOnExec(fdRequest);
+    lockFile(fdRequest, ltWrite, true);
+
+    StringSink sink;
+    writeRegistration(infos, sink);
+    writeFull(fdRequest, (const unsigned char *) sink.s.data(), sink.s.size());
+
+    if (rename(tmp.c_str(), request.c_str()) == -1)
+        throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmp % request);
+
+    AutoCloseFD fdLeader = openLockFile(dir + "/leader.lock", true);
+
+    try {
+        while (true) {
+            lockFile(fdLeader, ltWrite, true);
+
+            if (pathExists(result)) {
+                string error = readFile(result);
+                unlink(result.c_str());
+                if (error != "") throw Error(error);
+                return;
+            }
+
+            if (settings.groupCommitWindow) {
+                struct timespec t;
+                t.tv_sec = settings.groupCommitWindow / 1000;
+                t.tv_nsec = (settings.groupCommitWindow % 1000) * 1000000;
+                nanosleep(&t, 0);
+            }
+
+            commitPendingRegistrations(dir, name);
         }
+    } catch (...) {
+        unlink(request.c_str());
+        throw;
+    }
+}
 
-        /* Check that the derivation outputs are correct.  We can't do
-           this in addValidPath() above, because the references might
-           not be valid yet. */
-        foreach (ValidPathInfos::const_iterator, i, infos)
-            if (isDerivation(i->path)) {
-                // FIXME: inefficient; we already loaded the
-                // derivation in addValidPath().
-                Derivation drv = readDerivation(i->path);
-                checkDerivationOutputs(i->path, drv);
+
+void LocalStore::commitPendingRegistrations(const Path & dir, const string & ownRequest)
+{
+    struct Request
+    {
+        string name;
+        AutoCloseFD fd;
+        ValidPathInfos infos;
+        string error;
+    };
+
+    std::list<Request> requests;
+
+    for (auto & i : readDirectory(dir)) {
+        if (!hasSuffix(i.name, ".req")) continue;
+        Path path = dir + "/" + i.name;
+        string name(i.name, 0, i.name.size() - 4);
+
+        /* If we can lock the request, the process that made it is
+           gone, so the paths may not even exist anymore. */
+        requests.push_back(Request());
+        Request & r(requests.back());
+        r.name = name;
+        if (name != ownRequest) {
+            r.fd = open(path.c_str(), O_RDONLY);
+            if (r.fd == -1) {
+                if (errno != ENOENT)
+                    throw SysError(format("opening ‘%1%’") % path);
+                requests.pop_back();
+                continue;
             }
+            if (lockFile(r.fd, ltRead, false)) {
+                printMsg(lvlError, format("removing stale registration request ‘%1%’") % path);
+                unlink(path.c_str());
+                requests.pop_back();
+                continue;
+            }
+        }
 
-        /* Do a topological sort of the paths.  This will throw an
-           error if a cycle is detected and roll back the
-           transaction.  Cycles can only occur when a derivation
-           has multiple outputs. */
-        topoSortPaths(*this, paths);
+        try {
+            string data = readFile(path);
+            StringSource source(data);
+            r.infos = readRegistration(source);
+        } catch (EndOfFile & e) {
+            throw Error(format("registration request ‘%1%’ is truncated") % path);
+        }
+    }
+
+    debug(format("committing %1% registration requests") % requests.size());
+
+    bool updated = false;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+        updated = false;
+
+        foreach (std::list<Request>::iterator, i, requests) {
+            /* Use a savepoint so that an invalid request (e.g. one
+               containing a cycle) doesn't affect the others. */
+            if (sqlite3_exec(db, "savepoint registration;", 0, 0, 0) != SQLITE_OK)
+                throwSQLiteError(db, "creating savepoint");
+            try {
+                if (registerValidPaths_(i->infos)) updated = true;
+                i->error = "";
+            } catch (SQLiteBusy & e) {
+                throw;
+            } catch (Error & e) {
+                if (sqlite3_exec(db, "rollback to registration;", 0, 0, 0) != SQLITE_OK)
+                    throwSQLiteError(db, "rolling back to savepoint");
+                i->error = e.msg();
+            }
+            if (sqlite3_exec(db, "release registration;", 0, 0, 0) != SQLITE_OK)
+                throwSQLiteError(db, "releasing savepoint");
+        }
 
         txn.commit();
     } end_retry_sqlite;
+
+    /* Only now can we tell the other processes. */
+    foreach (std::list<Request>::iterator, i, requests) {
+        Path result = dir + "/" + i->name + ".res";
+        Path tmp = result + ".tmp";
+        writeFile(tmp, i->error);
+        if (rename(tmp.c_str(), result.c_str()) == -1)
+            throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmp % result);
+        unlink((dir + "/" + i->name + ".req").c_str());
+    }
+
+    if (updated) bumpPathInfoGeneration();
+    bumpPathInfoRegistrations();
 }
 
 
@@ -1344,6 +1740,9 @@ void LocalStore::invalidatePath(const Path & path)
 
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
+
+    /* Inside a transaction, the caller bumps after committing. */
+    if (sqlite3_get_autocommit(db)) bumpPathInfoGeneration();
 }
 
 
@@ -1498,8 +1897,8 @@ void LocalStore::exportPath(const Path & path, bool sign,
 
     printMsg(lvlInfo, format("exporting path ‘%1%’") % path);
 
-    if (!isValidPath(path))
-        throw Error(format("path ‘%1%’ is not valid") % path);
+    /* This throws if the path is not valid. */
+    ValidPathInfo info = queryPathInfo(path);
 
     HashAndWriteSink hashAndWriteSink(sink);
 
@@ -1509,7 +1908,7 @@ void LocalStore::exportPath(const Path & path, bool sign,
        filesystem corruption from spreading to other machines.
        Don't complain if the stored hash is zero (unknown). */
     Hash hash = hashAndWriteSink.currentHash();
-    Hash storedHash = queryPathHash(path);
+    Hash storedHash = info.hash;
     if (hash != storedHash && storedHash != Hash(storedHash.type))
         throw Error(format("hash of path ‘%1%’ has changed from ‘%2%’ to ‘%3%’!") % path
             % printHash(storedHash) % printHash(hash));
@@ -1518,12 +1917,9 @@ void LocalStore::exportPath(const Path & path, bool sign,
 
     writeString(path, hashAndWriteSink);
 
-    PathSet references;
-    queryReferences(path, references);
-    writeStrings(references, hashAndWriteSink);
+    writeStrings(info.references, hashAndWriteSink);
 
-    Path deriver = queryDeriver(path);
-    writeString(deriver, hashAndWriteSink);
+    writeString(info.deriver, hashAndWriteSink);
 
     if (sign) {
         Hash hash = hashAndWriteSink.currentHash();
@@ -1569,6 +1965,12 @@ struct HashAndReadSource : Source
         if (hashing) hashSink(data, n);
         return n;
     }
+    size_t readDirect(const unsigned char * & data, size_t len)
+    {
+        size_t n = readSource.readDirect(data, len);
+        if (hashing && n) hashSink(data, n);
+        return n;
+    }
 };
 
 
@@ -1709,6 +2111,99 @@ Paths LocalStore::importPaths(bool requireSignature, Source & source)
 }
 
 
+/* Recreate the tree `from' at `to', hard-linking regular files where
+   possible. */
+static void linkOrCopyTree(const Path & from, const Path & to)
+{
+    checkInterrupt();
+
+    struct stat st;
+    if (lstat(from.c_str(), &st))
+        throw SysError(format("getting attributes of path ‘%1%’") % from);
+
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdir(to.c_str(), 0755) == -1)
+            throw SysError(format("creating directory ‘%1%’") % to);
+        for (auto & i : readDirectory(from))
+            linkOrCopyTree(from + "/" + i.name, to + "/" + i.name);
+    }
+
+    else if (S_ISLNK(st.st_mode)) {
+        if (symlink(readLink(from).c_str(), to.c_str()) == -1)
+            throw SysError(format("creating symlink ‘%1%’") % to);
+    }
+
+    else if (S_ISREG(st.st_mode)) {
+        if (link(from.c_str(), to.c_str()) == 0) return;
+        if (errno != EXDEV && errno != EMLINK && errno != EPERM)
+            throw SysError(format("creating hard link ‘%1%’") % to);
+        AutoCloseFD fdFrom = open(from.c_str(), O_RDONLY);
+        if (fdFrom == -1) throw SysError(format("opening ‘%1%’") % from);
+        AutoCloseFD fdTo = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+        if (fdTo == -1) throw SysError(format("creating ‘%1%’") % to);
+        std::vector<unsigned char> buf(65536);
+        while (true) {
+            checkInterrupt();
+            ssize_t n = read(fdFrom, buf.data(), buf.size());
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError(format("reading ‘%1%’") % from);
+            }
+            if (n == 0) break;
+            writeFull(fdTo, buf.data(), n);
+        }
+    }
+
+    else
+        throw Error(format("file ‘%1%’ has an unsupported type") % from);
+}
+
+
+void LocalStore::addIdenticalPath(const Path & from, const ValidPathInfo & info)
+{
+    assertStorePath(info.path);
+
+    addTempRoot(info.path);
+
+    if (isValidPath(info.path)) return;
+
+    PathLocks outputLock(singleton<PathSet, Path>(info.path));
+
+    if (isValidPath(info.path)) return;
+
+    printMsg(lvlInfo, format("reusing the contents of ‘%1%’ for ‘%2%’") % from % info.path);
+
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path tmp = tmpDir + "/x";
+
+    linkOrCopyTree(from, tmp);
+
+    if (pathExists(info.path)) deletePath(info.path);
+
+    if (rename(tmp.c_str(), info.path.c_str()) == -1)
+        throw SysError(format("cannot move ‘%1%’ to ‘%2%’") % tmp % info.path);
+
+    canonicalisePathMetaData(info.path, -1);
+
+    /* Don't trust the caller: `from' may have been modified, or its
+       hash may just be a collision in the caller's data. */
+    HashResult hash = hashPath(htSHA256, info.path);
+    if (hash.first != info.hash) {
+        deletePath(info.path);
+        throw Error(format("contents of ‘%1%’ do not match the expected hash of ‘%2%’")
+            % from % info.path);
+    }
+
+    ValidPathInfo info2 = info;
+    info2.narSize = hash.second;
+    info2.deriver = info.deriver != "" && isValidPath(info.deriver) ? info.deriver : "";
+    registerValidPath(info2);
+
+    outputLock.setDeletion(true);
+}
+
+
 void LocalStore::invalidatePathChecked(const Path & path)
 {
     assertStorePath(path);
@@ -1727,6 +2222,73 @@ void LocalStore::invalidatePathChecked(const Path & path)
 
         txn.commit();
     } end_retry_sqlite;
+
+    bumpPathInfoGeneration();
+}
+
+
+void LocalStore::publishPathInfoSnapshot()
+{
+    /* Only one process needs to do this at a time. */
+    AutoCloseFD fdLock = openLockFile(pathInfoSnapshotLockFile(), true);
+    if (!lockFile(fdLock, ltWrite, false)) return;
+
+    /* Read the counters before the database, so that concurrent
+       changes make the snapshot stale rather than wrong. */
+    unsigned long long generation, registrations;
+    readPathInfoCounters(generation, registrations);
+
+    std::vector<ValidPathInfo> infos;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        infos.clear();
+        std::map<unsigned long long, size_t> ids;
+
+        SQLiteStmt stmtPaths;
+        stmtPaths.create(db, "select id, path, hash, registrationTime, deriver, narSize from ValidPaths;");
+
+        int r;
+        while ((r = sqlite3_step(stmtPaths)) == SQLITE_ROW) {
+            ValidPathInfo info;
+            info.id = sqlite3_column_int64(stmtPaths, 0);
+            const char * s = (const char *) sqlite3_column_text(stmtPaths, 1);
+            assert(s);
+            info.path = s;
+            s = (const char *) sqlite3_column_text(stmtPaths, 2);
+            assert(s);
+            info.hash = parseHashField(info.path, s);
+            info.registrationTime = sqlite3_column_int(stmtPaths, 3);
+            s = (const char *) sqlite3_column_text(stmtPaths, 4);
+            if (s) info.deriver = s;
+            info.narSize = sqlite3_column_int64(stmtPaths, 5);
+            ids[info.id] = infos.size();
+            infos.push_back(info);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying valid paths");
+
+        SQLiteStmt stmtRefs;
+        stmtRefs.create(db, "select referrer, reference from Refs;");
+
+        while ((r = sqlite3_step(stmtRefs)) == SQLITE_ROW) {
+            auto referrer = ids.find(sqlite3_column_int64(stmtRefs, 0));
+            auto reference = ids.find(sqlite3_column_int64(stmtRefs, 1));
+            assert(referrer != ids.end() && reference != ids.end());
+            infos[referrer->second].references.insert(infos[reference->second].path);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying references");
+
+        txn.commit();
+    } end_retry_sqlite;
+
+    writePathInfoSnapshot(infos, generation, registrations);
+
+    printMsg(lvlDebug, format("published path info snapshot with %1% paths") % infos.size());
 }
 
 
@@ -1755,39 +2317,179 @@ bool LocalStore::verifyStore(bool checkContents, bool repair)
     fdGCLock.close();
 
     /* Optionally, check the content hashes (slow). */
-    if (checkContents) {
-        printMsg(lvlInfo, "checking hashes...");
+    if (checkContents) verifyPathContents(validPaths, repair, errors);
 
-        Hash nullHash(htSHA256);
+    return errors;
+}
+
+
+/* Check the content hashes of `paths'.  The hashing is done by a
+   pool of threads, while everything else (reporting, repairing and
+   updating the database) happens on the calling thread.  Paths that
+   have been checked are appended to a checkpoint file, so that an
+   interrupted run can be resumed.  The first line of the file is the
+   time at which the run started; a checkpoint older than
+   `maxCheckpointAge' is ignored, since the paths it lists may have
+   been modified since. */
+static const time_t maxCheckpointAge = 24 * 60 * 60;
+
+
+void LocalStore::verifyPathContents(const PathSet & paths, bool repair, bool & errors)
+{
+    Hash nullHash(htSHA256);
+
+    Path checkpointFile = settings.nixDBPath + "/verify-checkpoint";
+    PathSet checked;
+    time_t started = time(0);
+    if (pathExists(checkpointFile)) {
+        Strings lines = tokenizeString<Strings>(readFile(checkpointFile), "\n");
+        long long t;
+        if (!lines.empty() && string2Int(lines.front(), t) && t <= started && started - t < maxCheckpointAge) {
+            started = t;
+            lines.pop_front();
+            checked = PathSet(lines.begin(), lines.end());
+            printMsg(lvlError, format("resuming an interrupted verification; skipping %1% paths "
+                    "that have already been checked (remove ‘%2%’ to check all paths)")
+                % checked.size() % checkpointFile);
+        } else
+            printMsg(lvlError, format("ignoring outdated verification checkpoint ‘%1%’") % checkpointFile);
+    }
+
+    struct Item
+    {
+        ValidPathInfo info;
+        ino_t ino;
+        HashResult current;
+        string error;
+    };
+
+    std::vector<Item> items;
+
+    foreach (PathSet::const_iterator, i, paths) {
+        if (checked.find(*i) != checked.end()) continue;
+        Item item;
+        try {
+            item.info = queryPathInfo(*i);
+        } catch (Error & e) {
+            /* It's possible that the path got GC'ed. */
+            printMsg(lvlError, format("warning: %1%") % e.msg());
+            errors = true;
+            continue;
+        }
+        struct stat st;
+        item.ino = lstat(i->c_str(), &st) == 0 ? st.st_ino : 0;
+        items.push_back(item);
+    }
+
+    /* Hash the paths in inode order, which on most file systems
+       approximates their order on disk, to reduce seeking. */
+    std::sort(items.begin(), items.end(),
+        [](const Item & a, const Item & b) { return a.ino < b.ino; });
+
+    unsigned int nrThreads = std::max(1U, std::min(settings.verifyThreads, (unsigned int) items.size()));
+
+    printMsg(lvlInfo, format("checking hashes of %1% paths using %2% threads...") % items.size() % nrThreads);
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    size_t next = 0;
+    std::deque<size_t> finished;
+    bool quit = false, interrupted = false;
+
+    auto worker = [&]() {
+        while (true) {
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (quit || next == items.size()) return;
+                n = next++;
+            }
+            Item & item(items[n]);
+            try {
+                item.current = hashPath(item.info.hash.type, item.info.path);
+            } catch (Interrupted & e) {
+                /* Only one thread gets to see the interrupt. */
+                std::unique_lock<std::mutex> lock(mutex);
+                interrupted = true;
+                wakeup.notify_all();
+                return;
+            } catch (Error & e) {
+                item.error = e.msg();
+            } catch (std::exception & e) {
+                item.error = e.what();
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.push_back(n);
+            wakeup.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    auto stopThreads = [&]() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+        }
+        for (auto & i : threads) i.join();
+        threads.clear();
+    };
+
+    try {
+        AutoCloseFD fdCheckpoint = open(checkpointFile.c_str(),
+            O_WRONLY | O_APPEND | O_CREAT | (checked.empty() ? O_TRUNC : 0), 0600);
+        if (fdCheckpoint == -1)
+            throw SysError(format("opening ‘%1%’") % checkpointFile);
+        if (checked.empty()) {
+            string line = (format("%1%\n") % started).str();
+            writeFull(fdCheckpoint, (const unsigned char *) line.data(), line.size());
+        }
+
+        for (unsigned int n = 0; n < nrThreads; ++n)
+            threads.push_back(std::thread(worker));
+
+        for (size_t done = 0; done < items.size(); ++done) {
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    if (interrupted) throw Interrupted("interrupted by the user");
+                    if (!finished.empty()) break;
+                    wakeup.wait_for(lock, std::chrono::seconds(1));
+                    checkInterrupt();
+                }
+                n = finished.front();
+                finished.pop_front();
+            }
+
+            Item & item(items[n]);
+            ValidPathInfo & info(item.info);
 
-        foreach (PathSet::iterator, i, validPaths) {
             try {
-                ValidPathInfo info = queryPathInfo(*i);
+                if (item.error != "") throw Error(item.error);
 
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, format("checking contents of ‘%1%’") % *i);
-                HashResult current = hashPath(info.hash.type, *i);
+                printMsg(lvlTalkative, format("checked contents of ‘%1%’") % info.path);
 
-                if (info.hash != nullHash && info.hash != current.first) {
+                if (info.hash != nullHash && info.hash != item.current.first) {
                     printMsg(lvlError, format("path ‘%1%’ was modified! "
                             "expected hash ‘%2%’, got ‘%3%’")
-                        % *i % printHash(info.hash) % printHash(current.first));
-                    if (repair) repairPath(*i); else errors = true;
+                        % info.path % printHash(info.hash) % printHash(item.current.first));
+                    if (repair) repairPath(info.path); else { errors = true; continue; }
                 } else {
 
                     bool update = false;
 
                     /* Fill in missing hashes. */
                     if (info.hash == nullHash) {
-                        printMsg(lvlError, format("fixing missing hash on ‘%1%’") % *i);
-                        info.hash = current.first;
+                        printMsg(lvlError, format("fixing missing hash on ‘%1%’") % info.path);
+                        info.hash = item.current.first;
                         update = true;
                     }
 
                     /* Fill in missing narSize fields (from old stores). */
                     if (info.narSize == 0) {
-                        printMsg(lvlError, format("updating size field on ‘%1%’ to %2%") % *i % current.second);
-                        info.narSize = current.second;
+                        printMsg(lvlError, format("updating size field on ‘%1%’ to %2%") % info.path % item.current.second);
+                        info.narSize = item.current.second;
                         update = true;
                     }
 
@@ -1795,19 +2497,33 @@ bool LocalStore::verifyStore(bool checkContents, bool repair)
 
                 }
 
+                string line = info.path + "\n";
+                writeFull(fdCheckpoint, (const unsigned char *) line.data(), line.size());
+
             } catch (Error & e) {
                 /* It's possible that the path got GC'ed, so ignore
                    errors on invalid paths. */
-                if (isValidPath(*i))
+                if (isValidPath(info.path))
                     printMsg(lvlError, format("error: %1%") % e.msg());
                 else
                     printMsg(lvlError, format("warning: %1%") % e.msg());
                 errors = true;
             }
         }
+    } catch (...) {
+        /* Make the threads give up on the paths they're hashing. */
+        _isInterrupted = 1;
+        stopThreads();
+        _isInterrupted = 0;
+        throw;
     }
 
-    return errors;
+    stopThreads();
+
+    /* Everything has been checked, so the next run starts from
+       scratch. */
+    if (unlink(checkpointFile.c_str()) == -1 && errno != ENOENT)
+        throw SysError(format("removing ‘%1%’") % checkpointFile);
 }
 
 
@@ -80,6 +80,47 @@ struct SQLiteStmt
 };
 
 
+/* Helper class to ensure that prepared statements are reset when
+   leaving the scope that uses them.  Unfinished prepared statements
+   prevent transactions from being aborted, and can cause locks to be
+   kept when they should be released. */
+struct SQLiteStmtUse
+{
+    SQLiteStmt & stmt;
+    SQLiteStmtUse(SQLiteStmt & stmt) : stmt(stmt)
+    {
+        stmt.reset();
+    }
+    ~SQLiteStmtUse()
+    {
+        try {
+            stmt.reset();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+};
+
+
+/* RAII helper that rolls back a transaction unless it was
+   committed. */
+struct SQLiteTxn
+{
+    bool active;
+    sqlite3 * db;
+    SQLiteTxn(sqlite3 * db);
+    void commit();
+    ~SQLiteTxn();
+};
+
+
+MakeError(SQLiteError, Error);
+MakeError(SQLiteBusy, SQLiteError);
+
+void throwSQLiteError(sqlite3 * db, const format & f)
+    __attribute__ ((noreturn));
+
+
 class LocalStore : public StoreAPI
 {
 private:
@@ -106,6 +147,8 @@ public:
 
     ValidPathInfo queryPathInfo(const Path & path);
 
+    ValidPathInfos queryPathInfos(const PathSet & paths);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
@@ -149,12 +192,28 @@ public:
 
     Paths importPaths(bool requireSignature, Source & source);
 
+    /* Return a valid path for each of `hashes' that is the NAR hash
+       of some valid path. */
+    std::map<Hash, Path> queryPathsByHash(const std::set<Hash> & hashes);
+
+    /* Make `info.path' valid without receiving its contents, by
+       hard-linking (or copying) the files of `from', which must have
+       the same NAR hash. */
+    void addIdenticalPath(const Path & from, const ValidPathInfo & info);
+
     void buildPaths(const PathSet & paths, BuildMode buildMode);
 
     void ensurePath(const Path & path);
 
     void addTempRoot(const Path & path);
 
+    void addTempRoots(const PathSet & paths);
+
+    /* Record that `paths' are being used, so that the garbage
+       collector deletes them after paths that haven't been used for
+       longer. */
+    void markPathsUsed(const PathSet & paths);
+
     void addIndirectRoot(const Path & path);
 
     void syncWithGC();
@@ -198,6 +257,20 @@ public:
 
     void clearFailedPaths(const PathSet & paths);
 
+    /* Record that building a derivation named `name' took `duration'
+       milliseconds. */
+    void registerBuildTime(const string & name, unsigned long long duration);
+
+    /* Return how long building a derivation named `name' is expected
+       to take in milliseconds, or -1 if it hasn't been built
+       before. */
+    long long queryBuildTime(const string & name);
+
+    /* Record the resources used by a build. */
+    void registerBuildStats(const BuildStats & stats);
+
+    std::vector<BuildStats> queryBuildStats(const Path & drvPath);
+
     void vacuumDB();
 
     /* Repair the contents of the given path by redownloading it using
@@ -212,6 +285,21 @@ public:
 
     void setSubstituterEnv();
 
+    /* Drop the state accumulated on behalf of a client (running
+       substituters, which inherited its options, and its temporary
+       roots), so that a long-lived daemon worker can serve the next
+       connection with the same database handle. */
+    void resetClientState();
+
+    /* Create or delete the dummy file that reserves disk space for
+       the garbage collector. */
+    void updateReservedSpace(bool reserve);
+
+    /* Write a new snapshot of all valid paths for clients to map (see
+       path-info-snapshot.hh).  Does nothing if another process is
+       already writing one. */
+    void publishPathInfoSnapshot();
+
 private:
 
     Path schemaPath;
@@ -234,6 +322,11 @@ private:
     SQLiteStmt stmtHasPathFailed;
     SQLiteStmt stmtQueryFailedPaths;
     SQLiteStmt stmtClearFailedPath;
+    SQLiteStmt stmtRegisterBuildTime;
+    SQLiteStmt stmtQueryBuildTime;
+    SQLiteStmt stmtRegisterBuildStats;
+    SQLiteStmt stmtQueryBuildStats;
+    SQLiteStmt stmtPruneBuildStats;
     SQLiteStmt stmtAddDerivationOutput;
     SQLiteStmt stmtQueryValidDerivers;
     SQLiteStmt stmtQueryDerivationOutputs;
@@ -244,10 +337,19 @@ private:
 
     bool didSetSubstituterEnv;
 
+    void stopSubstituters();
+
+    void removeTempRoots();
+
     /* The file to which we write our temporary roots. */
     Path fnTempRoots;
     AutoCloseFD fdTempRoots;
 
+    /* The roots already written to it. */
+    PathSet tempRoots;
+
+    void openTempRootsFile();
+
     int getSchema();
 
     void openDB(bool create);
@@ -260,6 +362,12 @@ private:
 
     void addReference(unsigned long long referrer, unsigned long long reference);
 
+    bool registerValidPaths_(const ValidPathInfos & infos);
+
+    void registerValidPathsGrouped(const ValidPathInfos & infos);
+
+    void commitPendingRegistrations(const Path & dir, const string & ownRequest);
+
     void appendReferrer(const Path & from, const Path & to, bool lock);
 
     void rewriteReferrers(const Path & path, bool purge, PathSet referrers);
@@ -269,6 +377,8 @@ private:
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
+    void verifyPathContents(const PathSet & paths, bool repair, bool & errors);
+
     void verifyPath(const Path & path, const PathSet & store,
         PathSet & done, PathSet & validPaths, bool repair, bool & errors);
 
@@ -287,6 +397,10 @@ private:
 
     bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
 
+    void findLivePaths(GCState & state);
+
+    Paths sortByLastUse(const PathSet & paths);
+
     void deletePathRecursive(GCState & state, const Path & path);
 
     bool isActiveTempFile(const GCState & state,
@@ -317,6 +431,7 @@ private:
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(const Path & path);
+    bool queryPathInfo_(const Path & path, ValidPathInfo & info);
     void queryReferrers_(const Path & path, PathSet & referrers);
 };
 
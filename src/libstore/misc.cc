@@ -1,6 +1,7 @@
 #include "misc.hh"
 #include "store-api.hh"
 #include "local-store.hh"
+#include "path-graph.hh"
 #include "globals.hh"
 
 
@@ -18,44 +19,75 @@ Derivation derivationFromPath(StoreAPI & store, const Path & drvPath)
 void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
-    if (paths.find(path) != paths.end()) return;
-    paths.insert(path);
+    PathSet roots;
+    roots.insert(path);
+    computeFSClosure(store, roots, paths, flipDirection, includeOutputs, includeDerivers);
+}
 
-    PathSet edges;
 
-    if (flipDirection) {
-        store.queryReferrers(path, edges);
+void computeFSClosure(StoreAPI & store, const PathSet & paths,
+    PathSet & closure, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    PathSet todo;
+    foreach (PathSet::const_iterator, i, paths)
+        if (closure.insert(*i).second) todo.insert(*i);
 
-        if (includeOutputs) {
-            PathSet derivers = store.queryValidDerivers(path);
-            foreach (PathSet::iterator, i, derivers)
-                edges.insert(*i);
-        }
+    while (!todo.empty()) {
+        checkInterrupt();
 
-        if (includeDerivers && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i) && store.queryDeriver(*i) == path)
-                    edges.insert(*i);
-        }
+        PathSet edges;
 
-    } else {
-        store.queryReferences(path, edges);
+        if (flipDirection) {
+            /* There is no bulk query for referrers. */
+            foreach (PathSet::iterator, i, todo) {
+                store.queryReferrers(*i, edges);
 
-        if (includeOutputs && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i)) edges.insert(*i);
-        }
+                if (includeOutputs) {
+                    PathSet derivers = store.queryValidDerivers(*i);
+                    edges.insert(derivers.begin(), derivers.end());
+                }
 
-        if (includeDerivers) {
-            Path deriver = store.queryDeriver(path);
-            if (store.isValidPath(deriver)) edges.insert(deriver);
+                if (includeDerivers && isDerivation(*i)) {
+                    PathSet outputs = store.queryDerivationOutputs(*i);
+                    foreach (PathSet::iterator, j, outputs)
+                        if (store.isValidPath(*j) && store.queryDeriver(*j) == *i)
+                            edges.insert(*j);
+                }
+            }
+
+        } else {
+            ValidPathInfos infos = store.queryPathInfos(todo);
+
+            if (infos.size() != todo.size()) {
+                foreach (ValidPathInfos::iterator, i, infos) todo.erase(i->path);
+                throw Error(format("path ‘%1%’ is not valid") % *todo.begin());
+            }
+
+            /* Outputs and derivers need not be valid. */
+            PathSet maybeValid;
+
+            foreach (ValidPathInfos::iterator, i, infos) {
+                edges.insert(i->references.begin(), i->references.end());
+
+                if (includeOutputs && isDerivation(i->path)) {
+                    PathSet outputs = store.queryDerivationOutputs(i->path);
+                    maybeValid.insert(outputs.begin(), outputs.end());
+                }
+
+                if (includeDerivers && i->deriver != "")
+                    maybeValid.insert(i->deriver);
+            }
+
+            if (!maybeValid.empty()) {
+                PathSet valid = store.queryValidPaths(maybeValid);
+                edges.insert(valid.begin(), valid.end());
+            }
         }
-    }
 
-    foreach (PathSet::iterator, i, edges)
-        computeFSClosure(store, *i, paths, flipDirection, includeOutputs, includeDerivers);
+        todo.clear();
+        foreach (PathSet::iterator, i, edges)
+            if (closure.insert(*i).second) todo.insert(*i);
+    }
 }
 
 
@@ -181,38 +213,11 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
 }
 
 
-static void dfsVisit(StoreAPI & store, const PathSet & paths,
-    const Path & path, PathSet & visited, Paths & sorted,
-    PathSet & parents)
-{
-    if (parents.find(path) != parents.end())
-        throw BuildError(format("cycle detected in the references of ‘%1%’") % path);
-
-    if (visited.find(path) != visited.end()) return;
-    visited.insert(path);
-    parents.insert(path);
-
-    PathSet references;
-    if (store.isValidPath(path))
-        store.queryReferences(path, references);
-
-    foreach (PathSet::iterator, i, references)
-        /* Don't traverse into paths that don't exist.  That can
-           happen due to substitutes for non-existent paths. */
-        if (*i != path && paths.find(*i) != paths.end())
-            dfsVisit(store, paths, *i, visited, sorted, parents);
-
-    sorted.push_front(path);
-    parents.erase(path);
-}
-
-
 Paths topoSortPaths(StoreAPI & store, const PathSet & paths)
 {
+    PathGraph graph(store, paths);
     Paths sorted;
-    PathSet visited, parents;
-    foreach (PathSet::const_iterator, i, paths)
-        dfsVisit(store, paths, *i, visited, sorted, parents);
+    for (auto & i : graph.topoSort()) sorted.push_back(graph.path(i));
     return sorted;
 }
 
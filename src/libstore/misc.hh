@@ -21,6 +21,13 @@ void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection = false,
     bool includeOutputs = false, bool includeDerivers = false);
 
+/* The same for the closure of a set of paths.  This queries the store
+   for a whole level of the closure at a time, which is much faster
+   for large closures. */
+void computeFSClosure(StoreAPI & store, const PathSet & paths,
+    PathSet & closure, bool flipDirection = false,
+    bool includeOutputs = false, bool includeDerivers = false);
+
 /* Return the path corresponding to the output identifier `id' in the
    given derivation. */
 Path findOutput(const Derivation & drv, string id);
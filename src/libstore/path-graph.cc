@@ -0,0 +1,107 @@
+#include "path-graph.hh"
+
+#include <algorithm>
+
+
+namespace nix {
+
+
+PathGraph::PathGraph(StoreAPI & store, const PathSet & paths)
+{
+    /* Invalid paths have no references, as in topoSortPaths(). */
+    init(paths, store.queryPathInfos(paths));
+}
+
+
+PathGraph::PathGraph(const PathSet & paths, const ValidPathInfos & infos)
+{
+    init(paths, infos);
+}
+
+
+void PathGraph::init(const PathSet & paths, const ValidPathInfos & infos)
+{
+    this->paths.assign(paths.begin(), paths.end());
+    ids.reserve(paths.size());
+    for (Id n = 0; n < this->paths.size(); ++n)
+        ids[this->paths[n]] = n;
+
+    refs.resize(paths.size());
+    for (auto & info : infos) {
+        Id n = id(info.path);
+        for (auto & i : info.references) {
+            auto j = ids.find(i);
+            if (j != ids.end()) refs[n].push_back(j->second);
+        }
+        std::sort(refs[n].begin(), refs[n].end());
+    }
+}
+
+
+PathGraph::Id PathGraph::id(const Path & path) const
+{
+    auto i = ids.find(path);
+    if (i == ids.end())
+        throw Error(format("path ‘%1%’ is not in the graph") % path);
+    return i->second;
+}
+
+
+PathGraph::Ids PathGraph::topoSort(const Ids & subset) const
+{
+    enum { unvisited, visiting, visited };
+    std::vector<char> state(paths.size(), visited);
+    for (auto & i : subset) state[i] = unvisited;
+
+    /* Visit the roots and references in ascending order, which is
+       the order of their paths, so that the result is the same as
+       that of the recursive search that topoSortPaths() used to do.
+       We emit paths in post-order and reverse the result at the
+       end. */
+    Ids roots(subset);
+    std::sort(roots.begin(), roots.end());
+
+    Ids sorted;
+    sorted.reserve(roots.size());
+
+    std::vector<std::pair<Id, size_t> > stack;
+
+    for (auto & root : roots) {
+        if (state[root] != unvisited) continue;
+        state[root] = visiting;
+        stack.push_back(std::make_pair(root, 0));
+
+        while (!stack.empty()) {
+            Id n = stack.back().first;
+            size_t & pos = stack.back().second;
+            if (pos < refs[n].size()) {
+                Id m = refs[n][pos++];
+                if (m == n) continue;
+                if (state[m] == visiting)
+                    throw BuildError(format("cycle detected in the references of ‘%1%’") % paths[m]);
+                if (state[m] == unvisited) {
+                    state[m] = visiting;
+                    stack.push_back(std::make_pair(m, 0));
+                }
+            } else {
+                state[n] = visited;
+                sorted.push_back(n);
+                stack.pop_back();
+            }
+        }
+    }
+
+    std::reverse(sorted.begin(), sorted.end());
+    return sorted;
+}
+
+
+PathGraph::Ids PathGraph::topoSort() const
+{
+    Ids all(paths.size());
+    for (Id n = 0; n < all.size(); ++n) all[n] = n;
+    return topoSort(all);
+}
+
+
+}
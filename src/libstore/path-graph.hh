@@ -0,0 +1,74 @@
+#pragma once
+
+#include "store-api.hh"
+
+#include <unordered_map>
+
+
+namespace nix {
+
+
+/* A part of the reference graph of the store, loaded with a single
+   bulk query.  The paths are numbered in lexicographic order, so that
+   algorithms on the graph can use vectors indexed by these ids rather
+   than sets of paths, and don't need to go back to the store. */
+class PathGraph
+{
+public:
+
+    typedef unsigned int Id;
+    typedef std::vector<Id> Ids;
+
+    /* Load `paths' and the references between them.  References to
+       paths outside of `paths' are ignored. */
+    PathGraph(StoreAPI & store, const PathSet & paths);
+
+    /* Load `paths' and the references between them from `infos'.
+       Paths without an entry in `infos' have no references. */
+    PathGraph(const PathSet & paths, const ValidPathInfos & infos);
+
+    size_t size() const
+    {
+        return paths.size();
+    }
+
+    const Path & path(Id id) const
+    {
+        return paths[id];
+    }
+
+    bool has(const Path & path) const
+    {
+        return ids.find(path) != ids.end();
+    }
+
+    Id id(const Path & path) const;
+
+    /* The references of a path in the graph, in ascending order.
+       These include the path itself if it refers to itself. */
+    const Ids & references(Id id) const
+    {
+        return refs[id];
+    }
+
+    /* Sort `subset' topologically, such that paths come before their
+       references.  Only references between different paths in
+       `subset' are considered.  Throws a BuildError if there is a
+       cycle.  This does not recurse, so it works on graphs of any
+       depth. */
+    Ids topoSort(const Ids & subset) const;
+
+    /* Sort all paths in the graph topologically. */
+    Ids topoSort() const;
+
+private:
+
+    void init(const PathSet & paths, const ValidPathInfos & infos);
+
+    std::vector<Path> paths;
+    std::unordered_map<Path, Id> ids;
+    std::vector<Ids> refs;
+};
+
+
+}
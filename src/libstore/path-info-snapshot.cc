@@ -0,0 +1,422 @@
+#include "path-info-snapshot.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+namespace nix {
+
+
+/* "NIXPIS01" in little-endian. */
+static const unsigned long long snapshotMagic = 0x3130534950584e49ULL;
+
+
+struct PathInfoSnapshot::Header
+{
+    unsigned long long magic;
+    unsigned long long generation;
+    unsigned long long registrations;
+    unsigned long long nrPaths;
+    unsigned long long nrRefs;
+    unsigned long long stringsSize;
+};
+
+
+/* One entry per valid path, sorted by path.  Strings are stored as
+   offsets into a table of NUL-terminated strings that starts with an
+   empty string, so offset 0 means "none".  References are indices
+   into the entry array. */
+struct PathInfoSnapshot::Entry
+{
+    unsigned long long path;
+    unsigned long long deriver;
+    unsigned long long narSize;
+    long long registrationTime;
+    unsigned int firstRef, nrRefs;
+    unsigned int hashType, hashSize;
+    unsigned char hash[Hash::maxHashSize];
+};
+
+
+static Path snapshotFile()
+{
+    return settings.nixDBPath + "/path-info-snapshot";
+}
+
+
+static Path countersFile()
+{
+    return settings.nixDBPath + "/path-info-counters";
+}
+
+
+Path pathInfoSnapshotLockFile()
+{
+    return settings.nixDBPath + "/path-info-snapshot.lock";
+}
+
+
+/* The counters file holds the generation and the registration
+   counter.  It's mapped writable by processes that modify the
+   database.  It's only created when a snapshot is published; until
+   then there is no snapshot that could become stale, so processes
+   don't need to count.  Returns 0 if the file doesn't exist and
+   `create' is false. */
+static volatile unsigned long long * writableCounters = 0;
+
+
+static volatile unsigned long long * getWritableCounters(bool create)
+{
+    if (writableCounters) return writableCounters;
+
+    Path path = countersFile();
+    AutoCloseFD fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd == -1) {
+        if (!create && errno == ENOENT) return 0;
+        throw SysError(format("opening ‘%1%’") % path);
+    }
+    fchmod(fd, 0644);
+
+    const size_t size = 2 * sizeof(unsigned long long);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("statting ‘%1%’") % path);
+    if ((size_t) st.st_size < size && ftruncate(fd, size) == -1)
+        throw SysError(format("resizing ‘%1%’") % path);
+
+    void * p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        throw SysError(format("mapping ‘%1%’") % path);
+
+    return writableCounters = (volatile unsigned long long *) p;
+}
+
+
+/* The database change has already been committed at this point, so
+   failing to count it must not make the operation fail.  Instead the
+   snapshot is disabled by removing it. */
+static void bumpCounter(unsigned int n)
+{
+    try {
+        volatile unsigned long long * counters = getWritableCounters(false);
+        if (counters) __sync_fetch_and_add(&counters[n], 1);
+    } catch (SysError & e) {
+        printMsg(lvlError, format("warning: %1%; removing the path info snapshot") % e.msg());
+        unlink(snapshotFile().c_str());
+    }
+}
+
+
+void bumpPathInfoGeneration()
+{
+    bumpCounter(0);
+}
+
+
+void bumpPathInfoRegistrations()
+{
+    bumpCounter(1);
+}
+
+
+void readPathInfoCounters(unsigned long long & generation,
+    unsigned long long & registrations)
+{
+    volatile unsigned long long * counters = getWritableCounters(true);
+    generation = counters[0];
+    registrations = counters[1];
+}
+
+
+void writePathInfoSnapshot(const std::vector<ValidPathInfo> & _infos,
+    unsigned long long generation, unsigned long long registrations)
+{
+    typedef PathInfoSnapshot::Header Header;
+    typedef PathInfoSnapshot::Entry Entry;
+
+    std::vector<const ValidPathInfo *> infos;
+    infos.reserve(_infos.size());
+    for (auto & i : _infos) infos.push_back(&i);
+    std::sort(infos.begin(), infos.end(),
+        [](const ValidPathInfo * a, const ValidPathInfo * b) { return a->path < b->path; });
+
+    auto indexOf = [&](const Path & path) -> unsigned int {
+        auto i = std::lower_bound(infos.begin(), infos.end(), path,
+            [](const ValidPathInfo * a, const Path & b) { return a->path < b; });
+        if (i == infos.end() || (*i)->path != path)
+            throw Error(format("reference to invalid path ‘%1%’ while writing path info snapshot") % path);
+        return i - infos.begin();
+    };
+
+    std::vector<Entry> entries(infos.size());
+    std::vector<unsigned int> refs;
+    string strings(1, 0);
+
+    for (size_t n = 0; n < infos.size(); ++n) {
+        const ValidPathInfo & info(*infos[n]);
+        Entry & e(entries[n]);
+        memset(&e, 0, sizeof e);
+        e.path = strings.size();
+        strings.append(info.path); strings.push_back(0);
+        if (info.deriver != "") {
+            e.deriver = strings.size();
+            strings.append(info.deriver); strings.push_back(0);
+        }
+        e.narSize = info.narSize;
+        e.registrationTime = info.registrationTime;
+        e.firstRef = refs.size();
+        e.nrRefs = info.references.size();
+        for (auto & j : info.references) refs.push_back(indexOf(j));
+        e.hashType = info.hash.type;
+        e.hashSize = info.hash.hashSize;
+        memcpy(e.hash, info.hash.hash, info.hash.hashSize);
+    }
+
+    /* Keep the string table 8-byte aligned. */
+    if (refs.size() % 2) refs.push_back(0);
+
+    Header header;
+    header.magic = snapshotMagic;
+    header.generation = generation;
+    header.registrations = registrations;
+    header.nrPaths = entries.size();
+    header.nrRefs = refs.size();
+    header.stringsSize = strings.size();
+
+    Path path = snapshotFile();
+    Path tmp = (format("%1%.tmp-%2%") % path % getpid()).str();
+
+    AutoCloseFD fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw SysError(format("creating ‘%1%’") % tmp);
+    fchmod(fd, 0644);
+
+    try {
+        writeFull(fd, (const unsigned char *) &header, sizeof header);
+        writeFull(fd, (const unsigned char *) entries.data(), entries.size() * sizeof(Entry));
+        writeFull(fd, (const unsigned char *) refs.data(), refs.size() * sizeof(unsigned int));
+        writeFull(fd, (const unsigned char *) strings.data(), strings.size());
+        fd.close();
+
+        /* Readers only check the parts of the snapshot they use, so
+           check the whole file once here. */
+        PathInfoSnapshot snapshot;
+        snapshot.map(tmp);
+        if (!snapshot.header)
+            throw Error(format("path info snapshot ‘%1%’ is corrupt") % tmp);
+        for (const Entry * e = snapshot.entries; e != snapshot.entries + snapshot.header->nrPaths; ++e)
+            if (!snapshot.validEntry(e))
+                throw Error(format("path info snapshot ‘%1%’ is corrupt") % tmp);
+    } catch (...) {
+        unlink(tmp.c_str());
+        throw;
+    }
+
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmp % path);
+}
+
+
+PathInfoSnapshot::PathInfoSnapshot()
+    : data(0), size(0), dev(0), ino(0), mtime(0), header(0)
+    , entries(0), refs(0), strings(0), counters(0), lastAttempt(0)
+{
+}
+
+
+PathInfoSnapshot::~PathInfoSnapshot()
+{
+    unmap();
+    if (counters)
+        munmap((void *) counters, 2 * sizeof(unsigned long long));
+}
+
+
+void PathInfoSnapshot::unmap()
+{
+    if (data) munmap(data, size);
+    data = 0;
+    header = 0;
+}
+
+
+void PathInfoSnapshot::map(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        unmap();
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("statting ‘%1%’") % path);
+
+    if (data && st.st_dev == dev && st.st_ino == ino && st.st_mtime == mtime)
+        return;
+
+    unmap();
+
+    if ((size_t) st.st_size < sizeof(Header)) return;
+
+    void * p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        throw SysError(format("mapping ‘%1%’") % path);
+
+    data = (unsigned char *) p;
+    size = st.st_size;
+    dev = st.st_dev;
+    ino = st.st_ino;
+    mtime = st.st_mtime;
+
+    if (!validHeader()) {
+        printMsg(lvlError, format("warning: ignoring corrupt path info snapshot ‘%1%’") % path);
+        header = 0;
+    }
+}
+
+
+bool PathInfoSnapshot::validHeader()
+{
+    /* Don't trust the header blindly; check the sizes one at a time
+       so that they can't overflow. */
+    const Header * h = (const Header *) data;
+    size_t left = size - sizeof(Header);
+    if (h->magic != snapshotMagic) return false;
+    if (h->nrPaths > left / sizeof(Entry)) return false;
+    left -= h->nrPaths * sizeof(Entry);
+    if (h->nrRefs > left / sizeof(unsigned int)) return false;
+    left -= h->nrRefs * sizeof(unsigned int);
+    if (h->stringsSize != left || h->stringsSize == 0 || data[size - 1] != 0)
+        return false;
+
+    header = h;
+    entries = (const Entry *) (data + sizeof(Header));
+    refs = (const unsigned int *) (entries + h->nrPaths);
+    strings = (const char *) (refs + h->nrRefs);
+
+    return true;
+}
+
+
+bool PathInfoSnapshot::validEntry(const Entry * e)
+{
+    /* Since the string table ends in a NUL, any offset into it is a
+       valid string. */
+    if (e->path >= header->stringsSize || e->deriver >= header->stringsSize) return false;
+    if (e->firstRef > header->nrRefs || e->nrRefs > header->nrRefs - e->firstRef) return false;
+    for (unsigned int n = 0; n < e->nrRefs; ++n)
+        if (refs[e->firstRef + n] >= header->nrPaths
+            || entries[refs[e->firstRef + n]].path >= header->stringsSize)
+            return false;
+    if (e->hashType != htMD5 && e->hashType != htSHA1 && e->hashType != htSHA256)
+        return false;
+    if (e->hashSize != Hash((HashType) e->hashType).hashSize) return false;
+    return true;
+}
+
+
+bool PathInfoSnapshot::current()
+{
+    if (!counters) {
+        /* Don't keep retrying if there is no snapshot at all. */
+        time_t now = time(0);
+        if (lastAttempt == now) return false;
+        lastAttempt = now;
+
+        Path path = countersFile();
+        AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) == -1 || (size_t) st.st_size < 2 * sizeof(unsigned long long))
+            return false;
+        void * p = mmap(0, 2 * sizeof(unsigned long long), PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return false;
+        counters = (const volatile unsigned long long *) p;
+    }
+
+    if (header && header->generation == counters[0]) return true;
+
+    /* The daemon may have published a newer snapshot. */
+    map(snapshotFile());
+
+    return header && header->generation == counters[0];
+}
+
+
+const PathInfoSnapshot::Entry * PathInfoSnapshot::find(const Path & path)
+{
+    if (!current()) return 0;
+
+    const Entry * lo = entries, * hi = entries + header->nrPaths;
+    while (lo < hi) {
+        const Entry * mid = lo + (hi - lo) / 2;
+        if (mid->path >= header->stringsSize) return 0;
+        int c = strcmp(strings + mid->path, path.c_str());
+        if (c == 0) return validEntry(mid) ? mid : 0;
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+
+    return 0;
+}
+
+
+bool PathInfoSnapshot::lookup(const Path & path, ValidPathInfo * info)
+{
+    const Entry * e = find(path);
+    if (!e) return false;
+
+    if (info) {
+        info->path = path;
+        info->deriver = strings + e->deriver;
+        info->hash = Hash((HashType) e->hashType);
+        memcpy(info->hash.hash, e->hash, e->hashSize);
+        info->registrationTime = e->registrationTime;
+        info->narSize = e->narSize;
+        info->references.clear();
+        for (unsigned int n = 0; n < e->nrRefs; ++n)
+            info->references.insert(strings + entries[refs[e->firstRef + n]].path);
+    }
+
+    return true;
+}
+
+
+bool pathInfoSnapshotOutdated(time_t minAge)
+{
+    unsigned long long generation, registrations;
+    readPathInfoCounters(generation, registrations);
+
+    /* This is called for every daemon connection, so only read the
+       header rather than mapping and checking the whole file. */
+    Path path = snapshotFile();
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return true;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("statting ‘%1%’") % path);
+
+    PathInfoSnapshot::Header header;
+    if (pread(fd, &header, sizeof header, 0) != sizeof header
+        || header.magic != snapshotMagic)
+        return true;
+
+    if (header.generation == generation && header.registrations == registrations)
+        return false;
+
+    return time(0) - st.st_mtime >= minAge;
+}
+
+
+}
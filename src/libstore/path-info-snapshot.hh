@@ -0,0 +1,108 @@
+#pragma once
+
+#include "store-api.hh"
+
+#include <sys/types.h>
+
+
+namespace nix {
+
+
+/* A read-only, memory-mapped snapshot of the valid paths and their
+   metadata (hash, NAR size, references, deriver).  The daemon writes
+   it to the database directory so that clients can answer read-only
+   queries without a round trip to the daemon.
+
+   Staleness is tracked through two counters in a small shared file
+   next to the snapshot.  Every process that invalidates a path or
+   changes its metadata increments the generation counter *after*
+   committing the change; registering new paths increments the
+   registration counter.  A snapshot is only used while its generation
+   matches the current one.  Paths registered after the snapshot was
+   taken are simply absent from it, so a miss must always be answered
+   by the daemon. */
+
+
+/* Record that a valid path was invalidated or its metadata changed.
+   Must be called after the change has been committed.  These do
+   nothing if no snapshot has ever been published, and don't throw. */
+void bumpPathInfoGeneration();
+
+/* Record that new valid paths have been registered. */
+void bumpPathInfoRegistrations();
+
+/* Whether the snapshot is missing or out of date, and at least
+   `minAge' seconds old. */
+bool pathInfoSnapshotOutdated(time_t minAge);
+
+/* Write a new snapshot containing `infos' atomically.  `generation'
+   and `registrations' must be the counter values read *before* the
+   database was queried. */
+void writePathInfoSnapshot(const std::vector<ValidPathInfo> & infos,
+    unsigned long long generation, unsigned long long registrations);
+
+void readPathInfoCounters(unsigned long long & generation,
+    unsigned long long & registrations);
+
+Path pathInfoSnapshotLockFile();
+
+
+class PathInfoSnapshot
+{
+public:
+
+    PathInfoSnapshot();
+
+    ~PathInfoSnapshot();
+
+    /* Look up `path' in the snapshot and fill in `info' if it's not
+       null.  Returns false if the path is absent or if there is no
+       current snapshot, in which case the caller must ask the
+       daemon. */
+    bool lookup(const Path & path, ValidPathInfo * info);
+
+private:
+
+    struct Header;
+    struct Entry;
+
+    /* The mapped snapshot file. */
+    unsigned char * data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+
+    const Header * header;
+    const Entry * entries;
+    const unsigned int * refs;
+    const char * strings;
+
+    /* The mapped counters file. */
+    const volatile unsigned long long * counters;
+    time_t lastAttempt;
+
+    bool current();
+
+    void map(const Path & path);
+
+    /* Check the header of the mapped file, which might be truncated
+       or corrupt.  Since checking every entry would make opening the
+       snapshot O(store size), entries are checked as they're used;
+       the daemon checks all of them when it writes the snapshot. */
+    bool validHeader();
+
+    bool validEntry(const Entry * e);
+
+    void unmap();
+
+    const Entry * find(const Path & path);
+
+    friend bool pathInfoSnapshotOutdated(time_t minAge);
+
+    friend void writePathInfoSnapshot(const std::vector<ValidPathInfo> & infos,
+        unsigned long long generation, unsigned long long registrations);
+};
+
+
+}
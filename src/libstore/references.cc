@@ -5,6 +5,7 @@
 
 #include <map>
 #include <cstdlib>
+#include <thread>
 
 
 namespace nix {
@@ -80,8 +81,10 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
 }
 
 
-PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+/* Scan the NAR written to the sink passed to `dump' for the hash
+   parts of `refs', and hash it. */
+static PathSet scanNAR(const PathSet & refs, HashResult & hash,
+    std::function<void(Sink & sink)> dump)
 {
     RefScanSink sink;
     std::map<string, Path> backMap;
@@ -102,8 +105,7 @@ PathSet scanForReferences(const string & path,
         backMap[s] = *i;
     }
 
-    /* Look for the hashes in the NAR dump of the path. */
-    dumpPath(path, sink);
+    dump(sink);
 
     /* Map the hashes found back to their store paths. */
     PathSet found;
@@ -114,7 +116,122 @@ PathSet scanForReferences(const string & path,
     }
 
     hash = sink.hashSink.finish();
-        
+
+    return found;
+}
+
+
+PathSet scanForReferences(const string & path,
+    const PathSet & refs, HashResult & hash)
+{
+    /* Look for the hashes in the NAR dump of the path. */
+    return scanNAR(refs, hash, [&](Sink & sink) { dumpPath(path, sink); });
+}
+
+
+HashRewriteSink::HashRewriteSink(Sink & to, const HashRewrites & rewrites)
+    : to(to), rewrites(rewrites), written(0)
+{
+    foreach (HashRewrites::const_iterator, i, rewrites)
+        assert(i->first.size() == refLength && i->second.size() == refLength);
+}
+
+
+void HashRewriteSink::operator () (const unsigned char * data, size_t len)
+{
+    /* A hash may span this fragment and the previous one, so we keep
+       back the last refLength - 1 bytes of the data, which can't
+       contain a complete hash yet. */
+    buf.append((const char *) data, len);
+
+    foreach (HashRewrites::const_iterator, i, rewrites) {
+        size_t j = 0;
+        while ((j = buf.find(i->first, j)) != string::npos) {
+            debug(format("rewriting @ %1%") % (written + j));
+            buf.replace(j, refLength, i->second);
+            j += refLength;
+        }
+    }
+
+    if (buf.size() >= refLength) {
+        size_t n = buf.size() - (refLength - 1);
+        to((const unsigned char *) buf.data(), n);
+        buf.erase(0, n);
+        written += n;
+    }
+}
+
+
+void HashRewriteSink::flush()
+{
+    to((const unsigned char *) buf.data(), buf.size());
+    written += buf.size();
+    buf.clear();
+}
+
+
+/* A sink that copies its data to two sinks. */
+struct TeeSink : Sink
+{
+    Sink & a, & b;
+    TeeSink(Sink & a, Sink & b) : a(a), b(b) { }
+    void operator () (const unsigned char * data, size_t len)
+    {
+        a(data, len);
+        b(data, len);
+    }
+};
+
+
+PathSet rewriteHashesInPath(const Path & path, const HashRewrites & rewrites,
+    const PathSet & refs, HashResult & hash)
+{
+    Path tmp = path + ".rewrite";
+    if (pathExists(tmp)) deletePath(tmp);
+
+    /* Dump the path into a pipe on a separate thread, rewriting and
+       scanning on the way, and restore the result from the other end
+       of the pipe. */
+    Pipe pipe;
+    pipe.create();
+
+    PathSet found;
+    string error;
+
+    std::thread thread([&]() {
+        try {
+            found = scanNAR(refs, hash, [&](Sink & scanner) {
+                FdSink out(pipe.writeSide);
+                TeeSink tee(scanner, out);
+                HashRewriteSink rewriter(tee, rewrites);
+                dumpPath(path, rewriter);
+                rewriter.flush();
+                out.flush();
+            });
+        } catch (std::exception & e) {
+            error = e.what();
+        }
+        pipe.writeSide.close();
+    });
+
+    try {
+        FdSource source(pipe.readSide);
+        restorePath(tmp, source);
+    } catch (...) {
+        /* Make the writer fail rather than block. */
+        pipe.readSide.close();
+        thread.join();
+        if (error != "") throw Error(error);
+        throw;
+    }
+
+    thread.join();
+    if (error != "") throw Error(error);
+
+    deletePath(path);
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError(format("renaming ‘%1%’ to ‘%2%’") % tmp % path);
+
     return found;
 }
 
@@ -2,10 +2,45 @@
 
 #include "types.hh"
 #include "hash.hh"
+#include "serialise.hh"
+
+#include <map>
 
 namespace nix {
 
 PathSet scanForReferences(const Path & path, const PathSet & refs,
     HashResult & hash);
-    
+
+
+/* A mapping from the hash parts of store paths to the hash parts
+   that should replace them. */
+typedef std::map<string, string> HashRewrites;
+
+/* A sink that replaces the hashes in `rewrites' in the data written
+   to it on the fly.  Since a hash may span two writes, the last few
+   bytes are held back until the next write or flush(). */
+class HashRewriteSink : public Sink
+{
+public:
+
+    HashRewriteSink(Sink & to, const HashRewrites & rewrites);
+
+    void operator () (const unsigned char * data, size_t len);
+
+    /* Pass on the data that was held back. */
+    void flush();
+
+private:
+    Sink & to;
+    const HashRewrites & rewrites;
+    string buf;
+    unsigned long long written;
+};
+
+/* Replace the hashes in `rewrites' in `path', without reading the
+   path into memory.  The result is scanned for references and hashed
+   in the same pass, like scanForReferences() does. */
+PathSet rewriteHashesInPath(const Path & path, const HashRewrites & rewrites,
+    const PathSet & refs, HashResult & hash);
+
 }
@@ -0,0 +1,305 @@
+#include "config.h"
+#include "remote-builders.hh"
+#include "store-api.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cmath>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+namespace nix {
+
+
+bool isNativeBuildHook(const string & hook)
+{
+    string::size_type slash = hook.rfind('/');
+    string name = slash == string::npos ? hook : string(hook, slash + 1);
+    return name == "build-remote.pl" || name == "build-remote";
+}
+
+
+Path remoteLoadDir()
+{
+    return getEnv("NIX_CURRENT_LOAD", "/run/nix/current-load");
+}
+
+
+Strings remoteSshOptions(const string & sshKey)
+{
+    Strings opts;
+    if (sshKey != "" && sshKey != "-") {
+        opts.push_back("-i");
+        opts.push_back(sshKey);
+    }
+    opts.push_back("-oBatchMode=yes");
+    opts.push_back("-oConnectTimeout=10");
+    opts.push_back("-oControlMaster=auto");
+    opts.push_back("-oControlPath=" + remoteLoadDir() + "/ssh-%r@%h:%p");
+    opts.push_back("-oControlPersist=60");
+    return opts;
+}
+
+
+RemoteBuilders::RemoteBuilders(StoreAPI & store)
+    : store(store), machinesMTime(0)
+{
+    machinesFile = getEnv("NIX_REMOTE_SYSTEMS", settings.nixConfDir + "/machines");
+}
+
+
+void RemoteBuilders::loadMachines()
+{
+    struct stat st;
+    if (stat(machinesFile.c_str(), &st) == -1) {
+        if (errno != ENOENT) throw SysError(format("getting status of ‘%1%’") % machinesFile);
+        machines.clear();
+        machinesMTime = 0;
+        return;
+    }
+    if (st.st_mtime == machinesMTime && !machines.empty()) return;
+    machinesMTime = st.st_mtime;
+
+    std::vector<RemoteMachine> old;
+    old.swap(machines);
+
+    for (auto & line : tokenizeString<Strings>(readFile(machinesFile), "\n")) {
+        string s = string(line, 0, line.find('#'));
+        vector<string> tokens = tokenizeString<vector<string> >(s);
+        if (tokens.empty()) continue;
+
+        RemoteMachine m;
+        m.hostName = tokens[0];
+        if (tokens.size() > 1) m.systemTypes = tokenizeString<Strings>(tokens[1], ",");
+        if (tokens.size() > 2) m.sshKey = tokens[2];
+        if (tokens.size() < 4 || !string2Int(tokens[3], m.maxJobs)) m.maxJobs = 1;
+        if (tokens.size() < 5 || !string2Int(tokens[4], m.speedFactor) || m.speedFactor == 0)
+            m.speedFactor = 1;
+        if (tokens.size() > 5) m.supportedFeatures = tokenizeString<StringSet>(tokens[5], ",");
+        if (tokens.size() > 6) m.mandatoryFeatures = tokenizeString<StringSet>(tokens[6], ",");
+        m.supportedFeatures.insert(m.mandatoryFeatures.begin(), m.mandatoryFeatures.end());
+        m.disabledUntil = 0;
+        m.failures = 0;
+
+        /* Keep what we learned about machines that are still there. */
+        for (auto & i : old)
+            if (i.hostName == m.hostName) {
+                m.disabledUntil = i.disabledUntil;
+                m.failures = i.failures;
+                m.conn = i.conn;
+                m.knownValid = i.knownValid;
+            }
+
+        machines.push_back(m);
+    }
+}
+
+
+bool RemoteBuilders::connect(RemoteMachine & machine)
+{
+    if (machine.conn) return true;
+    try {
+        std::shared_ptr<ServeConnection> conn(new ServeConnection);
+        openServeConnection(*conn, machine.hostName, remoteSshOptions(machine.sshKey));
+        machine.conn = conn;
+        machine.failures = 0;
+        return true;
+    } catch (Error & e) {
+        printMsg(lvlError, e.msg());
+        printMsg(lvlError, format("unable to open SSH connection to ‘%1%’, trying other available machines...")
+            % machine.hostName);
+        disable(machine);
+        return false;
+    }
+}
+
+
+void RemoteBuilders::disable(RemoteMachine & machine)
+{
+    machine.conn.reset();
+    time_t backOff = std::min(30 << std::min(machine.failures, 5U), 600);
+    machine.failures++;
+    machine.disabledUntil = time(0) + backOff;
+    printMsg(lvlInfo, format("not using ‘%1%’ for %2% seconds") % machine.hostName % backOff);
+}
+
+
+static Path slotLockFile(const RemoteMachine & machine, unsigned int slot)
+{
+    return (format("%1%/%2%-%3%-%4%") % remoteLoadDir()
+        % concatStringsSep("+", machine.systemTypes) % machine.hostName % slot).str();
+}
+
+
+static int openSlotLock(const RemoteMachine & machine, unsigned int slot)
+{
+    Path path = slotLockFile(machine, slot);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd == -1) throw SysError(format("opening lock file ‘%1%’") % path);
+    closeOnExec(fd);
+    return fd;
+}
+
+
+/* The slot locks use flock() rather than fcntl() so that they are
+   compatible with ‘build-remote.pl’.  Since flock() locks belong to
+   an open file, this also detects slots held by this process. */
+unsigned int RemoteBuilders::getLoad(const RemoteMachine & machine)
+{
+    unsigned int load = 0;
+    for (unsigned int slot = 0; slot < machine.maxJobs; ++slot) {
+        AutoCloseFD fd = openSlotLock(machine, slot);
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            flock(fd, LOCK_UN);
+        else
+            load++;
+    }
+    return load;
+}
+
+
+unsigned long long RemoteBuilders::missingSize(RemoteMachine & machine,
+    const PathSet & inputs, std::map<Path, unsigned long long> & sizes)
+{
+    PathSet unknown;
+    for (auto & i : inputs)
+        if (machine.knownValid.find(i) == machine.knownValid.end())
+            unknown.insert(i);
+
+    if (!unknown.empty()) {
+        if (!connect(machine)) return 0;
+        try {
+            PathSet valid = queryRemoteValidPaths(*machine.conn, unknown, false, false);
+            machine.knownValid.insert(valid.begin(), valid.end());
+        } catch (Error & e) {
+            printMsg(lvlError, format("lost connection to ‘%1%’: %2%") % machine.hostName % e.msg());
+            disable(machine);
+            return 0;
+        }
+    }
+
+    unsigned long long size = 0;
+    PathSet query;
+    for (auto & i : unknown)
+        if (machine.knownValid.find(i) == machine.knownValid.end()
+            && sizes.find(i) == sizes.end())
+            query.insert(i);
+    for (auto & info : store.queryPathInfos(query))
+        sizes[info.path] = info.narSize;
+    for (auto & i : unknown)
+        if (machine.knownValid.find(i) == machine.knownValid.end())
+            size += sizes[i];
+    return size;
+}
+
+
+struct Candidate
+{
+    RemoteMachine * machine;
+    unsigned int load;
+    unsigned long long missing;
+};
+
+
+static bool hasFeatures(const RemoteMachine & machine, const StringSet & features)
+{
+    for (auto & i : features)
+        if (machine.supportedFeatures.find(i) == machine.supportedFeatures.end()) return false;
+    for (auto & i : machine.mandatoryFeatures)
+        if (features.find(i) == features.end()) return false;
+    return true;
+}
+
+
+RemoteSlotPtr RemoteBuilders::acquireSlot(const string & platform, const StringSet & features,
+    const PathSet & inputs, bool canBuildLocally, bool & postpone)
+{
+    postpone = false;
+
+    loadMachines();
+    if (machines.empty()) return RemoteSlotPtr();
+
+    createDirs(remoteLoadDir());
+
+    while (true) {
+
+        /* Find the machines that can execute this build and aren't
+           at their job limit.  Machines that are disabled for now
+           still count for postponing, since they'll be retried. */
+        bool rightType = false;
+        std::vector<Candidate> available;
+        time_t now = time(0);
+        for (auto & m : machines) {
+            if (find(m.systemTypes.begin(), m.systemTypes.end(), platform) == m.systemTypes.end()
+                || !hasFeatures(m, features))
+                continue;
+            rightType = true;
+            if (m.disabledUntil > now) continue;
+            unsigned int load = getLoad(m);
+            if (load < m.maxJobs) available.push_back(Candidate{&m, load, 0});
+        }
+
+        if (available.empty()) {
+            /* Postpone if we have a machine of the right type, except
+               if the local system can and wants to do the build. */
+            postpone = rightType && !canBuildLocally;
+            return RemoteSlotPtr();
+        }
+
+        /* Only bother asking the machines what they have if there is
+           a choice. */
+        if (available.size() > 1) {
+            std::map<Path, unsigned long long> sizes;
+            for (auto & c : available)
+                c.missing = missingSize(*c.machine, inputs, sizes);
+        }
+
+        auto lf = [](const Candidate & c) {
+            return (unsigned int) std::floor((double) c.load / c.machine->speedFactor + 0.4999);
+        };
+
+        std::stable_sort(available.begin(), available.end(),
+            [&](const Candidate & a, const Candidate & b) {
+                if (lf(a) != lf(b)) return lf(a) < lf(b);
+                if (a.missing != b.missing) return a.missing < b.missing;
+                if (a.machine->speedFactor != b.machine->speedFactor)
+                    return a.machine->speedFactor > b.machine->speedFactor;
+                return a.load < b.load;
+            });
+
+        for (auto & c : available) {
+            RemoteMachine & m(*c.machine);
+            if (m.disabledUntil > now) continue;
+
+            if (verbosity >= lvlDebug)
+                printMsg(lvlDebug, format("load on ‘%1%’ = %2%, missing inputs = %3% bytes")
+                    % m.hostName % c.load % c.missing);
+
+            /* Another process may have claimed the free slots since
+               we looked. */
+            RemoteSlotPtr slot(new RemoteSlot);
+            for (unsigned int n = 0; n < m.maxJobs && slot->lock == -1; ++n) {
+                AutoCloseFD fd = openSlotLock(m, n);
+                if (flock(fd, LOCK_EX | LOCK_NB) == 0) slot->lock = fd.borrow();
+            }
+            if (slot->lock == -1) continue;
+
+            if (!connect(m)) continue;
+
+            slot->hostName = m.hostName;
+            slot->sshKey = m.sshKey;
+
+            /* The build will copy the inputs to the machine. */
+            m.knownValid.insert(inputs.begin(), inputs.end());
+
+            return slot;
+        }
+    }
+}
+
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "types.hh"
+#include "serve-client.hh"
+
+#include <memory>
+#include <map>
+
+
+namespace nix {
+
+
+class StoreAPI;
+
+
+/* A machine listed in the remote systems file
+   ($NIX_REMOTE_SYSTEMS). */
+struct RemoteMachine
+{
+    string hostName;
+    Strings systemTypes;
+    string sshKey;
+    unsigned int maxJobs;
+    unsigned int speedFactor;
+    StringSet supportedFeatures, mandatoryFeatures;
+
+    /* When we fail to connect to the machine, it isn't used until
+       `disabledUntil'.  The back-off doubles with every consecutive
+       failure. */
+    time_t disabledUntil;
+    unsigned int failures;
+
+    /* Connection used to ask the machine which paths it already
+       has.  It stays open for the lifetime of the worker. */
+    std::shared_ptr<ServeConnection> conn;
+
+    /* Paths known to be valid on the machine.  This may become stale
+       if the machine garbage-collects them, but it's only used for
+       placement, not for deciding what to copy. */
+    PathSet knownValid;
+};
+
+
+/* An exclusive claim on one of the build slots of a remote machine.
+   The slot is released when this object is destroyed. */
+struct RemoteSlot
+{
+    string hostName;
+    string sshKey;
+    AutoCloseFD lock;
+};
+
+typedef std::shared_ptr<RemoteSlot> RemoteSlotPtr;
+
+
+/* Decides which machine performs a remote build.  Slots are claimed
+   by locking the files in $NIX_CURRENT_LOAD, so concurrent Nix
+   processes (including ones still using ‘build-remote.pl’) see each
+   other's builds. */
+class RemoteBuilders
+{
+public:
+
+    RemoteBuilders(StoreAPI & store);
+
+    /* Claim a slot on the best machine for building a derivation for
+       `platform' that requires `features' and has input closure
+       `inputs'.  Machines are ranked by their load relative to their
+       speed factor, then by the size of the inputs they would have to
+       be sent, then by speed factor and finally by absolute load.
+       Returns null if no machine is available; `postpone' is then set
+       if the build should wait for a machine rather than being done
+       locally. */
+    RemoteSlotPtr acquireSlot(const string & platform, const StringSet & features,
+        const PathSet & inputs, bool canBuildLocally, bool & postpone);
+
+private:
+
+    StoreAPI & store;
+
+    Path machinesFile;
+    time_t machinesMTime;
+
+    std::vector<RemoteMachine> machines;
+
+    /* Re-read the machines file if it has changed. */
+    void loadMachines();
+
+    bool connect(RemoteMachine & machine);
+
+    void disable(RemoteMachine & machine);
+
+    unsigned int getLoad(const RemoteMachine & machine);
+
+    /* Return the total size of the paths in `inputs' that `machine'
+       doesn't have. */
+    unsigned long long missingSize(RemoteMachine & machine,
+        const PathSet & inputs, std::map<Path, unsigned long long> & sizes);
+};
+
+
+/* Whether `hook' (the value of $NIX_BUILD_HOOK) is the standard
+   remote build hook, which is implemented natively. */
+bool isNativeBuildHook(const string & hook);
+
+/* The directory containing the slot lock files. */
+Path remoteLoadDir();
+
+/* The SSH options for connecting to a build machine.  Connections to
+   the same machine share a single SSH session through a control
+   socket in remoteLoadDir().  Connecting times out quickly, since
+   the worker waits for it. */
+Strings remoteSshOptions(const string & sshKey);
+
+
+}
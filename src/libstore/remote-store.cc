@@ -35,6 +35,7 @@ template<class T> T readStorePaths(Source & from)
 }
 
 template PathSet readStorePaths(Source & from);
+template Paths readStorePaths(Source & from);
 
 
 RemoteStore::RemoteStore()
@@ -43,6 +44,14 @@ RemoteStore::RemoteStore()
 }
 
 
+bool RemoteStore::lookupSnapshot(const Path & path, ValidPathInfo * info)
+{
+    if (!settings.usePathInfoSnapshot) return false;
+    if (!snapshot) snapshot = std::shared_ptr<PathInfoSnapshot>(new PathInfoSnapshot());
+    return snapshot->lookup(path, info);
+}
+
+
 void RemoteStore::openConnection(bool reserveSpace)
 {
     if (initialised) return;
@@ -177,6 +186,7 @@ void RemoteStore::setOptions()
 
 bool RemoteStore::isValidPath(const Path & path)
 {
+    if (lookupSnapshot(path)) return true;
     openConnection();
     writeInt(wopIsValidPath, to);
     writeString(path, to);
@@ -186,20 +196,27 @@ bool RemoteStore::isValidPath(const Path & path)
 }
 
 
-PathSet RemoteStore::queryValidPaths(const PathSet & paths)
+PathSet RemoteStore::queryValidPaths(const PathSet & _paths)
 {
+    /* Only ask the daemon about paths that the snapshot doesn't
+       know. */
+    PathSet paths, res;
+    foreach (PathSet::const_iterator, i, _paths)
+        if (lookupSnapshot(*i)) res.insert(*i); else paths.insert(*i);
+    if (paths.empty()) return res;
+
     openConnection();
     if (GET_PROTOCOL_MINOR(daemonVersion) < 12) {
-        PathSet res;
         foreach (PathSet::const_iterator, i, paths)
             if (isValidPath(*i)) res.insert(*i);
-        return res;
     } else {
         writeInt(wopQueryValidPaths, to);
         writeStrings(paths, to);
         processStderr();
-        return readStorePaths<PathSet>(from);
+        PathSet res2 = readStorePaths<PathSet>(from);
+        res.insert(res2.begin(), res2.end());
     }
+    return res;
 }
 
 
@@ -281,11 +298,12 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 
 ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
 {
+    ValidPathInfo info;
+    if (lookupSnapshot(path, &info)) return info;
     openConnection();
     writeInt(wopQueryPathInfo, to);
     writeString(path, to);
     processStderr();
-    ValidPathInfo info;
     info.path = path;
     info.deriver = readString(from);
     if (info.deriver != "") assertStorePath(info.deriver);
@@ -299,6 +317,8 @@ ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
 
 Hash RemoteStore::queryPathHash(const Path & path)
 {
+    ValidPathInfo info;
+    if (lookupSnapshot(path, &info)) return info.hash;
     openConnection();
     writeInt(wopQueryPathHash, to);
     writeString(path, to);
@@ -311,6 +331,11 @@ Hash RemoteStore::queryPathHash(const Path & path)
 void RemoteStore::queryReferences(const Path & path,
     PathSet & references)
 {
+    ValidPathInfo info;
+    if (lookupSnapshot(path, &info)) {
+        references.insert(info.references.begin(), info.references.end());
+        return;
+    }
     openConnection();
     writeInt(wopQueryReferences, to);
     writeString(path, to);
@@ -334,6 +359,8 @@ void RemoteStore::queryReferrers(const Path & path,
 
 Path RemoteStore::queryDeriver(const Path & path)
 {
+    ValidPathInfo info;
+    if (lookupSnapshot(path, &info)) return info.deriver;
     openConnection();
     writeInt(wopQueryDeriver, to);
     writeString(path, to);
@@ -501,6 +528,20 @@ void RemoteStore::addTempRoot(const Path & path)
 }
 
 
+void RemoteStore::addTempRoots(const PathSet & paths)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 15)
+        StoreAPI::addTempRoots(paths);
+    else {
+        writeInt(wopAddTempRoots, to);
+        writeStrings(paths, to);
+        processStderr();
+        readInt(from);
+    }
+}
+
+
 void RemoteStore::addIndirectRoot(const Path & path)
 {
     openConnection();
@@ -578,6 +619,34 @@ void RemoteStore::clearFailedPaths(const PathSet & paths)
     readInt(from);
 }
 
+
+std::vector<BuildStats> RemoteStore::queryBuildStats(const Path & drvPath)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 16)
+        throw Error("the Nix daemon is too old to report build statistics");
+    writeInt(wopQueryBuildStats, to);
+    writeString(drvPath, to);
+    processStderr();
+    std::vector<BuildStats> res;
+    unsigned int count = readInt(from);
+    while (count--) {
+        BuildStats stats;
+        stats.drvPath = drvPath;
+        stats.startTime = readLongLong(from);
+        stats.succeeded = readInt(from) != 0;
+        stats.wallTime = readLongLong(from);
+        stats.userTime = readLongLong(from);
+        stats.systemTime = readLongLong(from);
+        stats.maxRSS = readLongLong(from);
+        stats.bytesRead = readLongLong(from);
+        stats.bytesWritten = readLongLong(from);
+        res.push_back(stats);
+    }
+    return res;
+}
+
+
 void RemoteStore::optimiseStore()
 {
     openConnection();
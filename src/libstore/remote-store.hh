@@ -3,6 +3,7 @@
 #include <string>
 
 #include "store-api.hh"
+#include "path-info-snapshot.hh"
 
 
 namespace nix {
@@ -71,6 +72,8 @@ public:
 
     void addTempRoot(const Path & path);
 
+    void addTempRoots(const PathSet & paths);
+
     void addIndirectRoot(const Path & path);
     
     void syncWithGC();
@@ -83,6 +86,8 @@ public:
 
     void clearFailedPaths(const PathSet & paths);
 
+    std::vector<BuildStats> queryBuildStats(const Path & drvPath);
+
     void optimiseStore();
 
 private:
@@ -92,6 +97,12 @@ private:
     unsigned int daemonVersion;
     bool initialised;
 
+    /* Local snapshot of the daemon's path info, used to answer
+       read-only queries without a round trip. */
+    std::shared_ptr<PathInfoSnapshot> snapshot;
+
+    bool lookupSnapshot(const Path & path, ValidPathInfo * info = 0);
+
     void openConnection(bool reserveSpace = true);
 
     void processStderr(Sink * sink = 0, Source * source = 0);
@@ -42,3 +42,29 @@ create table if not exists FailedPaths (
     path text primary key not null,
     time integer not null
 );
+
+-- How long building a derivation took, keyed by the name of the
+-- derivation without its version, so that the estimate carries over
+-- to newer versions of a package.
+create table if not exists BuildTimes (
+    name     text primary key not null,
+    duration integer not null, -- in milliseconds
+    time     integer not null  -- when the derivation was last built
+);
+
+-- The resources used by each build of a derivation (see
+-- `build-record-stats').
+create table if not exists BuildStats (
+    id           integer primary key autoincrement not null,
+    drvPath      text not null,
+    startTime    integer not null,
+    succeeded    integer not null,
+    wallTime     integer not null, -- in milliseconds
+    userTime     integer not null,
+    systemTime   integer not null,
+    maxRSS       integer not null, -- in KiB
+    bytesRead    integer not null,
+    bytesWritten integer not null
+);
+
+create index if not exists IndexBuildStats on BuildStats(drvPath);
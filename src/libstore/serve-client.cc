@@ -0,0 +1,309 @@
+#include "serve-client.hh"
+#include "serve-protocol.hh"
+#include "worker-protocol.hh"
+#include "store-api.hh"
+#include "local-store.hh"
+#include "chunks.hh"
+#include "globals.hh"
+
+#include <memory>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+namespace nix {
+
+
+Strings remoteNixStoreCommand(const string & host, const Strings & sshOpts)
+{
+    Strings args;
+    if (host == "local")
+        args.push_back(settings.nixBinDir + "/nix-store");
+    else {
+        args = {"ssh", "-x", "-a", host};
+        for (auto & i : tokenizeString<Strings>(getEnv("NIX_SSHOPTS")))
+            args.push_back(i);
+        args.insert(args.end(), sshOpts.begin(), sshOpts.end());
+        args.push_back("nix-store");
+    }
+    return args;
+}
+
+
+void openServeConnection(ServeConnection & conn, const string & host,
+    const Strings & sshOpts, int stderrFd)
+{
+    conn.host = host;
+    conn.codec = codecNone;
+
+    bool local = host == "local";
+
+    Strings args = remoteNixStoreCommand(host, sshOpts);
+    args.push_back("--serve");
+    args.push_back("--write");
+
+    std::vector<const char *> cargs;
+    for (auto & i : args) cargs.push_back(i.c_str());
+    cargs.push_back(0);
+
+    Pipe to, from;
+    to.create();
+    from.create();
+
+    /* We may modify the environment in the child. */
+    ProcessOptions options;
+    options.allowVfork = false;
+
+    conn.sshPid = startProcess([&]() {
+        if (dup2(to.readSide, STDIN_FILENO) == -1)
+            throw SysError("dupping stdin");
+        if (dup2(from.writeSide, STDOUT_FILENO) == -1)
+            throw SysError("dupping stdout");
+        if (stderrFd != -1 && dup2(stderrFd, STDERR_FILENO) == -1)
+            throw SysError("dupping stderr");
+        if (local) {
+            /* The local store must build the derivations we send it
+               itself rather than hand them back to the build hook. */
+            unsetenv("NIX_BUILD_HOOK");
+            execv(cargs[0], (char * *) &cargs[0]);
+        } else
+            execvp("ssh", (char * *) &cargs[0]);
+        throw SysError(format("executing ‘%1%’") % cargs[0]);
+    }, options);
+
+    to.readSide.close();
+    from.writeSide.close();
+
+    conn.toFd = to.writeSide.borrow();
+    conn.fromFd = from.readSide.borrow();
+    closeOnExec(conn.toFd);
+    closeOnExec(conn.fromFd);
+    conn.to.fd = conn.toFd;
+    conn.from.fd = conn.fromFd;
+
+    /* If the remote side exits right away (e.g. because SSH failed
+       or because it runs Nix <= 1.7, which has no ‘--serve’), we get
+       EOF or EPIPE. */
+    bool failed = false;
+    try {
+        writeInt(SERVE_MAGIC_1, conn.to);
+        writeInt(SERVE_PROTOCOL_VERSION, conn.to);
+        conn.to.flush();
+        if (readInt(conn.from) != SERVE_MAGIC_2)
+            throw Error("protocol mismatch");
+        conn.serverVersion = readInt(conn.from);
+    } catch (EndOfFile & e) {
+        failed = true;
+    } catch (SysError & e) {
+        if (e.errNo != EPIPE) throw;
+        failed = true;
+    }
+
+    if (failed) {
+        conn.toFd.close();
+        conn.fromFd.close();
+        conn.sshPid.wait(true);
+        throw Error(format("unable to connect to ‘%1%’") % host);
+    }
+
+    if (GET_PROTOCOL_MAJOR(conn.serverVersion) != 0x200)
+        throw Error(format("unsupported ‘nix-store --serve’ protocol version on ‘%1%’") % host);
+}
+
+
+void setServeCompression(ServeConnection & conn, const Strings & codecs)
+{
+    if (codecs.empty() || GET_PROTOCOL_MINOR(conn.serverVersion) < 1) return;
+    writeInt(cmdSetCompression, conn.to);
+    writeStrings(codecs, conn.to);
+    conn.to.flush();
+    string name = readString(conn.from);
+    if (name == "") return;
+    conn.codec = parseCodec(name);
+    if (conn.codec == codecNone)
+        throw Error(format("‘%1%’ chose unknown compression method ‘%2%’") % conn.host % name);
+}
+
+
+void closeServeConnection(ServeConnection & conn)
+{
+    conn.toFd.close();
+    conn.fromFd.close();
+    int status = conn.sshPid.wait(true);
+    if (!statusOk(status))
+        throw Error(format("connection to ‘%1%’ %2%") % conn.host % statusToString(status));
+}
+
+
+PathSet queryRemoteValidPaths(ServeConnection & conn, const PathSet & paths,
+    bool lock, bool substitute)
+{
+    writeInt(cmdQueryValidPaths, conn.to);
+    writeInt(lock, conn.to);
+    writeInt(substitute, conn.to);
+    writeStrings(paths, conn.to);
+    conn.to.flush();
+    return readStorePaths<PathSet>(conn.from);
+}
+
+
+/* Sink and source wrappers that count the bytes passing through,
+   optionally reporting the count to `progress'. */
+struct CountingSink : Sink
+{
+    Sink & next;
+    ProgressCallback progress;
+    unsigned long long count;
+    CountingSink(Sink & next, const ProgressCallback & progress = ProgressCallback())
+        : next(next), progress(progress), count(0) { }
+    void operator () (const unsigned char * data, size_t len)
+    {
+        next(data, len);
+        count += len;
+        if (progress) progress(count);
+    }
+};
+
+
+struct CountingSource : Source
+{
+    Source & next;
+    ProgressCallback progress;
+    unsigned long long count;
+    CountingSource(Source & next, const ProgressCallback & progress = ProgressCallback())
+        : next(next), progress(progress), count(0) { }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = next.read(data, len);
+        count += n;
+        if (progress) progress(count);
+        return n;
+    }
+    size_t readDirect(const unsigned char * & data, size_t len)
+    {
+        size_t n = next.readDirect(data, len);
+        count += n;
+        if (progress && n) progress(count);
+        return n;
+    }
+};
+
+
+TransferStats exportToServe(ServeConnection & conn, StoreAPI & store,
+    const Paths & paths, bool sign, const ProgressCallback & progress)
+{
+    TransferStats stats;
+
+    writeInt(cmdImportPaths, conn.to);
+    if (conn.codec == codecNone) {
+        CountingSink sink(conn.to, progress);
+        exportPaths(store, paths, sign, sink);
+        stats.size = stats.compressedSize = sink.count;
+    } else {
+        CompressionSink sink(conn.to, conn.codec);
+        if (progress) {
+            CountingSink counter(sink, progress);
+            exportPaths(store, paths, sign, counter);
+        } else
+            exportPaths(store, paths, sign, sink);
+        sink.finish();
+        stats.size = sink.size();
+        stats.compressedSize = sink.compressedSize();
+    }
+    conn.to.flush();
+
+    if (readInt(conn.from) != 1)
+        throw Error(format("remote machine ‘%1%’ failed to import closure") % conn.host);
+
+    return stats;
+}
+
+
+TransferStats importFromServe(ServeConnection & conn, StoreAPI & store,
+    const ProgressCallback & progress)
+{
+    TransferStats stats;
+
+    if (conn.codec == codecNone) {
+        CountingSource source(conn.from, progress);
+        store.importPaths(false, source);
+        stats.size = stats.compressedSize = source.count;
+    } else {
+        DecompressionSource source(conn.from, conn.codec);
+        if (progress) {
+            CountingSource counter(source, progress);
+            store.importPaths(false, counter);
+        } else
+            store.importPaths(false, source);
+        source.finish();
+        stats.size = source.size();
+        stats.compressedSize = source.compressedSize();
+    }
+
+    return stats;
+}
+
+
+bool importChunkedFromServe(ServeConnection & conn, LocalStore & store,
+    const Paths & paths, bool sign, TransferStats & stats,
+    const ProgressCallback & progress)
+{
+    /* The index is only an optimisation, so don't fail if we can't
+       use it (e.g. because the database is read-only). */
+    std::shared_ptr<ChunkIndex> index;
+    ChunkHashes known;
+    try {
+        index = std::make_shared<ChunkIndex>(store);
+        known = index->similarChunks(PathSet(paths.begin(), paths.end()));
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot use the chunk index: %1%") % e.msg());
+        return false;
+    }
+    if (known.empty()) return false;
+
+    writeInt(cmdExportPathsChunked, conn.to);
+    writeInt(sign, conn.to);
+    writeStrings(paths, conn.to);
+    writeString(packChunkHashes(known), conn.to);
+    conn.to.flush();
+
+    auto receive = [&](Source & source) {
+        ChunkDecoder decoder(source, *index);
+        CountingSource counter(decoder, progress);
+        try {
+            if (progress)
+                store.importPaths(false, counter);
+            else
+                store.importPaths(false, decoder);
+            decoder.finish();
+        } catch (MissingChunk & e) {
+            decoder.skip();
+            throw;
+        }
+        stats.size = decoder.literalSize + decoder.localSize;
+        stats.reused = decoder.localSize;
+    };
+
+    if (conn.codec == codecNone) {
+        CountingSource source(conn.from);
+        receive(source);
+        stats.compressedSize = source.count;
+    } else {
+        DecompressionSource source(conn.from, conn.codec);
+        try {
+            receive(source);
+        } catch (MissingChunk & e) {
+            source.finish();
+            throw;
+        }
+        source.finish();
+        stats.compressedSize = source.compressedSize();
+    }
+
+    return true;
+}
+
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "types.hh"
+#include "util.hh"
+#include "serialise.hh"
+#include "compression.hh"
+
+#include <functional>
+
+
+namespace nix {
+
+
+class StoreAPI;
+class LocalStore;
+
+
+/* A connection to ‘nix-store --serve --write’ on a remote host. */
+struct ServeConnection
+{
+    string host;
+    Pid sshPid;
+    AutoCloseFD toFd, fromFd;
+    FdSink to;
+    FdSource from;
+    unsigned int serverVersion;
+    Codec codec;
+};
+
+
+/* Return the command line that runs ‘nix-store’ on `host' through
+   SSH (see below for the special host name ‘local’). */
+Strings remoteNixStoreCommand(const string & host, const Strings & sshOpts);
+
+/* Start ‘nix-store --serve --write’ on `host' through SSH, passing
+   `sshOpts' to SSH in addition to $NIX_SSHOPTS, and perform the
+   handshake.  If `stderrFd' is not -1, the standard error of SSH
+   (which includes that of the remote side) goes to that file
+   descriptor.  The special host name ‘local’ runs ‘nix-store’ on the
+   local machine without SSH, which is mostly useful for testing. */
+void openServeConnection(ServeConnection & conn, const string & host,
+    const Strings & sshOpts, int stderrFd = -1);
+
+/* Ask the remote side to compress closures with the first codec in
+   `codecs' that both sides support. */
+void setServeCompression(ServeConnection & conn, const Strings & codecs);
+
+/* Close the connection and wait for SSH to exit. */
+void closeServeConnection(ServeConnection & conn);
+
+/* Return the subset of `paths' that is valid on the remote side.  If
+   `lock' is set, the remote side adds temporary roots for them. */
+PathSet queryRemoteValidPaths(ServeConnection & conn, const PathSet & paths,
+    bool lock, bool substitute);
+
+
+/* The amount of data moved by a transfer: the size of the export
+   stream and the number of bytes that actually went over the
+   connection. */
+struct TransferStats
+{
+    unsigned long long size, compressedSize;
+
+    /* The part of `size' that was taken from local paths rather than
+       transferred. */
+    unsigned long long reused;
+
+    TransferStats() : size(0), compressedSize(0), reused(0) { }
+};
+
+/* Called during a transfer with the number of bytes of the
+   (uncompressed) export stream moved so far. */
+typedef std::function<void(unsigned long long)> ProgressCallback;
+
+/* Import `paths' (which must be sorted so that references come
+   first) into the remote store. */
+TransferStats exportToServe(ServeConnection & conn, StoreAPI & store,
+    const Paths & paths, bool sign,
+    const ProgressCallback & progress = ProgressCallback());
+
+/* Import the export stream that the remote side is sending into
+   `store'. */
+TransferStats importFromServe(ServeConnection & conn, StoreAPI & store,
+    const ProgressCallback & progress = ProgressCallback());
+
+/* Fetch `paths' (sorted so that references come first) into `store',
+   letting the remote side send only the parts of them that aren't in
+   similar local paths (see chunks.hh).  Returns false without sending
+   anything if there are no similar paths.  Throws MissingChunk after
+   reading the rest of the stream if the local data couldn't be used,
+   in which case the caller should fetch the paths that are still
+   invalid in the normal way. */
+bool importChunkedFromServe(ServeConnection & conn, LocalStore & store,
+    const Paths & paths, bool sign, TransferStats & stats,
+    const ProgressCallback & progress = ProgressCallback());
+
+
+}
@@ -227,6 +227,21 @@ Path computeStorePathForText(const string & name, const string & s,
 }
 
 
+void StoreAPI::addTempRoots(const PathSet & paths)
+{
+    for (auto & i : paths) addTempRoot(i);
+}
+
+
+ValidPathInfos StoreAPI::queryPathInfos(const PathSet & paths)
+{
+    ValidPathInfos res;
+    for (auto & i : queryValidPaths(paths))
+        res.push_back(queryPathInfo(i));
+    return res;
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -234,11 +249,18 @@ string StoreAPI::makeValidityRegistration(const PathSet & paths,
     bool showDerivers, bool showHash)
 {
     string s = "";
-    
-    foreach (PathSet::iterator, i, paths) {
-        s += *i + "\n";
 
-        ValidPathInfo info = queryPathInfo(*i);
+    ValidPathInfos infos = queryPathInfos(paths);
+    if (infos.size() != paths.size()) {
+        PathSet missing(paths);
+        foreach (ValidPathInfos::iterator, i, infos) missing.erase(i->path);
+        throw Error(format("path ‘%1%’ is not valid") % *missing.begin());
+    }
+
+    foreach (ValidPathInfos::iterator, i, infos) {
+        ValidPathInfo & info(*i);
+
+        s += info.path + "\n";
 
         if (showHash) {
             s += printHash(info.hash) + "\n";
@@ -283,6 +305,14 @@ ValidPathInfo decodeValidPathInfo(std::istream & str, bool hashGiven)
 }
 
 
+string showBuildStats(const BuildStats & stats)
+{
+    return (format("wall=%1% user=%2% system=%3% maxrss=%4% read=%5% written=%6%")
+        % stats.wallTime % stats.userTime % stats.systemTime
+        % stats.maxRSS % stats.bytesRead % stats.bytesWritten).str();
+}
+
+
 string showPaths(const PathSet & paths)
 {
     string s;
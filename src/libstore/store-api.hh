@@ -100,6 +100,32 @@ typedef list<ValidPathInfo> ValidPathInfos;
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
 
+/* The resources used by one build of a derivation, summed over the
+   builder and all its descendants. */
+struct BuildStats
+{
+    Path drvPath;
+    time_t startTime;
+    bool succeeded;
+    unsigned long long wallTime; /* in milliseconds */
+    unsigned long long userTime;
+    unsigned long long systemTime;
+    unsigned long long maxRSS; /* in KiB; of the largest process */
+    unsigned long long bytesRead; /* from or to disk */
+    unsigned long long bytesWritten;
+    BuildStats()
+    {
+        startTime = 0;
+        succeeded = false;
+        wallTime = userTime = systemTime = maxRSS = 0;
+        bytesRead = bytesWritten = 0;
+    }
+};
+
+/* Return `stats' as a line of `key=value' pairs. */
+string showBuildStats(const BuildStats & stats);
+
+
 class StoreAPI 
 {
 public:
@@ -118,6 +144,10 @@ public:
     /* Query information about a valid path. */
     virtual ValidPathInfo queryPathInfo(const Path & path) = 0;
 
+    /* Query information about those of the given paths that are
+       valid. */
+    virtual ValidPathInfos queryPathInfos(const PathSet & paths);
+
     /* Query the hash of a valid path. */ 
     virtual Hash queryPathHash(const Path & path) = 0;
 
@@ -203,6 +233,10 @@ public:
        The root disappears as soon as we exit. */
     virtual void addTempRoot(const Path & path) = 0;
 
+    /* The same for a set of paths.  This is cheaper than adding them
+       one at a time. */
+    virtual void addTempRoots(const PathSet & paths);
+
     /* Add an indirect root, which is merely a symlink to `path' from
        /nix/var/nix/gcroots/auto/<hash of `path'>.  `path' is supposed
        to be a symlink to a store path.  The garbage collector will
@@ -245,6 +279,10 @@ public:
        value `*' causes all failed paths to be cleared. */
     virtual void clearFailedPaths(const PathSet & paths) = 0;
 
+    /* Return the recorded builds of `drvPath' (see
+       `build-record-stats'), oldest first. */
+    virtual std::vector<BuildStats> queryBuildStats(const Path & drvPath) = 0;
+
     /* Return a string representing information about the path that
        can be loaded into the database using `nix-store --load-db' or
        `nix-store --register-validity'. */
@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <memory>
+#include <cstring>
 
 #include <strings.h> // for strcasecmp
 
@@ -161,15 +163,61 @@ static void parseContents(ParseSink & sink, Source & source, const Path & path)
         checkInterrupt();
         unsigned int n = sizeof(buf);
         if ((unsigned long long) n > left) n = left;
-        source(buf, n);
-        sink.receiveContents(buf, n);
-        left -= n;
+        /* Pass the data straight from the source's buffer if it has
+           one, to save a copy. */
+        const unsigned char * data;
+        size_t got = source.readDirect(data, n);
+        if (got == 0) {
+            source(buf, n);
+            data = buf;
+            got = n;
+        }
+        sink.receiveContents(data, got);
+        left -= got;
     }
 
     readPadding(size, source);
 }
 
 
+/* A string of the archive format that is expected to be one of a
+   few keywords (such as `(' or `type'), read without allocating. */
+struct Tag
+{
+    char data[16];
+    size_t len;
+
+    bool operator == (const char * s) const
+    {
+        return strlen(s) == len && memcmp(data, s, len) == 0;
+    }
+
+    bool operator != (const char * s) const
+    {
+        return !(*this == s);
+    }
+
+    string str() const
+    {
+        return string(data, len);
+    }
+};
+
+
+static void readTag(Source & source, Tag & tag)
+{
+    tag.len = readInt(source);
+    if (tag.len > sizeof(tag.data)) {
+        /* Can't be a keyword; read it anyway for the error message. */
+        string s(tag.len, 0);
+        source((unsigned char *) &s[0], tag.len);
+        throw badArchive("unexpected string " + s.substr(0, 64));
+    }
+    source((unsigned char *) tag.data, tag.len);
+    readPadding(tag.len, source);
+}
+
+
 struct CaseInsensitiveCompare
 {
     bool operator() (const string & a, const string & b) const
@@ -179,21 +227,25 @@ struct CaseInsensitiveCompare
 };
 
 
+typedef std::map<Path, int, CaseInsensitiveCompare> CaseHackNames;
+
+
 static void parse(ParseSink & sink, Source & source, const Path & path)
 {
-    string s;
+    Tag s;
 
-    s = readString(source);
+    readTag(source, s);
     if (s != "(") throw badArchive("expected open tag");
 
     enum { tpUnknown, tpRegular, tpDirectory, tpSymlink } type = tpUnknown;
 
-    std::map<Path, int, CaseInsensitiveCompare> names;
+    /* Only needed for the case hack. */
+    std::unique_ptr<CaseHackNames> names;
 
     while (1) {
         checkInterrupt();
 
-        s = readString(source);
+        readTag(source, s);
 
         if (s == ")") {
             break;
@@ -202,7 +254,8 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
         else if (s == "type") {
             if (type != tpUnknown)
                 throw badArchive("multiple type fields");
-            string t = readString(source);
+            Tag t;
+            readTag(source, t);
 
             if (t == "regular") {
                 type = tpRegular;
@@ -212,13 +265,14 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
             else if (t == "directory") {
                 sink.createDirectory(path);
                 type = tpDirectory;
+                if (useCaseHack) names = std::unique_ptr<CaseHackNames>(new CaseHackNames);
             }
 
             else if (t == "symlink") {
                 type = tpSymlink;
             }
 
-            else throw badArchive("unknown file type " + t);
+            else throw badArchive("unknown file type " + t.str());
 
         }
 
@@ -227,20 +281,20 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
         }
 
         else if (s == "executable" && type == tpRegular) {
-            readString(source);
+            readTag(source, s);
             sink.isExecutable();
         }
 
         else if (s == "entry" && type == tpDirectory) {
             string name, prevName;
 
-            s = readString(source);
+            readTag(source, s);
             if (s != "(") throw badArchive("expected open tag");
 
             while (1) {
                 checkInterrupt();
 
-                s = readString(source);
+                readTag(source, s);
 
                 if (s == ")") {
                     break;
@@ -251,20 +305,20 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
                     if (name <= prevName)
                         throw Error("NAR directory is not sorted");
                     prevName = name;
-                    if (useCaseHack) {
-                        auto i = names.find(name);
-                        if (i != names.end()) {
+                    if (names) {
+                        auto i = names->find(name);
+                        if (i != names->end()) {
                             printMsg(lvlDebug, format("case collision between ‘%1%’ and ‘%2%’") % i->first % name);
                             name += caseHackSuffix;
                             name += int2String(++i->second);
                         } else
-                            names[name] = 0;
+                            (*names)[name] = 0;
                     }
                 } else if (s == "node") {
-                    if (s.empty()) throw badArchive("entry name missing");
+                    if (name.empty()) throw badArchive("entry name missing");
                     parse(sink, source, path + "/" + name);
                 } else
-                    throw badArchive("unknown field " + s);
+                    throw badArchive("unknown field " + s.str());
             }
         }
 
@@ -274,7 +328,7 @@ static void parse(ParseSink & sink, Source & source, const Path & path)
         }
 
         else
-            throw badArchive("unknown field " + s);
+            throw badArchive("unknown field " + s.str());
     }
 }
 
@@ -338,7 +392,7 @@ struct RestoreSink : ParseSink
 #endif
     }
 
-    void receiveContents(unsigned char * data, unsigned int len)
+    void receiveContents(const unsigned char * data, unsigned int len)
     {
         writeFull(fd, data, len);
     }
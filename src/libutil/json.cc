@@ -0,0 +1,54 @@
+#include "json.hh"
+
+#include <cstring>
+
+
+namespace nix {
+
+
+void escapeJSON(std::ostream & str, const char * s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    const char * end = s + len, * start = s;
+
+    str.put('"');
+
+    for (const char * p = s; p != end; ++p) {
+        unsigned char c = *p;
+        if (c >= 32 && c != '"' && c != '\\') continue;
+
+        str.write(start, p - start);
+        start = p + 1;
+
+        if (c == '"' || c == '\\') {
+            char buf[2] = { '\\', (char) c };
+            str.write(buf, 2);
+        }
+        else if (c == '\n') str.write("\\n", 2);
+        else if (c == '\r') str.write("\\r", 2);
+        else if (c == '\t') str.write("\\t", 2);
+        else {
+            char buf[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            str.write(buf, 6);
+        }
+    }
+
+    str.write(start, end - start);
+    str.put('"');
+}
+
+
+void escapeJSON(std::ostream & str, const char * s)
+{
+    escapeJSON(str, s, strlen(s));
+}
+
+
+void escapeJSON(std::ostream & str, const string & s)
+{
+    escapeJSON(str, s.data(), s.size());
+}
+
+
+}
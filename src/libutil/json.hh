@@ -0,0 +1,80 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+
+namespace nix {
+
+using std::string;
+
+
+/* Write `s' to `str' as a JSON string.  Runs of characters that don't
+   need escaping are written in one go. */
+void escapeJSON(std::ostream & str, const char * s, size_t len);
+
+void escapeJSON(std::ostream & str, const char * s);
+
+void escapeJSON(std::ostream & str, const string & s);
+
+
+/* Helpers for writing JSON directly to a stream, without building
+   the document in memory first.  The object or list is closed when
+   the helper is destroyed, so nested values must be written within
+   its lifetime. */
+
+struct JSONObject
+{
+    std::ostream & str;
+    bool first;
+    JSONObject(std::ostream & str) : str(str), first(true)
+    {
+        str << '{';
+    }
+    ~JSONObject()
+    {
+        str << '}';
+    }
+    void attr(const string & s)
+    {
+        if (!first) str << ','; else first = false;
+        escapeJSON(str, s);
+        str << ':';
+    }
+    void attr(const string & s, const string & t)
+    {
+        attr(s);
+        escapeJSON(str, t);
+    }
+    void attr(const string & s, int n)
+    {
+        attr(s);
+        str << n;
+    }
+};
+
+struct JSONList
+{
+    std::ostream & str;
+    bool first;
+    JSONList(std::ostream & str) : str(str), first(true)
+    {
+        str << '[';
+    }
+    ~JSONList()
+    {
+        str << ']';
+    }
+    void elem()
+    {
+        if (!first) str << ','; else first = false;
+    }
+    void elem(const string & s)
+    {
+        elem();
+        escapeJSON(str, s);
+    }
+};
+
+
+}
@@ -3,6 +3,7 @@
 
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
 
 
 namespace nix {
@@ -106,6 +107,22 @@ size_t BufferedSource::read(unsigned char * data, size_t len)
 }
 
 
+size_t BufferedSource::readDirect(const unsigned char * & data, size_t len)
+{
+    if (!buffer) buffer = new unsigned char[bufSize];
+
+    if (!bufPosIn) bufPosIn = readUnbuffered(buffer, bufSize);
+
+    /* Hand out the data in the buffer.  Resetting the positions is
+       fine since the buffer won't be refilled until the next call. */
+    size_t n = len > bufPosIn - bufPosOut ? bufPosIn - bufPosOut : len;
+    data = buffer + bufPosOut;
+    bufPosOut += n;
+    if (bufPosIn == bufPosOut) bufPosIn = bufPosOut = 0;
+    return n;
+}
+
+
 bool BufferedSource::hasData()
 {
     return bufPosOut < bufPosIn;
@@ -134,6 +151,16 @@ size_t StringSource::read(unsigned char * data, size_t len)
 }
 
 
+size_t StringSource::readDirect(const unsigned char * & data, size_t len)
+{
+    if (pos == s.size()) throw EndOfFile("end of string reached");
+    size_t n = std::min(len, s.size() - pos);
+    data = (const unsigned char *) s.data() + pos;
+    pos += n;
+    return n;
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -251,11 +278,10 @@ size_t readString(unsigned char * buf, size_t max, Source & source)
 string readString(Source & source)
 {
     size_t len = readInt(source);
-    unsigned char * buf = new unsigned char[len];
-    AutoDeleteArray<unsigned char> d(buf);
-    source(buf, len);
+    string s(len, 0);
+    if (len) source((unsigned char *) &s[0], len);
     readPadding(len, source);
-    return string((char *) buf, len);
+    return s;
 }
 
  
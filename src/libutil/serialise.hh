@@ -46,6 +46,16 @@ struct Source
        return the number of bytes stored.  If blocks until at least
        one byte is available. */
     virtual size_t read(unsigned char * data, size_t len) = 0;
+
+    /* Like read(), but instead of copying the data, set ‘data’ to
+       point at it in the source's own buffer.  The data stays valid
+       until the next operation on the source.  Returns 0 if the
+       source doesn't support this, in which case nothing has been
+       consumed. */
+    virtual size_t readDirect(const unsigned char * & data, size_t len)
+    {
+        return 0;
+    }
 };
 
 
@@ -60,6 +70,8 @@ struct BufferedSource : Source
     ~BufferedSource();
     
     size_t read(unsigned char * data, size_t len);
+
+    size_t readDirect(const unsigned char * & data, size_t len);
     
     /* Underlying read call, to be overridden. */
     virtual size_t readUnbuffered(unsigned char * data, size_t len) = 0;
@@ -108,6 +120,7 @@ struct StringSource : Source
     size_t pos;
     StringSource(const string & _s) : s(_s), pos(0) { }
     size_t read(unsigned char * data, size_t len);    
+    size_t readDirect(const unsigned char * & data, size_t len);
 };
 
 
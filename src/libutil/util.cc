@@ -785,12 +785,12 @@ void Pid::kill(bool quiet)
 }
 
 
-int Pid::wait(bool block)
+int Pid::wait(bool block, struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, block ? 0 : WNOHANG);
+        int res = wait4(pid, &status, block ? 0 : WNOHANG, usage);
         if (res == pid) {
             pid = -1;
             return status;
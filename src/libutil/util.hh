@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <functional>
 
 #include <cstdio>
@@ -256,7 +257,10 @@ public:
     void operator =(pid_t pid);
     operator pid_t();
     void kill(bool quiet = false);
-    int wait(bool block);
+    /* Wait for the process to exit and return its status.  If
+       `usage' is not null, it receives the resources used by the
+       process and the descendants it waited for. */
+    int wait(bool block, struct rusage * usage = 0);
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
 };
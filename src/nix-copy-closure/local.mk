@@ -0,0 +1,9 @@
+programs += nix-copy-closure
+
+nix-copy-closure_DIR := $(d)
+
+nix-copy-closure_SOURCES := $(d)/nix-copy-closure.cc
+
+nix-copy-closure_LIBS = libmain libstore libutil libformat
+
+nix-copy-closure_LDFLAGS = -pthread
@@ -0,0 +1,431 @@
+#include "shared.hh"
+#include "util.hh"
+#include "serialise.hh"
+#include "globals.hh"
+#include "misc.hh"
+#include "store-api.hh"
+#include "local-store.hh"
+#include "compression.hh"
+#include "serve-protocol.hh"
+#include "serve-client.hh"
+#include "chunks.hh"
+#include "worker-protocol.hh"
+
+#include <iostream>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace nix;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+static void showThroughput(unsigned int nrPaths, const TransferStats & stats,
+    Codec codec, double start)
+{
+    double elapsed = std::max(now() - start, 0.001);
+    string compressed;
+    if (stats.reused)
+        compressed += (format(", %.2f MiB taken from local paths")
+            % (stats.reused / (1024.0 * 1024.0))).str();
+    if (codec != codecNone)
+        compressed += (format(", %.2f MiB compressed with %s")
+            % (stats.compressedSize / (1024.0 * 1024.0)) % codecName(codec)).str();
+    printMsg(lvlInfo, format("copied %d paths (%.2f MiB%s) in %.1f s, %.2f MiB/s")
+        % nrPaths % (stats.size / (1024.0 * 1024.0)) % compressed % elapsed
+        % (stats.compressedSize / (1024.0 * 1024.0) / elapsed));
+}
+
+
+/* Return a callback that shows how much of `total' bytes (if known)
+   has been transferred, at most a few times per second. */
+static ProgressCallback makeProgress(bool show, unsigned long long total)
+{
+    if (!show) return ProgressCallback();
+    double last = 0;
+    return [=](unsigned long long done) mutable {
+        double t = now();
+        if (t - last < 0.2) return;
+        last = t;
+        string s = (format("\r%.2f") % (done / (1024.0 * 1024.0))).str();
+        if (total)
+            s += (format(" of %.2f MiB (%d%%)") % (total / (1024.0 * 1024.0))
+                % std::min(done * 100 / total, 100ULL)).str();
+        else
+            s += " MiB";
+        writeToStderr(s + "\033[K");
+    };
+}
+
+
+static void endProgress(bool show)
+{
+    if (show) writeToStderr("\r\033[K");
+}
+
+
+/* Return the closure of `storePaths', dependencies first. */
+static Paths sortedClosure(const Paths & storePaths, bool includeOutputs)
+{
+    PathSet closure;
+    for (auto & i : storePaths)
+        computeFSClosure(*store, followLinksToStorePath(i), closure, false, includeOutputs);
+    Paths sorted = topoSortPaths(*store, closure);
+    std::reverse(sorted.begin(), sorted.end());
+    return sorted;
+}
+
+
+static void copyTo(ServeConnection & conn, const Paths & storePaths,
+    bool includeOutputs, bool dryRun, bool sign, bool useSubstitutes,
+    bool showProgress)
+{
+    Paths sorted = sortedClosure(storePaths, includeOutputs);
+
+    /* Ask which paths are already valid on the remote host, locking
+       them to prevent a race with the remote garbage collector.
+       Optionally ask the remote host to substitute missing paths. */
+    PathSet present = queryRemoteValidPaths(conn,
+        PathSet(sorted.begin(), sorted.end()), true, useSubstitutes && !dryRun);
+
+    Paths missing;
+    for (auto & i : sorted)
+        if (present.find(i) == present.end()) missing.push_back(i);
+
+    unsigned long long missingSize = 0;
+    for (auto & info : store->queryPathInfos(PathSet(missing.begin(), missing.end())))
+        missingSize += info.narSize;
+
+    if (missing.empty()) return;
+
+    printMsg(lvlError, format("copying %d missing paths (%.2f MiB) to ‘%s’...")
+        % missing.size() % (missingSize / (1024.0 * 1024.0)) % conn.host);
+    if (dryRun) return;
+
+    double start = now();
+
+    TransferStats stats = exportToServe(conn, *store, missing, sign,
+        makeProgress(showProgress, missingSize));
+    endProgress(showProgress);
+
+    showThroughput(missing.size(), stats, conn.codec, start);
+}
+
+
+/* For backwards compatibility with remote hosts running Nix <= 1.7,
+   which lack ‘nix-store --serve’. */
+static void oldCopyTo(const string & host, const Strings & sshOpts,
+    const Paths & storePaths, bool includeOutputs, bool dryRun, bool sign,
+    bool useSubstitutes)
+{
+    Paths closure = sortedClosure(storePaths, includeOutputs);
+
+    auto remote = [&](const Strings & args) {
+        Strings cmd = remoteNixStoreCommand(host, sshOpts);
+        cmd.insert(cmd.end(), args.begin(), args.end());
+        return cmd;
+    };
+
+    /* Optionally use substitutes on the remote host.  The exit status
+       is ignored because this is just an optimisation. */
+    if (!dryRun && useSubstitutes) {
+        Strings cmd = remote({"-r", "--ignore-unknown"});
+        cmd.insert(cmd.end(), closure.begin(), closure.end());
+        try {
+            runProgram(cmd.front(), true, Strings(++cmd.begin(), cmd.end()));
+        } catch (ExecError & e) {
+        }
+    }
+
+    /* Ask the remote host which paths are invalid.  Because of limits
+       to the command line length, do this in chunks. */
+    Paths missing;
+    for (auto i = closure.begin(); i != closure.end(); ) {
+        Strings cmd = remote({"--check-validity", "--print-invalid"});
+        for (unsigned int n = 0; n < 1500 && i != closure.end(); ++n, ++i)
+            cmd.push_back(*i);
+        for (auto & j : tokenizeString<Paths>(runProgram(cmd.front(), true, Strings(++cmd.begin(), cmd.end())), "\n"))
+            missing.push_back(j);
+    }
+
+    if (missing.empty()) return;
+
+    printMsg(lvlError, format("copying %d missing paths to ‘%s’...") % missing.size() % host);
+    if (dryRun) return;
+
+    /* Export the store paths and import them on the remote host. */
+    Strings cmd = remote({"--import"});
+    std::vector<const char *> cargs;
+    for (auto & i : cmd) cargs.push_back(i.c_str());
+    cargs.push_back(0);
+
+    Pipe pipe;
+    pipe.create();
+
+    Pid pid = startProcess([&]() {
+        if (dup2(pipe.readSide, STDIN_FILENO) == -1)
+            throw SysError("dupping stdin");
+        AutoCloseFD fd = open("/dev/null", O_WRONLY);
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+            throw SysError("redirecting stdout to ‘/dev/null’");
+        execvp(cargs[0], (char * *) &cargs[0]);
+        throw SysError(format("executing ‘%1%’") % cargs[0]);
+    });
+
+    pipe.readSide.close();
+    FdSink sink(pipe.writeSide);
+    exportPaths(*store, missing, sign, sink);
+    sink.flush();
+    pipe.writeSide.close();
+
+    int status = pid.wait(true);
+    if (!statusOk(status))
+        throw Error(format("copying store paths to remote machine ‘%1%’ failed: %2%")
+            % host % statusToString(status));
+}
+
+
+/* Import the export stream that the remote side is sending. */
+static void importFrom(ServeConnection & conn, unsigned int nrPaths,
+    bool showProgress, unsigned long long size)
+{
+    double start = now();
+    TransferStats stats = importFromServe(conn, *store, makeProgress(showProgress, size));
+    endProgress(showProgress);
+    showThroughput(nrPaths, stats, conn.codec, start);
+}
+
+
+/* Try to fetch `paths' using the data of older versions of them that
+   we already have.  Returns the paths that still need to be fetched
+   normally. */
+static Paths fetchChunked(ServeConnection & conn, LocalStore & localStore,
+    const Paths & paths, bool sign, bool showProgress, unsigned long long size)
+{
+    double start = now();
+    TransferStats stats;
+    try {
+        bool res = importChunkedFromServe(conn, localStore, paths, sign, stats,
+            makeProgress(showProgress, size));
+        endProgress(showProgress);
+        if (!res) return paths;
+    } catch (MissingChunk & e) {
+        endProgress(showProgress);
+        printMsg(lvlError, format("warning: %1%; copying the remaining paths in full") % e.msg());
+        PathSet valid = localStore.queryValidPaths(PathSet(paths.begin(), paths.end()));
+        Paths left;
+        for (auto & i : paths)
+            if (valid.find(i) == valid.end()) left.push_back(i);
+        return left;
+    }
+    showThroughput(paths.size(), stats, conn.codec, start);
+    return Paths();
+}
+
+
+static void copyFrom(ServeConnection & conn, const Paths & storePaths,
+    bool includeOutputs, bool dryRun, bool sign, bool useChunks, bool showProgress)
+{
+    /* Query the closure of the given store paths on the remote
+       machine.  Paths are assumed to be store paths; there is no
+       resolution (following of symlinks). */
+    writeInt(cmdQueryClosure, conn.to);
+    writeInt(includeOutputs, conn.to);
+    writeStrings(storePaths, conn.to);
+    conn.to.flush();
+    PathSet closure = readStorePaths<PathSet>(conn.from);
+
+    PathSet valid = store->queryValidPaths(closure);
+    PathSet missing;
+    for (auto & i : closure)
+        if (valid.find(i) == valid.end()) missing.insert(i);
+
+    if (missing.empty()) return;
+
+    /* Old servers just send the missing paths. */
+    if (GET_PROTOCOL_MINOR(conn.serverVersion) < 2) {
+        printMsg(lvlError, format("copying %1% missing paths from ‘%2%’...")
+            % missing.size() % conn.host);
+        if (dryRun) return;
+        writeInt(cmdExportPaths, conn.to);
+        writeInt(sign, conn.to);
+        writeStrings(missing, conn.to);
+        conn.to.flush();
+        importFrom(conn, missing.size(), showProgress, 0);
+        return;
+    }
+
+    /* Otherwise, get the manifest of the missing paths first. */
+    writeInt(cmdQueryExportManifest, conn.to);
+    writeStrings(missing, conn.to);
+    conn.to.flush();
+    ValidPathInfos manifest;
+    unsigned int count = readInt(conn.from);
+    while (count--) {
+        ValidPathInfo info;
+        info.path = readStorePath(conn.from);
+        info.deriver = readString(conn.from);
+        if (info.deriver != "") assertStorePath(info.deriver);
+        info.references = readStorePaths<PathSet>(conn.from);
+        string hash = readString(conn.from);
+        string::size_type colon = hash.find(':');
+        HashType ht = colon == string::npos ? htUnknown : parseHashType(string(hash, 0, colon));
+        if (ht == htUnknown)
+            throw Error(format("‘%1%’ sent an invalid hash for ‘%2%’") % conn.host % info.path);
+        info.hash = parseHash(ht, string(hash, colon + 1));
+        info.narSize = readLongLong(conn.from);
+        manifest.push_back(info);
+    }
+
+    /* Paths whose contents we already have under another name can
+       be created locally, provided that their references are valid
+       by then. */
+    std::map<Hash, Path> identical;
+    LocalStore * localStore = dynamic_cast<LocalStore *>(store.get());
+    if (localStore) {
+        std::set<Hash> hashes;
+        for (auto & info : manifest) hashes.insert(info.hash);
+        identical = localStore->queryPathsByHash(hashes);
+    }
+
+    Paths fetch;
+    ValidPathInfos reuse;
+    PathSet available = valid;
+    unsigned long long fetchSize = 0, reuseSize = 0;
+    for (auto & info : manifest) {
+        bool canReuse = identical.find(info.hash) != identical.end();
+        for (auto & ref : info.references)
+            if (ref != info.path && available.find(ref) == available.end()) canReuse = false;
+        if (canReuse) {
+            reuse.push_back(info);
+            available.insert(info.path);
+            reuseSize += info.narSize;
+        } else {
+            fetch.push_back(info.path);
+            fetchSize += info.narSize;
+        }
+    }
+
+    if (!reuse.empty())
+        printMsg(lvlError, format("reusing local contents for %d missing paths (%.2f MiB)")
+            % reuse.size() % (reuseSize / (1024.0 * 1024.0)));
+    if (!fetch.empty())
+        printMsg(lvlError, format("copying %d missing paths (%.2f MiB) from ‘%s’...")
+            % fetch.size() % (fetchSize / (1024.0 * 1024.0)) % conn.host);
+    if (dryRun) return;
+
+    for (auto & info : reuse)
+        localStore->addIdenticalPath(identical[info.hash], info);
+
+    if (fetch.empty()) return;
+
+    if (useChunks && localStore && GET_PROTOCOL_MINOR(conn.serverVersion) >= 3) {
+        fetch = fetchChunked(conn, *localStore, fetch, sign, showProgress, fetchSize);
+        if (fetch.empty()) return;
+        PathSet left(fetch.begin(), fetch.end());
+        fetchSize = 0;
+        for (auto & info : manifest)
+            if (left.find(info.path) != left.end()) fetchSize += info.narSize;
+    }
+
+    writeInt(cmdExportPathsOrdered, conn.to);
+    writeInt(sign, conn.to);
+    writeStrings(fetch, conn.to);
+    conn.to.flush();
+    importFrom(conn, fetch.size(), showProgress, fetchSize);
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        bool toMode = true;
+        bool sign = false;
+        bool includeOutputs = false;
+        bool dryRun = false;
+        bool useSubstitutes = false;
+        bool legacyCompress = false;
+        bool useChunks = true;
+        bool showProgress = false;
+        string host;
+        Paths storePaths;
+
+        /* By default, use a codec that is fast enough not to slow
+           down a local network. */
+        Strings codecs = streamingCodecs();
+
+        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--help")
+                showManPage("nix-copy-closure");
+            else if (*arg == "--version")
+                printVersion("nix-copy-closure");
+            else if (*arg == "--sign") sign = true;
+            else if (*arg == "--gzip" || *arg == "--xz") legacyCompress = true;
+            else if (*arg == "--bzip2") codecs.push_back("bzip2");
+            else if (*arg == "--compress") {
+                string s = getArg(*arg, arg, end);
+                codecs.clear();
+                if (s != "none") {
+                    if (parseCodec(s) == codecNone)
+                        throw UsageError(format("unsupported compression method ‘%1%’") % s);
+                    codecs.push_back(s);
+                }
+            }
+            else if (*arg == "--no-dedup") useChunks = false;
+            else if (*arg == "--from") toMode = false;
+            else if (*arg == "--to") toMode = true;
+            else if (*arg == "--include-outputs") includeOutputs = true;
+            else if (*arg == "--show-progress") showProgress = true;
+            else if (*arg == "--dry-run") dryRun = true;
+            else if (*arg == "--use-substitutes" || *arg == "-s") useSubstitutes = true;
+            else if (*arg != "" && arg->at(0) == '-')
+                return false;
+            else if (host == "") host = *arg;
+            else storePaths.push_back(*arg);
+            return true;
+        });
+
+        if (host == "") throw UsageError("no host name specified");
+
+        settings.update();
+
+        store = openStore();
+
+        ServeConnection conn;
+        /* ‘--gzip’ and ‘--xz’ used to enable compression by SSH,
+           which we still do if we can't compress ourselves. */
+        Strings sshOpts;
+        if (legacyCompress && codecs.empty()) sshOpts.push_back("-C");
+        try {
+            openServeConnection(conn, host, sshOpts);
+        } catch (Error & e) {
+            /* Remote hosts running Nix <= 1.7 lack ‘nix-store
+               --serve’.  There is no fallback for copying from such
+               hosts. */
+            if (!toMode)
+                throw Error(format("%1% (copying from hosts running Nix 1.7 or older is not supported)") % e.msg());
+            printMsg(lvlError, format("warning: %1%; falling back to old closure copying method") % e.msg());
+            oldCopyTo(host, sshOpts, storePaths, includeOutputs, dryRun, sign, useSubstitutes);
+            return;
+        }
+        setServeCompression(conn, codecs);
+
+        if (toMode)
+            copyTo(conn, storePaths, includeOutputs, dryRun, sign, useSubstitutes, showProgress);
+        else
+            copyFrom(conn, storePaths, includeOutputs, dryRun, sign, useChunks, showProgress);
+
+        closeServeConnection(conn);
+    });
+}
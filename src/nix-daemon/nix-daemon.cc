@@ -7,8 +7,11 @@
 #include "affinity.hh"
 #include "globals.hh"
 #include "monitor-fd.hh"
+#include "path-info-snapshot.hh"
+#include "jobserver.hh"
 
 #include <algorithm>
+#include <map>
 
 #include <cstring>
 #include <unistd.h>
@@ -26,6 +29,10 @@
 #include <sys/ucred.h>
 #endif
 
+#if __linux__
+#include <sys/prctl.h>
+#endif
+
 using namespace nix;
 
 
@@ -123,7 +130,7 @@ struct RetrieveRegularNARSink : ParseSink
         regular = false;
     }
 
-    void receiveContents(unsigned char * data, unsigned int len)
+    void receiveContents(const unsigned char * data, unsigned int len)
     {
         s.append((const char *) data, len);
     }
@@ -147,6 +154,12 @@ struct SavingSourceAdapter : Source
         s.append((const char *) data, n);
         return n;
     }
+    size_t readDirect(const unsigned char * & data, size_t len)
+    {
+        size_t n = orig.readDirect(data, len);
+        if (n) s.append((const char *) data, n);
+        return n;
+    }
 };
 
 
@@ -345,6 +358,15 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopAddTempRoots: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        startWork();
+        store->addTempRoots(paths);
+        stopWork();
+        writeInt(1, to);
+        break;
+    }
+
     case wopAddIndirectRoot: {
         Path path = absPath(readString(from));
         startWork();
@@ -490,6 +512,25 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopQueryBuildStats: {
+        Path path = readStorePath(from);
+        startWork();
+        std::vector<BuildStats> builds = store->queryBuildStats(path);
+        stopWork();
+        writeInt(builds.size(), to);
+        for (auto & i : builds) {
+            writeLongLong(i.startTime, to);
+            writeInt(i.succeeded, to);
+            writeLongLong(i.wallTime, to);
+            writeLongLong(i.userTime, to);
+            writeLongLong(i.systemTime, to);
+            writeLongLong(i.maxRSS, to);
+            writeLongLong(i.bytesRead, to);
+            writeLongLong(i.bytesWritten, to);
+        }
+        break;
+    }
+
     case wopClearFailedPaths: {
         PathSet paths = readStrings<PathSet>(from);
         startWork();
@@ -562,8 +603,14 @@ static void processConnection(bool trusted)
             throw Error("if you run ‘nix-daemon’ as root, then you MUST set ‘build-users-group’!");
 #endif
 
-        /* Open the store. */
-        store = std::shared_ptr<StoreAPI>(new LocalStore(reserveSpace));
+        /* Open the store, unless we're a pre-forked worker that
+           already has one.  In that case, still honour the client's
+           request to free (or restore) the reserved space, like
+           opening the store would. */
+        if (!store)
+            store = std::shared_ptr<StoreAPI>(new LocalStore(reserveSpace));
+        else
+            ((LocalStore *) store.get())->updateReservedSpace(reserveSpace);
 
         stopWork();
         to.flush();
@@ -614,6 +661,26 @@ static void processConnection(bool trusted)
 }
 
 
+/* Minimum number of seconds between path info snapshots; 0 means
+   that no snapshots are published. */
+static unsigned int snapshotInterval = 0;
+
+
+/* Publish a new path info snapshot if it's enabled and the current one
+   is out of date.  This runs after the client has gone away, so it
+   doesn't have to wait for it. */
+static void refreshPathInfoSnapshot()
+{
+    if (snapshotInterval == 0 || !store) return;
+    try {
+        if (pathInfoSnapshotOutdated(snapshotInterval))
+            dynamic_cast<LocalStore &>(*store).publishPathInfoSnapshot();
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: cannot publish path info snapshot: %1%") % e.msg());
+    }
+}
+
+
 static void sigChldHandler(int sigNo)
 {
     /* Reap all dead children. */
@@ -691,6 +758,185 @@ static PeerInfo getPeerInfo(int remote)
 }
 
 
+/* Check whether the peer connected to `remote' is allowed to use the
+   daemon, and return whether it is trusted. */
+static bool authenticatePeer(int remote, PeerInfo & peer)
+{
+    bool trusted = false;
+    peer = getPeerInfo(remote);
+
+    struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
+    string user = pw ? pw->pw_name : int2String(peer.uid);
+
+    struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
+    string group = gr ? gr->gr_name : int2String(peer.gid);
+
+    Strings trustedUsers = settings.get("trusted-users", Strings({"root"}));
+    Strings allowedUsers = settings.get("allowed-users", Strings({"*"}));
+
+    if (matchUser(user, group, trustedUsers))
+        trusted = true;
+
+    if (!trusted && !matchUser(user, group, allowedUsers))
+        throw Error(format("user ‘%1%’ is not allowed to connect to the Nix daemon") % user);
+
+    printMsg(lvlInfo, format((string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""))
+        % (peer.pidKnown ? int2String(peer.pid) : "<unknown>")
+        % (peer.uidKnown ? user : "<unknown>"));
+
+    return trusted;
+}
+
+
+static volatile sig_atomic_t workerQuit = 0;
+
+
+static void workerQuitHandler(int sigNo)
+{
+    workerQuit = 1;
+    _isInterrupted = 1;
+}
+
+
+/* Main loop of a pre-forked worker.  Unlike a per-connection child, a
+   worker opens the store once and then handles connections one at a
+   time until it's told to quit.  Everything a client can change
+   (settings, verbosity, CPU affinity, temporary roots, substituters)
+   is reset between connections.  If a connection ends abnormally,
+   the exception propagates and the worker dies; the master will
+   start a fresh one. */
+static void runWorker(int fdSocket, pid_t master)
+{
+    if (setsid() == -1)
+        throw SysError(format("creating a new session"));
+
+    /* SIGTERM/SIGHUP from the master must not be confused with the
+       SIGINT that MonitorFdHup sends when a client hangs up. */
+    struct sigaction act;
+    act.sa_handler = workerQuitHandler;
+    sigfillset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGTERM, &act, 0) || sigaction(SIGHUP, &act, 0))
+        throw SysError("installing daemon worker signal handlers");
+
+#if __linux__
+    /* Idle workers only check getppid() after accept() returns, so
+       make sure they go away with the master even if it is killed
+       without getting a chance to stop them. */
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1)
+        throw SysError("setting death signal");
+#endif
+    if (getppid() != master) exit(0);
+
+    LocalStore * localStore = new LocalStore();
+    store = std::shared_ptr<StoreAPI>(localStore);
+
+    Settings savedSettings = settings;
+    Verbosity savedVerbosity = verbosity;
+    LogType savedLogType = logType;
+
+    while (!workerQuit && getppid() == master) {
+
+        struct sockaddr_un remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+        AutoCloseFD remote = accept(fdSocket,
+            (struct sockaddr *) &remoteAddr, &remoteAddrLen);
+        if (remote == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("accepting connection");
+        }
+
+        closeOnExec(remote);
+
+        bool trusted;
+        PeerInfo peer;
+        try {
+            trusted = authenticatePeer(remote, peer);
+        } catch (Error & e) {
+            printMsg(lvlError, format("error processing connection: %1%") % e.msg());
+            continue;
+        }
+
+        from.fd = remote;
+        from.bufPosIn = from.bufPosOut = 0;
+        to.fd = remote;
+        processConnection(trusted);
+
+        remote.close();
+        from.fd = to.fd = -1;
+
+        settings = savedSettings;
+        verbosity = savedVerbosity;
+        logType = savedLogType;
+        restoreAffinity();
+        localStore->resetClientState();
+
+        refreshPathInfoSnapshot();
+
+        /* MonitorFdHup may have raised SIGINT when the client hung
+           up at the end of the session; that's not a reason to
+           quit. */
+        if (!workerQuit) _isInterrupted = 0;
+    }
+
+    exit(0);
+}
+
+
+/* Run a pool of `nrWorkers' pre-forked workers that accept
+   connections on `fdSocket' themselves, and replace workers as they
+   exit.  The master never opens the store. */
+static void workerPoolLoop(int fdSocket, unsigned int nrWorkers)
+{
+    setSigChldAction(false);
+
+    pid_t master = getpid();
+    std::map<pid_t, time_t> workers;
+
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.dieWithParent = false;
+    options.runExitHandlers = true;
+    options.allowVfork = false;
+
+    try {
+        while (1) {
+
+            while (workers.size() < nrWorkers) {
+                pid_t pid = startProcess([&]() {
+                    runWorker(fdSocket, master);
+                }, options);
+                workers[pid] = time(0);
+            }
+
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            checkInterrupt();
+            if (pid == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for daemon workers");
+            }
+
+            auto i = workers.find(pid);
+            if (i == workers.end()) continue;
+
+            if (status != 0) {
+                printMsg(lvlError, format("daemon worker %1% %2%") % pid % statusToString(status));
+                /* Don't respawn in a tight loop if workers fail right
+                   away, e.g. because the store cannot be opened. */
+                if (time(0) - i->second < 1) sleep(1);
+            }
+
+            workers.erase(i);
+        }
+    } catch (...) {
+        for (auto & i : workers) kill(i.first, SIGTERM);
+        throw;
+    }
+}
+
+
 #define SD_LISTEN_FDS_START 3
 
 
@@ -754,6 +1000,24 @@ static void daemonLoop(char * * argv)
 
     closeOnExec(fdSocket);
 
+    unsigned int nrWorkers = 0;
+    string s = settings.get("daemon-workers", string("0"));
+    if (!string2Int(s, nrWorkers))
+        throw Error(format("configuration setting ‘daemon-workers’ should have an integer value"));
+
+    s = settings.get("path-info-snapshot-interval", string("0"));
+    if (!string2Int(s, snapshotInterval))
+        throw Error(format("configuration setting ‘path-info-snapshot-interval’ should have an integer value"));
+
+    /* Create the jobserver before forking any workers, so that the
+       builds of all clients draw from the same pool. */
+    if (settings.buildJobserver) getJobserver();
+
+    if (nrWorkers > 0) {
+        workerPoolLoop(fdSocket, nrWorkers);
+        return;
+    }
+
     /* Loop accepting connections. */
     while (1) {
 
@@ -776,27 +1040,8 @@ static void daemonLoop(char * * argv)
 
             closeOnExec(remote);
 
-            bool trusted = false;
-            PeerInfo peer = getPeerInfo(remote);
-
-            struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
-            string user = pw ? pw->pw_name : int2String(peer.uid);
-
-            struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
-            string group = gr ? gr->gr_name : int2String(peer.gid);
-
-            Strings trustedUsers = settings.get("trusted-users", Strings({"root"}));
-            Strings allowedUsers = settings.get("allowed-users", Strings({"*"}));
-
-            if (matchUser(user, group, trustedUsers))
-                trusted = true;
-
-            if (!trusted && !matchUser(user, group, allowedUsers))
-                throw Error(format("user ‘%1%’ is not allowed to connect to the Nix daemon") % user);
-
-            printMsg(lvlInfo, format((string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""))
-                % (peer.pidKnown ? int2String(peer.pid) : "<unknown>")
-                % (peer.uidKnown ? user : "<unknown>"));
+            PeerInfo peer;
+            bool trusted = authenticatePeer(remote, peer);
 
             /* Fork a child to handle the connection. */
             ProcessOptions options;
@@ -825,6 +1070,8 @@ static void daemonLoop(char * * argv)
                 to.fd = remote;
                 processConnection(trusted);
 
+                refreshPathInfoSnapshot();
+
                 exit(0);
             }, options);
 
@@ -850,31 +850,72 @@ static VersionDiff compareVersionAgainstSet(
 }
 
 
+static void printDrvJSON(Globals & globals, JSONObject & topObj, DrvInfo & drv)
+{
+    topObj.attr(drv.attrPath);
+    JSONObject pkgObj(cout);
+
+    pkgObj.attr("name", drv.name);
+    pkgObj.attr("system", drv.system);
+
+    pkgObj.attr("meta");
+    JSONObject metaObj(cout);
+    StringSet metaNames = drv.queryMetaNames();
+    foreach (StringSet::iterator, j, metaNames) {
+        metaObj.attr(*j);
+        Value * v = drv.queryMeta(*j);
+        if (!v) {
+            printMsg(lvlError, format("derivation ‘%1%’ has invalid meta attribute ‘%2%’") % drv.name % *j);
+            cout << "null";
+        } else {
+            PathSet context;
+            printValueAsJSON(*globals.state, true, *v, cout, context);
+        }
+    }
+}
+
+
 static void queryJSON(Globals & globals, vector<DrvInfo> & elems)
 {
     JSONObject topObj(cout);
-    foreach (vector<DrvInfo>::iterator, i, elems) {
-        topObj.attr(i->attrPath);
-        JSONObject pkgObj(cout);
-
-        pkgObj.attr("name", i->name);
-        pkgObj.attr("system", i->system);
-
-        pkgObj.attr("meta");
-        JSONObject metaObj(cout);
-        StringSet metaNames = i->queryMetaNames();
-        foreach (StringSet::iterator, j, metaNames) {
-            metaObj.attr(*j);
-            Value * v = i->queryMeta(*j);
-            if (!v) {
-                printMsg(lvlError, format("derivation ‘%1%’ has invalid meta attribute ‘%2%’") % i->name % *j);
-                cout << "null";
-            } else {
-                PathSet context;
-                printValueAsJSON(*globals.state, true, *v, cout, context);
-            }
-        }
+    foreach (vector<DrvInfo>::iterator, i, elems)
+        printDrvJSON(globals, topObj, *i);
+}
+
+
+/* Print the available derivations that match `args' as soon as they
+   have been evaluated, in attribute order.  Unlike opQuery's normal
+   path, this doesn't keep all derivations in memory. */
+static void streamAvailableJSON(Globals & globals, const string & attrPath,
+    const Strings & args)
+{
+    EvalState & state(*globals.state);
+
+    DrvNames selectors = drvNamesFromArgs(args);
+    if (selectors.empty())
+        selectors.push_back(DrvName("*"));
+
+    Value vRoot;
+    loadSourceExpr(state, globals.instSource.nixExprPath, vRoot);
+    Value & v(*findAlongAttrPath(state, attrPath, *globals.instSource.autoArgs, vRoot));
+
+    {
+        JSONObject topObj(cout);
+        getDerivations(state, v, attrPath, *globals.instSource.autoArgs, [&](DrvInfo & drv) {
+            if (globals.instSource.systemFilter != "*" && drv.system != globals.instSource.systemFilter)
+                return;
+            DrvName drvName(drv.name);
+            bool matches = false;
+            for (auto & i : selectors)
+                if (i.matches(drvName)) {
+                    i.hits++;
+                    matches = true;
+                }
+            if (matches) printDrvJSON(globals, topObj, drv);
+        }, true);
     }
+
+    checkSelectorUse(selectors);
 }
 
 
@@ -894,6 +935,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     bool compareVersions = false;
     bool xmlOutput = false;
     bool jsonOutput = false;
+    bool streamOutput = false;
 
     enum { sInstalled, sAvailable } source = sInstalled;
 
@@ -913,6 +955,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         else if (arg == "--available" || arg == "-a") source = sAvailable;
         else if (arg == "--xml") xmlOutput = true;
         else if (arg == "--json") jsonOutput = true;
+        else if (arg == "--stream") streamOutput = true;
         else if (arg == "--attr-path" || arg == "-P") printAttrPath = true;
         else if (arg == "--attr" || arg == "-A")
             attrPath = needArg(i, opFlags, arg);
@@ -921,6 +964,16 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     }
 
 
+    if (streamOutput && !jsonOutput)
+        throw UsageError("‘--stream’ requires ‘--json’");
+
+    /* Nothing needs to be compared or sorted, so the derivations can
+       be printed as they are found. */
+    if (streamOutput && source == sAvailable && !compareVersions && !printStatus) {
+        streamAvailableJSON(globals, attrPath, opArgs);
+        return;
+    }
+
     /* Obtain derivation information from the specified source. */
     DrvInfos availElems, installedElems;
 
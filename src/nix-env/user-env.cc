@@ -40,6 +40,17 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
     debug(format("building user environment dependencies"));
     store->buildPaths(drvsToBuild, state.repair ? bmRepair : bmNormal);
 
+    /* Make sure the outputs don't get garbage collected while we
+       build the user environment.  This is only necessary when
+       installing store paths, e.g., `nix-env -i /nix/store/abcd...-foo'. */
+    PathSet outputPaths;
+    foreach (DrvInfos::iterator, i, elems) {
+        DrvInfo::Outputs outputs = i->queryOutputs();
+        foreach (DrvInfo::Outputs::iterator, j, outputs)
+            outputPaths.insert(j->second);
+    }
+    store->addTempRoots(outputPaths);
+
     /* Construct the whole top level derivation. */
     PathSet references;
     Value manifest;
@@ -74,9 +85,6 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
             state.mkAttrs(vOutputs, 2);
             mkString(*state.allocAttr(vOutputs, state.sOutPath), j->second);
 
-            /* This is only necessary when installing store paths, e.g.,
-               `nix-env -i /nix/store/abcd...-foo'. */
-            store->addTempRoot(j->second);
             store->ensurePath(j->second);
 
             references.insert(j->second);
@@ -94,34 +94,31 @@ void printClosure(const Path & nePath, const StoreExpr & fs)
 #endif
 
 
-void printDotGraph(const PathSet & roots)
+void printDotGraph(const PathGraph & graph, const PathSet & roots)
 {
-    PathSet workList(roots);
-    PathSet doneSet;
-            
+    /* Ids are in lexicographic order, so this visits the paths in
+       the same order as a work list of paths would. */
+    std::set<PathGraph::Id> workList;
+    for (auto & i : roots) workList.insert(graph.id(i));
+    std::vector<bool> done(graph.size(), false);
+
     cout << "digraph G {\n";
 
     while (!workList.empty()) {
-	Path path = *(workList.begin());
-	workList.erase(path);
+        PathGraph::Id id = *workList.begin();
+        workList.erase(workList.begin());
 
-	if (doneSet.find(path) != doneSet.end()) continue;
-        doneSet.insert(path);
+        if (done[id]) continue;
+        done[id] = true;
+        const Path & path = graph.path(id);
 
         cout << makeNode(path, symbolicName(path), "#ff0000");
-        
-        PathSet references;
-        store->queryReferences(path, references);
-
-        for (PathSet::iterator i = references.begin();
-             i != references.end(); ++i)
-        {
-            if (*i != path) {
-                workList.insert(*i);
-                cout << makeEdge(*i, path);
+
+        for (auto & i : graph.references(id))
+            if (i != id) {
+                workList.insert(i);
+                cout << makeEdge(graph.path(i), path);
             }
-        }
-            
 
 #if 0        
 	    StoreExpr ne = storeExprFromPath(path);
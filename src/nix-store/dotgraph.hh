@@ -1,9 +1,9 @@
 #pragma once
 
-#include "types.hh"
+#include "path-graph.hh"
 
 namespace nix {
 
-void printDotGraph(const PathSet & roots);
+void printDotGraph(const PathGraph & graph, const PathSet & roots);
 
 }
@@ -1,5 +1,6 @@
 #include "globals.hh"
 #include "misc.hh"
+#include "path-graph.hh"
 #include "archive.hh"
 #include "shared.hh"
 #include "dotgraph.hh"
@@ -7,12 +8,16 @@
 #include "local-store.hh"
 #include "util.hh"
 #include "serve-protocol.hh"
+#include "compression.hh"
+#include "chunks.hh"
 #include "worker-protocol.hh"
 #include "monitor-fd.hh"
+#include "indexed-log.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstdio>
+#include <climits>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -232,33 +237,38 @@ const string treeLine = "|   ";
 const string treeNull = "    ";
 
 
-static void printTree(const Path & path,
-    const string & firstPad, const string & tailPad, PathSet & done)
+static void printTree(const PathGraph & graph, PathGraph::Id id,
+    const string & firstPad, const string & tailPad, std::vector<bool> & done)
 {
-    if (done.find(path) != done.end()) {
-        cout << format("%1%%2% [...]\n") % firstPad % path;
+    if (done[id]) {
+        cout << format("%1%%2% [...]\n") % firstPad % graph.path(id);
         return;
     }
-    done.insert(path);
+    done[id] = true;
 
-    cout << format("%1%%2%\n") % firstPad % path;
-
-    PathSet references;
-    store->queryReferences(path, references);
+    cout << format("%1%%2%\n") % firstPad % graph.path(id);
 
     /* Topologically sort under the relation A < B iff A \in
        closure(B).  That is, if derivation A is an (possibly indirect)
        input of B, then A is printed first.  This has the effect of
        flattening the tree, preventing deeply nested structures.  */
-    Paths sorted = topoSortPaths(*store, references);
+    PathGraph::Ids sorted = graph.topoSort(graph.references(id));
     reverse(sorted.begin(), sorted.end());
 
-    foreach (Paths::iterator, i, sorted) {
-        Paths::iterator j = i; ++j;
-        printTree(*i, tailPad + treeConn,
-            j == sorted.end() ? tailPad + treeNull : tailPad + treeLine,
+    for (auto i = sorted.begin(); i != sorted.end(); ++i)
+        printTree(graph, *i, tailPad + treeConn,
+            i + 1 == sorted.end() ? tailPad + treeNull : tailPad + treeLine,
             done);
-    }
+}
+
+
+/* Print `paths' with references coming before their referrers. */
+static void printSorted(const PathSet & paths)
+{
+    PathGraph graph(*store, paths);
+    PathGraph::Ids sorted = graph.topoSort();
+    for (auto i = sorted.rbegin(); i != sorted.rend(); ++i)
+        cout << format("%s\n") % graph.path(*i);
 }
 
 
@@ -268,7 +278,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
     enum QueryType
         { qDefault, qOutputs, qRequisites, qReferences, qReferrers
         , qReferrersClosure, qDeriver, qBinding, qHash, qSize
-        , qTree, qGraph, qXml, qResolve, qRoots };
+        , qTree, qGraph, qXml, qResolve, qRoots, qBuildStats };
     QueryType query = qDefault;
     bool useOutput = false;
     bool includeOutputs = false;
@@ -297,6 +307,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
         else if (*i == "--xml") query = qXml;
         else if (*i == "--resolve") query = qResolve;
         else if (*i == "--roots") query = qRoots;
+        else if (*i == "--build-stats") query = qBuildStats;
         else if (*i == "--use-output" || *i == "-u") useOutput = true;
         else if (*i == "--force-realise" || *i == "--force-realize" || *i == "-f") forceRealise = true;
         else if (*i == "--include-outputs") includeOutputs = true;
@@ -326,20 +337,18 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet roots, paths;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, ps) {
-                    if (query == qRequisites) computeFSClosure(*store, *j, paths, false, includeOutputs);
-                    else if (query == qReferences) store->queryReferences(*j, paths);
-                    else if (query == qReferrers) store->queryReferrers(*j, paths);
-                    else if (query == qReferrersClosure) computeFSClosure(*store, *j, paths, true);
-                }
+                roots.insert(ps.begin(), ps.end());
+            }
+            if (query == qRequisites) computeFSClosure(*store, roots, paths, false, includeOutputs);
+            else if (query == qReferrersClosure) computeFSClosure(*store, roots, paths, true);
+            else foreach (PathSet::iterator, i, roots) {
+                if (query == qReferences) store->queryReferences(*i, paths);
+                else if (query == qReferrers) store->queryReferrers(*i, paths);
             }
-            Paths sorted = topoSortPaths(*store, paths);
-            for (Paths::reverse_iterator i = sorted.rbegin();
-                 i != sorted.rend(); ++i)
-                cout << format("%s\n") % *i;
+            printSorted(paths);
             break;
         }
 
@@ -379,29 +388,31 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
 
         case qTree: {
-            PathSet done;
+            Paths roots;
             foreach (Strings::iterator, i, opArgs)
-                printTree(followLinksToStorePath(*i), "", "", done);
-            break;
-        }
-
-        case qGraph: {
-            PathSet roots;
-            foreach (Strings::iterator, i, opArgs) {
-                PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                roots.insert(paths.begin(), paths.end());
-            }
-            printDotGraph(roots);
+                roots.push_back(followLinksToStorePath(*i));
+            PathSet closure;
+            computeFSClosure(*store, PathSet(roots.begin(), roots.end()), closure);
+            PathGraph graph(*store, closure);
+            std::vector<bool> done(graph.size(), false);
+            foreach (Paths::iterator, i, roots)
+                printTree(graph, graph.id(*i), "", "", done);
             break;
         }
 
+        case qGraph:
         case qXml: {
-            PathSet roots;
+            PathSet roots, closure;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
                 roots.insert(paths.begin(), paths.end());
             }
-            printXmlGraph(roots);
+            computeFSClosure(*store, roots, closure);
+            PathGraph graph(*store, closure);
+            if (query == qGraph)
+                printDotGraph(graph, roots);
+            else
+                printXmlGraph(graph, roots);
             break;
         }
 
@@ -412,13 +423,13 @@ static void opQuery(Strings opFlags, Strings opArgs)
         }
 
         case qRoots: {
-            PathSet referrers;
+            PathSet paths, referrers;
             foreach (Strings::iterator, i, opArgs) {
-                PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, paths)
-                    computeFSClosure(*store, *j, referrers, true,
-                        settings.gcKeepOutputs, settings.gcKeepDerivations);
+                PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
+                paths.insert(ps.begin(), ps.end());
             }
+            computeFSClosure(*store, paths, referrers, true,
+                settings.gcKeepOutputs, settings.gcKeepDerivations);
             Roots roots = store->findRoots();
             foreach (Roots::iterator, i, roots)
                 if (referrers.find(i->second) != referrers.end())
@@ -426,6 +437,17 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
         }
 
+        case qBuildStats:
+            foreach (Strings::iterator, i, opArgs) {
+                Path path = useDeriver(followLinksToStorePath(*i));
+                std::vector<BuildStats> builds = store->queryBuildStats(path);
+                for (auto & j : builds)
+                    cout << format("%1% %2% %3% %4%\n")
+                        % path % j.startTime % (j.succeeded ? "succeeded" : "failed")
+                        % showBuildStats(j);
+            }
+            break;
+
         default:
             abort();
     }
@@ -465,9 +487,82 @@ static void opPrintEnv(Strings opFlags, Strings opArgs)
 }
 
 
+/* Return the offset in `s' of the first of its last `lines' lines.  A
+   trailing newline doesn't start another line. */
+static size_t tailStart(const string & s, unsigned int lines)
+{
+    size_t pos = s.size();
+    if (pos && s[pos - 1] == '\n') pos--;
+    while (pos) {
+        size_t nl = s.rfind('\n', pos - 1);
+        if (nl == string::npos) break;
+        if (--lines == 0) return nl + 1;
+        pos = nl;
+    }
+    return 0;
+}
+
+
+/* Sink that passes on only part of a sequentially produced log: the
+   bytes in [offset, offset + length), or the last `tail' lines. */
+struct LogFilterSink : Sink
+{
+    Sink & next;
+    unsigned long long offset, length, pos;
+    unsigned int tail;
+    string buffer;
+
+    LogFilterSink(Sink & next, unsigned long long offset, unsigned long long length, unsigned int tail)
+        : next(next), offset(offset), length(length), pos(0), tail(tail) { }
+
+    void operator () (const unsigned char * data, size_t len)
+    {
+        if (tail) {
+            buffer.append((const char *) data, len);
+            if (buffer.size() > 1024 * 1024)
+                buffer.erase(0, tailStart(buffer, tail));
+            return;
+        }
+
+        unsigned long long end = pos + len;
+        unsigned long long from = std::max(pos, offset);
+        unsigned long long to = std::min(end, length == ULLONG_MAX ? end : offset + length);
+        if (from < to) next(data + (from - pos), to - from);
+        pos = end;
+    }
+
+    /* Whether the rest of the log is not needed. */
+    bool done()
+    {
+        return !tail && length != ULLONG_MAX && pos >= offset + length;
+    }
+
+    void finish()
+    {
+        if (tail)
+            next((const unsigned char *) buffer.data() + tailStart(buffer, tail),
+                buffer.size() - tailStart(buffer, tail));
+    }
+};
+
+
 static void opReadLog(Strings opFlags, Strings opArgs)
 {
-    if (!opFlags.empty()) throw UsageError("unknown flag");
+    unsigned long long offset = 0, length = ULLONG_MAX;
+    unsigned int tail = 0;
+
+    for (Strings::iterator i = opFlags.begin(); i != opFlags.end(); ++i)
+        if (*i == "--tail") {
+            ++i;
+            if (i == opFlags.end() || !string2Int(*i, tail))
+                throw UsageError("‘--tail’ requires a numeric argument");
+        }
+        else if (*i == "--offset") offset = getIntArg<unsigned long long>(*i, i, opFlags.end(), true);
+        else if (*i == "--length") length = getIntArg<unsigned long long>(*i, i, opFlags.end(), true);
+        else throw UsageError(format("unknown flag ‘%1%’") % *i);
+
+    if (tail && (offset != 0 || length != ULLONG_MAX))
+        throw UsageError("‘--tail’ cannot be combined with ‘--offset’ or ‘--length’");
 
     RunPager pager;
 
@@ -477,6 +572,9 @@ static void opReadLog(Strings opFlags, Strings opArgs)
         string baseName = baseNameOf(path);
         bool found = false;
 
+        FdSink out(STDOUT_FILENO);
+        LogFilterSink filter(out, offset, length, tail);
+
         for (int j = 0; j < 2; j++) {
 
             Path logPath =
@@ -484,11 +582,38 @@ static void opReadLog(Strings opFlags, Strings opArgs)
                 ? (format("%1%/%2%/%3%/%4%") % settings.nixLogDir % drvsLogDir % string(baseName, 0, 2) % string(baseName, 2)).str()
                 : (format("%1%/%2%/%3%") % settings.nixLogDir % drvsLogDir % baseName).str();
             Path logBz2Path = logPath + ".bz2";
+            Path logIndexedPath = logPath + indexedLogSuffix;
+
+            if (pathExists(logIndexedPath)) {
+                /* Only decompress the blocks we need. */
+                IndexedLogReader log(logIndexedPath);
+                unsigned long long start = tail ? log.tailOffset(tail) : offset;
+                unsigned long long end = length > log.size() - std::min(start, log.size())
+                    ? log.size() : start + length;
+                log.read(start, end, out);
+                found = true;
+                break;
+            }
 
-            if (pathExists(logPath)) {
-                /* !!! Make this run in O(1) memory. */
-                string log = readFile(logPath);
-                writeFull(STDOUT_FILENO, (const unsigned char *) log.data(), log.size());
+            else if (pathExists(logPath)) {
+                AutoCloseFD fd = open(logPath.c_str(), O_RDONLY);
+                if (fd == -1) throw SysError(format("opening file ‘%1%’") % logPath);
+                if (!tail && offset) {
+                    if (lseek(fd, offset, SEEK_SET) == -1)
+                        throw SysError(format("seeking in ‘%1%’") % logPath);
+                    filter.pos = offset;
+                }
+                unsigned char buf[128 * 1024];
+                ssize_t n;
+                while ((n = read(fd, buf, sizeof(buf))) != 0) {
+                    checkInterrupt();
+                    if (n == -1) {
+                        if (errno == EINTR) continue;
+                        throw SysError(format("reading file ‘%1%’") % logPath);
+                    }
+                    filter(buf, n);
+                    if (filter.done()) break;
+                }
                 found = true;
                 break;
             }
@@ -506,8 +631,8 @@ static void opReadLog(Strings opFlags, Strings opArgs)
                     int n = BZ2_bzRead(&err, bz, buf, sizeof(buf));
                     if (err != BZ_OK && err != BZ_STREAM_END)
                         throw Error(format("error reading bzip2 file ‘%1%’") % logBz2Path);
-                    writeFull(STDOUT_FILENO, buf, n);
-                } while (err != BZ_STREAM_END);
+                    filter(buf, n);
+                } while (err != BZ_STREAM_END && !filter.done());
                 BZ2_bzReadClose(&err, bz);
                 found = true;
                 break;
@@ -522,7 +647,7 @@ static void opReadLog(Strings opFlags, Strings opArgs)
                 try {
                     string log = runProgram(CURL, true, {"--fail", "--location", "--silent", "--", url});
                     std::cout << "(using build log from " << url << ")" << std::endl;
-                    std::cout << log;
+                    filter((const unsigned char *) log.data(), log.size());
                     found = true;
                     break;
                 } catch (ExecError & e) {
@@ -533,6 +658,9 @@ static void opReadLog(Strings opFlags, Strings opArgs)
         }
 
         if (!found) throw Error(format("build log of derivation ‘%1%’ is not available") % path);
+
+        filter.finish();
+        out.flush();
     }
 }
 
@@ -859,6 +987,52 @@ static void opClearFailedPaths(Strings opFlags, Strings opArgs)
 }
 
 
+/* Order `infos' for sending such that each path comes after its
+   references.  Among the paths whose references have been sent,
+   alternate between the smallest and the largest, so that the
+   receiver gets to register paths regularly instead of waiting for a
+   run of large paths, while the large ones aren't all left until the
+   end. */
+static ValidPathInfos planTransfer(const ValidPathInfos & infos)
+{
+    std::map<Path, const ValidPathInfo *> byPath;
+    for (auto & info : infos) byPath[info.path] = &info;
+
+    std::map<Path, unsigned int> refsLeft;
+    std::map<Path, Paths> referrers;
+    std::set<std::pair<unsigned long long, Path> > ready;
+
+    for (auto & info : infos) {
+        unsigned int n = 0;
+        for (auto & ref : info.references)
+            if (ref != info.path && byPath.find(ref) != byPath.end()) {
+                referrers[ref].push_back(info.path);
+                n++;
+            }
+        refsLeft[info.path] = n;
+        if (n == 0) ready.insert(std::make_pair(info.narSize, info.path));
+    }
+
+    ValidPathInfos res;
+    bool smallest = true;
+    while (!ready.empty()) {
+        auto i = smallest ? ready.begin() : --ready.end();
+        smallest = !smallest;
+        Path path = i->second;
+        ready.erase(i);
+        res.push_back(*byPath[path]);
+        for (auto & referrer : referrers[path])
+            if (--refsLeft[referrer] == 0)
+                ready.insert(std::make_pair(byPath[referrer]->narSize, referrer));
+    }
+
+    if (res.size() != infos.size())
+        throw Error("cycle detected in the references of the paths to be sent");
+
+    return res;
+}
+
+
 /* Serve the nix store in a way usable by a restricted ssh user. */
 static void opServe(Strings opFlags, Strings opArgs)
 {
@@ -880,6 +1054,10 @@ static void opServe(Strings opFlags, Strings opArgs)
     out.flush();
     readInt(in); // Client version, unused for now
 
+    /* Codec used for the data of cmdImportPaths and cmdExportPaths,
+       as negotiated by cmdSetCompression. */
+    Codec codec = codecNone;
+
     while (true) {
         ServeCommand cmd;
         try {
@@ -895,8 +1073,7 @@ static void opServe(Strings opFlags, Strings opArgs)
                 bool substitute = readInt(in);
                 PathSet paths = readStorePaths<PathSet>(in);
                 if (lock && writeAllowed)
-                    for (auto & path : paths)
-                        store->addTempRoot(path);
+                    store->addTempRoots(paths);
 
                 /* If requested, substitute missing paths. This
                    implements nix-copy-closure's --use-substitutes
@@ -926,11 +1103,7 @@ static void opServe(Strings opFlags, Strings opArgs)
 
             case cmdQueryPathInfos: {
                 PathSet paths = readStorePaths<PathSet>(in);
-                // !!! Maybe we want a queryPathInfos?
-                foreach (PathSet::iterator, i, paths) {
-                    if (!store->isValidPath(*i))
-                        continue;
-                    ValidPathInfo info = store->queryPathInfo(*i);
+                for (auto & info : store->queryPathInfos(paths)) {
                     writeString(info.path, out);
                     writeString(info.deriver, out);
                     writeStrings(info.references, out);
@@ -948,16 +1121,83 @@ static void opServe(Strings opFlags, Strings opArgs)
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
-                store->importPaths(false, in);
+                if (codec == codecNone)
+                    store->importPaths(false, in);
+                else {
+                    DecompressionSource source(in, codec);
+                    store->importPaths(false, source);
+                    source.finish();
+                }
                 writeInt(1, out); // indicate success
                 break;
             }
 
-            case cmdExportPaths: {
+            case cmdExportPaths:
+            case cmdExportPathsOrdered: {
                 bool sign = readInt(in);
-                Paths sorted = topoSortPaths(*store, readStorePaths<PathSet>(in));
-                reverse(sorted.begin(), sorted.end());
-                exportPaths(*store, sorted, sign, out);
+                Paths sorted;
+                if (cmd == cmdExportPaths) {
+                    sorted = topoSortPaths(*store, readStorePaths<PathSet>(in));
+                    reverse(sorted.begin(), sorted.end());
+                } else
+                    sorted = readStorePaths<Paths>(in);
+                if (codec == codecNone)
+                    exportPaths(*store, sorted, sign, out);
+                else {
+                    CompressionSink sink(out, codec);
+                    exportPaths(*store, sorted, sign, sink);
+                    sink.finish();
+                }
+                break;
+            }
+
+            case cmdExportPathsChunked:
+            case cmdDumpStorePathChunked: {
+                /* Like cmdExportPathsOrdered and cmdDumpStorePath, but
+                   send the data as a chunk stream in which the chunks
+                   that the client says it has are replaced by their
+                   hashes. */
+                bool sign = false;
+                Paths paths;
+                if (cmd == cmdExportPathsChunked) {
+                    sign = readInt(in);
+                    paths = readStorePaths<Paths>(in);
+                } else
+                    paths.push_back(readStorePath(in));
+                ChunkHashes known = unpackChunkHashes(readString(in));
+                auto send = [&](Sink & sink) {
+                    ChunkEncoder encoder(sink, known);
+                    if (cmd == cmdExportPathsChunked)
+                        exportPaths(*store, paths, sign, encoder);
+                    else
+                        dumpPath(paths.front(), encoder);
+                    encoder.finish();
+                };
+                if (codec == codecNone)
+                    send(out);
+                else {
+                    CompressionSink sink(out, codec);
+                    send(sink);
+                    sink.finish();
+                }
+                break;
+            }
+
+            case cmdQueryExportManifest: {
+                /* Return the NAR hash, size and references of the
+                   given paths, in an order suitable for
+                   cmdExportPathsOrdered, so that the client can
+                   decide what it really needs. */
+                PathSet paths = readStorePaths<PathSet>(in);
+                ValidPathInfos infos = planTransfer(store->queryPathInfos(paths));
+                writeInt(infos.size(), out);
+                for (auto & info : infos) {
+                    writeString(info.path, out);
+                    writeString(info.deriver, out);
+                    writeStrings(info.references, out);
+                    writeString(printHashType(info.hash.type) + ":" + printHash(info.hash), out);
+                    writeLongLong(info.narSize, out);
+                }
                 break;
             }
 
@@ -997,6 +1237,16 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
+            case cmdSetCompression: {
+                /* Pick the first codec offered by the client that we
+                   support. */
+                codec = codecNone;
+                for (auto & name : readStrings<Strings>(in))
+                    if ((codec = parseCodec(name)) != codecNone) break;
+                writeString(codec == codecNone ? "" : codecName(codec), out);
+                break;
+            }
+
             default:
                 throw Error(format("unknown serve command %1%") % cmd);
         }
@@ -1082,7 +1332,8 @@ int main(int argc, char * * argv)
                 op = opServe;
             else if (*arg != "" && arg->at(0) == '-') {
                 opFlags.push_back(*arg);
-                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime") /* !!! hack */
+                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime" ||
+                    *arg == "--tail" || *arg == "--offset" || *arg == "--length") /* !!! hack */
                     opFlags.push_back(getArg(*arg, arg, end));
             }
             else
@@ -33,35 +33,30 @@ static string makeNode(const string & id)
 }
 
 
-void printXmlGraph(const PathSet & roots)
+void printXmlGraph(const PathGraph & graph, const PathSet & roots)
 {
-    PathSet workList(roots);
-    PathSet doneSet;
+    std::set<PathGraph::Id> workList;
+    for (auto & i : roots) workList.insert(graph.id(i));
+    std::vector<bool> done(graph.size(), false);
 
     cout << "<?xml version='1.0' encoding='utf-8'?>\n"
 	 << "<nix>\n";
 
     while (!workList.empty()) {
-	Path path = *(workList.begin());
-	workList.erase(path);
+	PathGraph::Id id = *workList.begin();
+	workList.erase(workList.begin());
 
-	if (doneSet.find(path) != doneSet.end()) continue;
-	doneSet.insert(path);
+	if (done[id]) continue;
+	done[id] = true;
+	const Path & path = graph.path(id);
 
 	cout << makeNode(path);
 
-	PathSet references;
-	store->queryReferences(path, references);
-
-	for (PathSet::iterator i = references.begin();
-	     i != references.end(); ++i)
-	{
-	    if (*i != path) {
-		workList.insert(*i);
-		cout << makeEdge(*i, path);
+	for (auto & i : graph.references(id))
+	    if (i != id) {
+		workList.insert(i);
+		cout << makeEdge(graph.path(i), path);
 	    }
-	}
-
     }
 
     cout << "</nix>\n";
@@ -1,9 +1,9 @@
 #pragma once
 
-#include "types.hh"
+#include "path-graph.hh"
 
 namespace nix {
 
-void printXmlGraph(const PathSet & roots);
+void printXmlGraph(const PathGraph & graph, const PathSet & roots);
 
 }
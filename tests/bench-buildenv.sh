@@ -0,0 +1,37 @@
+# Benchmark for building user environments: install a large number of
+# synthetic packages into a profile at once.  This is not run by
+# ‘make installcheck’; run it by hand from the tests directory, e.g.
+#
+#   NR_PACKAGES=1000 bash bench-buildenv.sh
+
+source common.sh
+
+clearStore
+clearProfiles
+
+n=${NR_PACKAGES:-1000}
+
+# Each package has some files of its own in directories that it
+# shares with all other packages, which is the expensive case.
+cat > $TEST_ROOT/bench-builder.sh <<'EOF2'
+mkdir -p $out/bin $out/lib/perl5/site_perl $out/share/man/man1
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    echo > $out/lib/perl5/site_perl/$name-$i.pm
+done
+echo > $out/bin/$name
+echo > $out/share/man/man1/$name.1
+EOF2
+
+expr=$TEST_ROOT/bench-buildenv.nix
+echo "with import $(pwd)/config.nix; [" > $expr
+for i in $(seq 1 $n); do
+    echo "(mkDerivation { name = \"bench-$i\"; builder = $TEST_ROOT/bench-builder.sh; })" >> $expr
+done
+echo "]" >> $expr
+
+nix-build $expr --no-out-link > /dev/null
+
+echo "installing $n packages..."
+time nix-env -p $profiles/bench -f $expr -i '*' > /dev/null
+
+[ "$(ls $profiles/bench/bin | wc -l)" = $n ]
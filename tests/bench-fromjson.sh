@@ -0,0 +1,43 @@
+# Benchmark for builtins.fromJSON: parse a large lockfile-like JSON
+# document.  This is not run by ‘make installcheck’; run it by hand
+# from the tests directory, e.g.
+#
+#   NR_PACKAGES=200000 bash bench-fromjson.sh
+#
+# To compare with another version of Nix, set NIX_BASELINE_BIN to the
+# directory containing its ‘nix-instantiate’.
+
+source common.sh
+
+n=${NR_PACKAGES:-100000}
+
+json=$TEST_ROOT/bench-fromjson.json
+
+awk -v n=$n 'BEGIN {
+    printf "{\n  \"lockfileVersion\": 1,\n  \"packages\": {\n";
+    for (i = 0; i < n; i++) {
+        printf "    \"pkg-%d\": {\n", i;
+        printf "      \"name\": \"package-%d\",\n", i;
+        printf "      \"version\": \"%d.%d.%d\",\n", i % 7, i % 13, i % 3;
+        printf "      \"resolved\": \"https://registry.example.org/pkg-%d/-/pkg-%d-1.0.tgz\",\n", i, i;
+        printf "      \"integrity\": \"sha512-%040d%046d\",\n", i * 7919, i;
+        printf "      \"dependencies\": { \"dep-%d\": \"^1.0\", \"dep-%d\": \"^2.1\", \"dep-%d\": \"~0.3\" },\n", i % 1000, (i * 3) % 1000, (i * 7) % 1000;
+        printf "      \"dev\": %s,\n", i % 2 ? "true" : "false";
+        printf "      \"size\": %d,\n", i * 37;
+        printf "      \"description\": \"Line one\\nLine \\\"two\\\"\\twith a tab\"\n";
+        printf "    }%s\n", i < n - 1 ? "," : "";
+    }
+    printf "  }\n}\n";
+}' > $json
+
+expr="let x = builtins.fromJSON (builtins.readFile $json); in builtins.length (builtins.attrNames x.packages)"
+
+echo "parsing $(du -h $json | cut -f1) of JSON..."
+time res=$(nix-instantiate --eval -E "$expr")
+[ "$res" = $n ]
+
+if [ -n "$NIX_BASELINE_BIN" ]; then
+    echo "same with $NIX_BASELINE_BIN/nix-instantiate..."
+    time res=$($NIX_BASELINE_BIN/nix-instantiate --eval -E "$expr")
+    [ "$res" = $n ]
+fi
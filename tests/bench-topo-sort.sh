@@ -0,0 +1,57 @@
+# Benchmark for topoSortPaths(): export synthetic closures that are
+# very deep (a chain) or very wide (one root referring to everything).
+# This is not run by ‘make installcheck’; run it by hand from the
+# tests directory, e.g.
+#
+#   NR_PATHS=20000 bash bench-topo-sort.sh
+#
+# The paths are passed on the command line, so NR_PATHS is limited by
+# the maximum argument size.  To compare with another version of Nix,
+# set NIX_BASELINE_BIN to the directory containing its ‘nix-store’.
+
+source common.sh
+
+clearStore
+
+n=${NR_PATHS:-20000}
+
+# Create $n empty store paths with made-up hashes and register them.
+# `shape' is "deep" or "wide".
+makeGraph() {
+    local shape=$1
+    awk -v n=$n -v store=$NIX_STORE_DIR -v shape=$shape '
+    function name(i,  h, j, x) {
+        h = ""; x = i + 1;
+        for (j = 0; j < 32; j++) { h = h substr(chars, x % 32 + 1, 1); x = int(x / 32) + j * 7; }
+        return store "/" h "-" shape "-" i;
+    }
+    BEGIN {
+        chars = "0123456789abcdfghijklmnpqrsvwxyz";
+        for (i = 0; i < n; i++) {
+            print name(i) > "/dev/stderr";
+            print name(i); print "";
+            if (shape == "deep") {
+                if (i + 1 < n) { print 1; print name(i + 1); } else print 0;
+            } else {
+                if (i == 0) { print n - 1; for (j = 1; j < n; j++) print name(j); } else print 0;
+            }
+        }
+    }' > $TEST_ROOT/bench-$shape.reg 2> $TEST_ROOT/bench-$shape.paths
+    xargs touch < $TEST_ROOT/bench-$shape.paths
+    nix-store --register-validity < $TEST_ROOT/bench-$shape.reg
+}
+
+for shape in deep wide; do
+    makeGraph $shape
+    paths=$(cat $TEST_ROOT/bench-$shape.paths)
+
+    echo "exporting $n paths ($shape)..."
+    time nix-store --export $paths > $TEST_ROOT/bench-$shape.nar 2> /dev/null
+    [ "$(nix-store --import < $TEST_ROOT/bench-$shape.nar 2> /dev/null | wc -l)" = $n ]
+
+    if [ -n "$NIX_BASELINE_BIN" ]; then
+        echo "same with $NIX_BASELINE_BIN/nix-store..."
+        time $NIX_BASELINE_BIN/nix-store --export $paths > /dev/null 2> $TEST_ROOT/bench.log \
+            || tail -1 $TEST_ROOT/bench.log
+    fi
+done
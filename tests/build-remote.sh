@@ -0,0 +1,28 @@
+source common.sh
+
+clearStore
+
+# Use the native build hook with the special machine ‘local’, which
+# does the "remote" builds through ‘nix-store --serve’ on this
+# machine.
+export NIX_BUILD_HOOK=build-remote
+export NIX_CURRENT_LOAD=$TEST_ROOT/current-load
+export NIX_REMOTE_SYSTEMS=$TEST_ROOT/machines
+rm -rf $NIX_CURRENT_LOAD
+echo "local $system - 2 1" > $NIX_REMOTE_SYSTEMS
+
+# With ‘--max-jobs 0’, every build has to go through the hook.
+outPath=$(nix-build dependencies.nix --no-out-link --max-jobs 0)
+
+echo "output path is $outPath"
+
+text=$(cat "$outPath"/foobar)
+if test "$text" != "FOOBAR"; then exit 1; fi
+
+# The hook claimed slots on the machine.
+test -e $NIX_CURRENT_LOAD/$system-local-0
+
+# A machine that doesn't support the required platform is not used.
+clearStore
+echo "local foo-bar - 2 1" > $NIX_REMOTE_SYSTEMS
+(! nix-build dependencies.nix --no-out-link --max-jobs 0)
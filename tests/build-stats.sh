@@ -0,0 +1,21 @@
+source common.sh
+
+clearStore
+
+opts="--option build-record-stats true --print-build-trace"
+
+# A successful build should print and record its resource usage.
+log=$(nix-build $opts negative-caching.nix -A succeed --no-out-link 2>&1)
+echo "$log" | grep -q "@ build-stats .*-succeed.drv wall=[0-9]* user=" || fail "no build-stats trace"
+
+drvPath=$(nix-instantiate negative-caching.nix -A succeed)
+outPath=$(nix-store -q --outputs $drvPath)
+nix-store -q --build-stats $drvPath | grep -q "^$drvPath [0-9]* succeeded wall=" || fail "build not recorded"
+
+# Outputs are mapped to their deriver.
+[ "$(nix-store -q --build-stats $outPath)" = "$(nix-store -q --build-stats $drvPath)" ]
+
+# Failed builds are recorded too.
+nix-build $opts negative-caching.nix -A fail --no-out-link 2> /dev/null && fail "should fail"
+drvPath=$(nix-instantiate negative-caching.nix -A fail)
+nix-store -q --build-stats $drvPath | grep -q "^$drvPath [0-9]* failed wall=" || fail "failure not recorded"
@@ -0,0 +1,14 @@
+with import ./config.nix;
+
+{ seed }:
+
+mkDerivation {
+  name = "chroot-procs";
+  inherit seed;
+  builder = builtins.toFile "builder.sh"
+    ''
+      mkdir $out
+      for i in /proc/[0-9]*; do echo $i; done > $out/procs
+      cat /proc/1/cmdline | tr '\0' ' ' > $out/init
+    '';
+}
@@ -0,0 +1,35 @@
+# Test that chroot builds get their own /proc, showing only the
+# build's own processes.
+
+source common.sh
+
+case $system in
+    *linux*)
+        ;;
+    *)
+        exit 0;
+esac
+
+if [ "$(id -u)" != 0 ]; then exit 0; fi
+
+clearStore
+
+dirs=
+for i in /bin /usr /lib /lib64 $NIX_STORE_DIR; do
+    if [ -e $i ]; then dirs="$dirs $i"; fi
+done
+
+for template in false true; do
+    outPath=$(nix-build chroot.nix --no-out-link \
+        --argstr seed "$template-$RANDOM" \
+        --option build-use-chroot true \
+        --option build-chroot-dirs "$dirs" \
+        --option build-chroot-template $template)
+
+    # The builder is PID 1 of its own PID namespace.
+    grep -q "builder.sh" $outPath/init || fail "builder is not PID 1 (template $template)"
+
+    # Only the builder itself, and perhaps a child it forked.
+    nrProcs=$(cat $outPath/procs | wc -l)
+    [ $nrProcs -le 4 ] || fail "build sees $nrProcs processes (template $template)"
+done
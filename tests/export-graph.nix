@@ -26,4 +26,11 @@ rec {
     exportReferencesGraph = ["refs" (import ./dependencies.nix).drvPath];
   };
 
+  foo."bar.runtimeGraphJSON" = mkDerivation {
+    name = "dependencies-json";
+    builder = builtins.toFile "build-graph-builder" "cp refs $out";
+    exportReferencesGraph = ["refs" (import ./dependencies.nix)];
+    exportReferencesGraphFormat = "json";
+  };
+
 }
@@ -28,3 +28,12 @@ checkRef input-2
 checkRef input-2.drv
 
 for i in $(cat $outPath); do checkRef $i; done
+
+# Test the JSON format.
+
+outPath=$(nix-build ./export-graph.nix -A 'foo."bar.runtimeGraphJSON"' -o $TEST_ROOT/result)
+
+grep -q '"references":\[' $outPath || fail "no references in JSON graph"
+for i in $(nix-store -qR $(nix-build ./dependencies.nix --no-out-link)); do
+    grep -q "\"path\":\"$i\"" $outPath || fail "missing $i in JSON graph"
+done
@@ -0,0 +1,23 @@
+source common.sh
+
+clearStore
+
+# Add some unreachable paths, and pretend that they haven't been used
+# in a long time.
+for i in 1 2 3; do
+    rm -rf $TEST_ROOT/lru-$i
+    mkdir $TEST_ROOT/lru-$i
+    head -c 100000 /dev/urandom > $TEST_ROOT/lru-$i/data
+    path[$i]=$(nix-store --add $TEST_ROOT/lru-$i)
+    touch -a -d 2000-01-0$i ${path[$i]}
+done
+
+# Use the oldest one.
+nix-store -r ${path[1]}
+
+# Freeing a bit more than one path should delete the two least
+# recently used ones.
+nix-store --gc --max-freed 150000
+[ -e ${path[1]} ]
+(! [ -e ${path[2]} ])
+(! [ -e ${path[3]} ])
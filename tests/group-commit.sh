@@ -0,0 +1,21 @@
+source common.sh
+
+clearStore
+
+# Register paths from several processes at the same time, and check
+# that each of them is valid once its registration has returned.
+pids=
+for i in $(seq 1 20); do
+    echo "file $i" > $TEST_ROOT/group-commit-$i
+    nix-store --option group-commit true --option group-commit-window 50 \
+        --add $TEST_ROOT/group-commit-$i > $TEST_ROOT/group-commit-$i.out &
+    pids="$pids $!"
+done
+
+for pid in $pids; do wait $pid; done
+
+for i in $(seq 1 20); do
+    path=$(cat $TEST_ROOT/group-commit-$i.out)
+    nix-store --check-validity $path
+    [ "$(cat $path)" = "file $i" ]
+done
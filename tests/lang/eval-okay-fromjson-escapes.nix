@@ -0,0 +1,8 @@
+# Escapes, empty and nested containers, and duplicate names (the last
+# one wins).
+builtins.fromJSON
+  ''
+    { "a": "x\"y\\z\/\n\t", "b": [ [], {}, [[ {"c": []} ]] ], "d": 1, "d": 2 }
+  ''
+==
+  { a = "x\"y\\z/\n\t"; b = [ [] {} [ [ { c = []; } ] ] ]; d = 2; }
@@ -11,8 +11,9 @@ nix_tests = \
   binary-patching.sh timeout.sh secure-drv-outputs.sh nix-channel.sh \
   multiple-outputs.sh import-derivation.sh fetchurl.sh optimise-store.sh \
   binary-cache.sh nix-profile.sh repair.sh dump-db.sh case-hack.sh \
-  check-reqs.sh
-  # parallel.sh
+  check-reqs.sh group-commit.sh build-remote.sh build-stats.sh \
+  gc-lru.sh chroot.sh
+  # parallel.sh bench-buildenv.sh bench-fromjson.sh bench-topo-sort.sh
 
 install-tests += $(foreach x, $(nix_tests), tests/$(x))
 
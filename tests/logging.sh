@@ -22,3 +22,11 @@ rm -rf $NIX_LOG_DIR
 (! nix-store -l $path)
 nix-build dependencies.nix --no-out-link --option build-compress-log true
 [ "$(nix-store -l $path)" = FOO ]
+
+# Test indexed logs.
+clearStore
+rm -rf $NIX_LOG_DIR
+nix-build dependencies.nix --no-out-link --option build-indexed-log true
+[ "$(nix-store -l $path)" = FOO ]
+[ "$(nix-store -l $path --tail 1)" = FOO ]
+[ "$(nix-store -l $path --offset 1 --length 1)" = O ]
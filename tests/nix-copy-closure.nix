@@ -51,6 +51,20 @@ makeTest (let pkgA = pkgs.aterm; pkgB = pkgs.wget; pkgC = pkgs.hello; in {
       $client->succeed("nix-copy-closure --from server --gzip ${pkgB} >&2");
       $client->succeed("nix-store --check-validity ${pkgB}");
 
+      # Copy it again, this time compressed with bzip2.
+      $client->succeed("nix-store --delete ${pkgB}");
+      $client->succeed("nix-copy-closure --from server --compress bzip2 ${pkgB} >&2");
+      $client->succeed("nix-store --verify-path ${pkgB}");
+
+      # Fetch a new version of a path of which the client has an older
+      # version; most of it should be taken from the local copy.
+      $client->succeed("mkdir /tmp/data-1.0 && head -c 4000000 /dev/urandom > /tmp/data-1.0/big && echo old > /tmp/data-1.0/small");
+      my $old = $client->succeed("nix-store --add /tmp/data-1.0"); chomp $old;
+      $client->succeed("nix-copy-closure --to server $old >&2");
+      my $new = $server->succeed("mkdir /tmp/data-1.1 && cp $old/big /tmp/data-1.1/ && echo new > /tmp/data-1.1/small && nix-store --add /tmp/data-1.1"); chomp $new;
+      $client->succeed("nix-copy-closure --from server $new 2>&1 | tee /dev/stderr | grep -q 'taken from local paths'");
+      $client->succeed("nix-store --verify-path $new");
+
       # Copy the closure of package C via the SSH substituter.
       $client->fail("nix-store -r ${pkgC}");
       $client->succeed(
@@ -16,6 +16,11 @@ outPath10=$(nix-env -f ./user-envs.nix -qa --out-path --no-name '*' | grep foo-1
 drvPath10=$(nix-env -f ./user-envs.nix -qa --drv-path --no-name '*' | grep foo-1.0)
 [ -n "$outPath10" -a -n "$drvPath10" ]
 
+# Query in JSON, with and without streaming.
+nix-env -f ./user-envs.nix -qa --json | grep -q '"name":"foo-1.0"'
+nix-env -f ./user-envs.nix -qa --json --stream | grep -q '"name":"foo-1.0"'
+test "$(nix-env -f ./user-envs.nix -qa --json --stream foo | grep -o '"name":' | wc -l)" -eq 4
+
 # Query descriptions.
 nix-env -f ./user-envs.nix -qa '*' --description | grep -q silly
 rm -f $HOME/.nix-defexpr
@@ -164,3 +169,18 @@ nix-env --set $outPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
 nix-env --set $drvPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
+
+# Modify a profile whose manifest was written by an older version of
+# Nix, which didn't record the ‘outputs’ of each element.
+rm -rf $TEST_ROOT/old-env
+mkdir -p $TEST_ROOT/old-env/bin
+ln -s $outPath10/bin/foo $TEST_ROOT/old-env/bin/foo
+cat > $TEST_ROOT/old-env/manifest.nix <<EOF
+[ { meta = { }; name = "foo-1.0"; outPath = "$outPath10"; system = "$system"; type = "derivation"; } ]
+EOF
+nix-env --set $(nix-store --add $TEST_ROOT/old-env)
+nix-env -q '*' | grep -q foo-1.0
+nix-env -i bar-0.1
+nix-env -q '*' | grep -q foo-1.0
+nix-env -q '*' | grep -q bar-0.1
+[ "$($profiles/test/bin/foo)" = "foo-1.0" ]